@@ -0,0 +1,194 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+#include <csignal>
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <array>
+#include <memory>
+#include <chrono>
+#include <algorithm>
+
+#include <getopt.h>
+
+#include "OpenAL.h"
+#include "Mixer.hpp"
+#include "StealingPool.hpp"
+#include "OutputFormat.hpp"
+#include "Stats.hpp"
+#include "Animator.hpp"
+
+//For ambient installations: plays many files at once, each looped on a
+//source of its own around the listener. Files are given as
+//file[@x,y,z]; those without a position are spread on a circle. With -n
+//the files are repeated until there are that many streams. Streams are
+//decoded by a fixed pool of workers (-w, one per core by default), not
+//by a thread each. Prints the underruns while playing and one line of
+//JSON with the underruns of each stream when it's done or interrupted.
+//With -p the streams circle the listener, moved -a times per second
+
+struct Placed {
+	std::string file;
+	bool positioned;
+	ALfloat x, y, z;
+};
+
+static volatile sig_atomic_t interrupted = 0;
+
+void onInterrupt(int) {
+	interrupted = 1;
+}
+
+Placed parsePlaced(const std::string& arg) {
+	Placed p{ arg, false, 0, 0, 0 };
+	size_t at = arg.rfind( '@' );
+	if( at != std::string::npos &&
+		sscanf( arg.c_str() + at + 1, "%f,%f,%f", &p.x, &p.y, &p.z ) == 3 )
+	{
+		p.file = arg.substr( 0, at );
+		p.positioned = true;
+	}
+	return p;
+}
+
+int usage(char* name) {
+	std::cerr << "Usage: " << name << " [-n|--streams <n>] [-w|--workers <n>] [-l|--latency <ms>] [-b|--buffers <n>] [-r|--radius <m>] [-o|--once] [-s|--stats <file>] [-p|--orbit <s>] [-a|--animate <Hz>] <file[@x,y,z]>..." << std::endl;
+	return EXIT_FAILURE;
+}
+
+int main(int argc, char** argv) {
+	int numStreams = 0;
+	int workers = 0;
+	int latency = 400;
+	int numBuffers = 4;
+	float radius = 5;
+	bool loop = true;
+	double orbitSeconds = 0;
+	double animateHz = 250;
+	std::string statsFile;
+	const struct option options[] = {
+		{ "streams", required_argument, NULL, 'n' },
+		{ "workers", required_argument, NULL, 'w' },
+		{ "latency", required_argument, NULL, 'l' },
+		{ "buffers", required_argument, NULL, 'b' },
+		{ "radius", required_argument, NULL, 'r' },
+		{ "once", no_argument, NULL, 'o' },
+		{ "stats", required_argument, NULL, 's' },
+		{ "orbit", required_argument, NULL, 'p' },
+		{ "animate", required_argument, NULL, 'a' },
+		{ NULL, 0, NULL, 0 }
+	};
+	int opt;
+	while( (opt = getopt_long( argc, argv, "n:w:l:b:r:os:p:a:", options, NULL )) != -1 ) {
+		switch( opt ) {
+			case 'n':
+				numStreams = std::max( 1, atoi( optarg ) );
+				break;
+			case 'w':
+				workers = atoi( optarg );
+				break;
+			case 'l':
+				latency = std::max( 1, atoi( optarg ) );
+				break;
+			case 'b':
+				numBuffers = std::max( 2, atoi( optarg ) );
+				break;
+			case 'r':
+				radius = atof( optarg );
+				break;
+			case 'o':
+				loop = false;
+				break;
+			case 's':
+				statsFile = optarg;
+				break;
+			case 'p':
+				orbitSeconds = std::max( 0.0, atof( optarg ) );
+				break;
+			case 'a':
+				animateHz = std::max( 1.0, atof( optarg ) );
+				break;
+			default:
+				return usage( argv[0] );
+		}
+	}
+	if( optind >= argc ) {
+		return usage( argv[0] );
+	}
+	std::vector<Placed> files;
+	for( int i = optind; i < argc; i++ ) {
+		files.push_back( parsePlaced( argv[i] ) );
+	}
+	if( numStreams <= 0 ) {
+		numStreams = files.size();
+	}
+	
+	std::unique_ptr<Stats> stats;
+	if( !statsFile.empty() ) {
+		stats.reset( new Stats() );
+		stats->startDump( statsFile, 1000 );
+	}
+	
+	//every stream is mono, so OpenAL can position it
+	OpenAL al;
+	al.createContext( numStreams ).makeCurrent();
+	std::array<ALfloat,6> ori{{ 1.0f, 0.0f, 0.0f, 0.0f, 1.0f, 0.0f }};
+	al.getListener().setPosition(0, 0, 0).setVelocity(0, 0, 0).setOrientation(ori);
+	OutputFormat formats( true );
+	
+	//the pool is declared first, so it outlives the mixer's jobs
+	StealingPool pool( workers );
+	Mixer mixer( al, formats, pool, numStreams, numBuffers, (float) latency / numBuffers );
+	mixer.setStats( stats.get() ).setLoop( loop );
+	//quieter as more streams play at once
+	ALfloat gain = 1 / sqrt( numStreams );
+	for( int i = 0; i < numStreams; i++ ) {
+		const Placed& p = files[i % files.size()];
+		if( p.positioned ) {
+			mixer.add( p.file, p.x, p.y, p.z, gain );
+		} else {
+			double a = 2 * M_PI * i / numStreams;
+			mixer.add( p.file, radius * cos( a ), radius * sin( a ), 0, gain );
+		}
+	}
+	
+	//each stream circles the listener, starting where it was placed
+	Animator anim( animateHz );
+	anim.setStats( stats.get() );
+	if( orbitSeconds > 0 ) {
+		for( int i = 0; i < numStreams; i++ ) {
+			std::array<ALfloat,3> p = mixer.stream( i ).source->getPosition();
+			anim.add( *mixer.stream( i ).source, [p, orbitSeconds](double seconds, ALfloat& x, ALfloat& y, ALfloat& z) {
+				double a = 2 * M_PI * seconds / orbitSeconds;
+				x = p[0] * cos( a ) - p[1] * sin( a );
+				y = p[0] * sin( a ) + p[1] * cos( a );
+				z = p[2];
+			});
+		}
+	}
+	anim.start();
+	std::cout << "Playing " << numStreams << " streams on " << pool.size() << " workers." << std::endl;
+	signal( SIGINT, onInterrupt );
+	
+	//wakes up when a buffer of any stream has been played, or for the
+	//status line
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	while( !interrupted && mixer.service() ) {
+		double t = std::chrono::duration<double>( std::chrono::steady_clock::now() - start ).count();
+		printf("\rt = %6.1f s, underruns: %ld, stolen jobs: %ld", t, mixer.underruns(), pool.stolen());
+		fflush(stdout);
+		mixer.wait( 0.1 );
+	}
+	anim.stopAnimating();
+	std::cout << std::endl << mixer.json() << std::endl;
+	if( orbitSeconds > 0 ) {
+		std::cout << anim.json() << std::endl;
+	}
+	
+	if( stats ) {
+		stats->stopDump();
+	}
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,242 @@
+#pragma once
+
+#include <string>
+#include <iostream>
+#include <vector>
+#include <sstream>
+#include <stdexcept>
+#include <cmath>
+#include <cstdio>
+
+#include <unistd.h>
+#include <sys/stat.h>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavutil/channel_layout.h>
+}
+
+//Generates the benchmark corpus: the same tones and noise encoded with
+//each codec the local ffmpeg can encode, at several sample rates. Files
+//already in the corpus directory are reused; codecs or rates the encoder
+//doesn't support are skipped
+
+class Corpus {
+	public:
+		struct Entry {
+			std::string name;	//codec-rate-layout
+			std::string codec;
+			int rate;
+			int channels;
+			std::string path;
+		};
+	
+	private:
+		struct Codec {
+			std::vector<const char*> encoders;	//first one found is used
+			const char* container;
+			const char* ext;
+		};
+		
+		std::string dir;
+		float seconds;
+		
+		void ce(int errnum, std::string msg) {
+			if( errnum < 0 ) {
+				char err[AV_ERROR_MAX_STRING_SIZE];
+				av_strerror(errnum, err, AV_ERROR_MAX_STRING_SIZE);
+				
+				std::stringstream ss;
+				ss << msg << ":" << err;
+				
+				throw std::runtime_error(ss.str());
+			}
+		}
+		
+		static bool exists(const std::string& path) {
+			struct stat st;
+			return stat( path.c_str(), &st ) == 0 && st.st_size > 0;
+		}
+		
+		static bool supportsRate(const AVCodec* codec, int rate) {
+			if( !codec->supported_samplerates ) {
+				return true;
+			}
+			for( const int* r = codec->supported_samplerates; *r; r++ ) {
+				if( *r == rate ) {
+					return true;
+				}
+			}
+			return false;
+		}
+		
+		//a chord of three tones, slowly panned, plus some noise so the
+		//encoders have something to work on
+		static float signal(long i, int channel, int rate) {
+			double t = (double) i / rate;
+			double pan = 0.5 + 0.5 * sin( 2 * M_PI * 0.25 * t );
+			double gain = channel == 0 ? pan : 1 - pan;
+			double s = 0.3 * sin( 2 * M_PI * 220 * t ) + 0.2 * sin( 2 * M_PI * 277.18 * t ) +
+				0.15 * sin( 2 * M_PI * 329.63 * t );
+			uint32_t noise = (uint32_t) (i * 1103515245u + 12345u + channel * 2654435761u);
+			return gain * s + 0.02 * ((noise >> 8) / 8388608.0 - 1);
+		}
+		
+		static void fill(AVFrame* frame, long first, int rate) {
+			enum AVSampleFormat fmt = (enum AVSampleFormat) frame->format;
+			int channels = frame->ch_layout.nb_channels;
+			bool planar = av_sample_fmt_is_planar( fmt );
+			for( int i = 0; i < frame->nb_samples; i++ ) {
+				for( int c = 0; c < channels; c++ ) {
+					float v = signal( first + i, c, rate );
+					int plane = planar ? c : 0;
+					int index = planar ? i : i * channels + c;
+					switch( av_get_packed_sample_fmt( fmt ) ) {
+						case AV_SAMPLE_FMT_S16:
+							((int16_t*) frame->data[plane])[index] = v * 32767;
+							break;
+						case AV_SAMPLE_FMT_S32:
+							((int32_t*) frame->data[plane])[index] = v * 2147483647.0;
+							break;
+						case AV_SAMPLE_FMT_FLT:
+							((float*) frame->data[plane])[index] = v;
+							break;
+						case AV_SAMPLE_FMT_DBL:
+							((double*) frame->data[plane])[index] = v;
+							break;
+						default:
+							throw std::runtime_error("Unsupported encoder sample format");
+					}
+				}
+			}
+		}
+		
+		//sends frame (NULL flushes) and writes the packets it results in
+		void encode(AVFormatContext* oc, AVCodecContext* enc, AVStream* st, AVFrame* frame, AVPacket* pkt) {
+			ce( avcodec_send_frame( enc, frame ), "Couldn't send frame to encoder" );
+			int ret;
+			while( (ret = avcodec_receive_packet( enc, pkt )) >= 0 ) {
+				av_packet_rescale_ts( pkt, enc->time_base, st->time_base );
+				pkt->stream_index = st->index;
+				ce( av_interleaved_write_frame( oc, pkt ), "Couldn't write packet" );
+			}
+			if( ret != AVERROR(EAGAIN) && ret != AVERROR_EOF ) {
+				ce( ret, "Couldn't encode" );
+			}
+		}
+		
+		void write(const AVCodec* codec, const Codec& c, int rate, int channels, const std::string& path) {
+			AVFormatContext* oc = NULL;
+			AVCodecContext* enc = NULL;
+			AVFrame* frame = NULL;
+			AVPacket* pkt = NULL;
+			std::string tmp = path + ".tmp";
+			try {
+				ce( avformat_alloc_output_context2( &oc, NULL, c.container, tmp.c_str() ), "Couldn't create muxer" );
+				enc = avcodec_alloc_context3( codec );
+				enc->sample_rate = rate;
+				av_channel_layout_default( &enc->ch_layout, channels );
+				enc->sample_fmt = codec->sample_fmts ? codec->sample_fmts[0] : AV_SAMPLE_FMT_S16;
+				enc->bit_rate = 64000 * channels;
+				enc->time_base = AVRational{ 1, rate };
+				enc->strict_std_compliance = FF_COMPLIANCE_EXPERIMENTAL;
+				if( oc->oformat->flags & AVFMT_GLOBALHEADER ) {
+					enc->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+				}
+				ce( avcodec_open2( enc, codec, NULL ), "Couldn't open encoder" );
+				
+				AVStream* st = avformat_new_stream( oc, NULL );
+				ce( -(st == NULL), "Couldn't create stream" );
+				ce( avcodec_parameters_from_context( st->codecpar, enc ), "Couldn't copy parameters" );
+				st->time_base = enc->time_base;
+				if( !(oc->oformat->flags & AVFMT_NOFILE) ) {
+					ce( avio_open( &oc->pb, tmp.c_str(), AVIO_FLAG_WRITE ), "Couldn't open " + tmp );
+				}
+				ce( avformat_write_header( oc, NULL ), "Couldn't write header" );
+				
+				frame = av_frame_alloc();
+				pkt = av_packet_alloc();
+				frame->format = enc->sample_fmt;
+				frame->sample_rate = rate;
+				frame->nb_samples = enc->frame_size > 0 ? enc->frame_size : 1024;
+				ce( av_channel_layout_copy( &frame->ch_layout, &enc->ch_layout ), "Couldn't copy layout" );
+				ce( av_frame_get_buffer( frame, 0 ), "Couldn't allocate frame" );
+				
+				long total = (long) (seconds * rate);
+				for( long done = 0; done < total; done += frame->nb_samples ) {
+					ce( av_frame_make_writable( frame ), "Couldn't write to frame" );
+					fill( frame, done, rate );
+					frame->pts = done;
+					encode( oc, enc, st, frame, pkt );
+				}
+				encode( oc, enc, st, NULL, pkt );
+				ce( av_write_trailer( oc ), "Couldn't write trailer" );
+			} catch(const std::runtime_error& e) {
+				unlink( tmp.c_str() );
+				tmp.clear();
+				std::cerr << path << ": " << e.what() << std::endl;
+			}
+			av_frame_free( &frame );
+			av_packet_free( &pkt );
+			avcodec_free_context( &enc );
+			if( oc ) {
+				if( !(oc->oformat->flags & AVFMT_NOFILE) ) {
+					avio_closep( &oc->pb );
+				}
+				avformat_free_context( oc );
+			}
+			if( !tmp.empty() ) {
+				rename( tmp.c_str(), path.c_str() );
+			}
+		}
+	
+	public:
+		Corpus(std::string dir_, float seconds_): dir(dir_), seconds(seconds_) {
+			mkdir( dir.c_str(), 0755 );
+		}
+		
+		std::vector<Entry> generate() {
+			const std::vector<Codec> codecs = {
+				{ { "pcm_s16le" }, "wav", "wav" },
+				{ { "flac" }, "flac", "flac" },
+				{ { "alac" }, "ipod", "m4a" },
+				{ { "libmp3lame" }, "mp3", "mp3" },
+				{ { "aac" }, "adts", "aac" },
+				{ { "libvorbis", "vorbis" }, "ogg", "ogg" },
+				{ { "libopus", "opus" }, "ogg", "opus" }
+			};
+			const int rates[] = { 44100, 48000, 96000 };
+			const int layouts[] = { 1, 2 };
+			
+			std::vector<Entry> entries;
+			for( const Codec& c : codecs ) {
+				const AVCodec* codec = NULL;
+				for( const char* name : c.encoders ) {
+					if( (codec = avcodec_find_encoder_by_name( name )) ) {
+						break;
+					}
+				}
+				if( !codec ) {
+					continue;
+				}
+				for( int rate : rates ) {
+					if( !supportsRate( codec, rate ) ) {
+						continue;
+					}
+					for( int channels : layouts ) {
+						std::stringstream name;
+						name << c.ext << "-" << rate << "-" << (channels == 1 ? "mono" : "stereo");
+						std::string path = dir + "/" + name.str() + "." + c.ext;
+						if( !exists( path ) ) {
+							write( codec, c, rate, channels, path );
+						}
+						if( exists( path ) ) {
+							entries.push_back( Entry{ name.str(), codec->name, rate, channels, path } );
+						}
+					}
+				}
+			}
+			return entries;
+		}
+};
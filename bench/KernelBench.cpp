@@ -0,0 +1,152 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+#include <vector>
+#include <random>
+#include <chrono>
+#include <algorithm>
+
+#include "SampleKernels.hpp"
+
+extern "C" {
+#include <libavutil/channel_layout.h>
+#include <libswresample/swresample.h>
+}
+
+//Checks the SIMD sample kernels against swresample and measures their
+//throughput. For each conversion and instruction set it prints one line:
+//conversion, isa, largest difference to swr and samples per second
+//(per channel); swr's own throughput is printed as isa "swr". Exits with
+//failure if any kernel differs from swr by more than one LSB
+
+struct Case {
+	const char* name;
+	enum AVSampleFormat inFmt;
+	uint64_t inLayout;
+	enum AVSampleFormat outFmt;
+	uint64_t outLayout;
+};
+
+const int samples = 1 << 16;
+const int rate = 48000;
+const double seconds = 0.25;
+
+//runs f until seconds have passed, returns samples per second
+template<typename F>
+double measure(F f) {
+	typedef std::chrono::steady_clock clock;
+	long runs = 0;
+	clock::time_point start = clock::now();
+	std::chrono::duration<double> elapsed;
+	do {
+		f();
+		runs++;
+		elapsed = clock::now() - start;
+	} while( elapsed.count() < seconds );
+	return (double) runs * samples / elapsed.count();
+}
+
+//largest difference between two packed buffers, in LSB for S16
+double difference(enum AVSampleFormat fmt, const std::vector<uint8_t>& a, const std::vector<uint8_t>& b) {
+	double diff = 0;
+	if( fmt == AV_SAMPLE_FMT_S16 ) {
+		const int16_t* x = (const int16_t*) a.data();
+		const int16_t* y = (const int16_t*) b.data();
+		for( size_t i = 0; i < a.size() / 2; i++ ) {
+			diff = std::max( diff, (double) std::abs( x[i] - y[i] ) );
+		}
+	} else {
+		const float* x = (const float*) a.data();
+		const float* y = (const float*) b.data();
+		for( size_t i = 0; i < a.size() / 4; i++ ) {
+			diff = std::max( diff, (double) std::fabs( x[i] - y[i] ) );
+		}
+	}
+	return diff;
+}
+
+int main() {
+	const Case cases[] = {
+		{ "fltp-s16-mono", AV_SAMPLE_FMT_FLTP, AV_CH_LAYOUT_MONO, AV_SAMPLE_FMT_S16, AV_CH_LAYOUT_MONO },
+		{ "fltp-s16-stereo", AV_SAMPLE_FMT_FLTP, AV_CH_LAYOUT_STEREO, AV_SAMPLE_FMT_S16, AV_CH_LAYOUT_STEREO },
+		{ "fltp-flt-stereo", AV_SAMPLE_FMT_FLTP, AV_CH_LAYOUT_STEREO, AV_SAMPLE_FMT_FLT, AV_CH_LAYOUT_STEREO },
+		{ "fltp-stereo-s16-mono", AV_SAMPLE_FMT_FLTP, AV_CH_LAYOUT_STEREO, AV_SAMPLE_FMT_S16, AV_CH_LAYOUT_MONO },
+		{ "fltp-stereo-flt-mono", AV_SAMPLE_FMT_FLTP, AV_CH_LAYOUT_STEREO, AV_SAMPLE_FMT_FLT, AV_CH_LAYOUT_MONO },
+		{ "s16-stereo-s16-mono", AV_SAMPLE_FMT_S16, AV_CH_LAYOUT_STEREO, AV_SAMPLE_FMT_S16, AV_CH_LAYOUT_MONO }
+	};
+	const SampleKernels::Isa isas[] = { SampleKernels::Scalar, SampleKernels::SSE2, SampleKernels::AVX2 };
+
+	//slightly out of range floats, so clipping is checked as well
+	std::mt19937 rng( 42 );
+	std::uniform_real_distribution<float> real( -1.1f, 1.1f );
+	std::uniform_int_distribution<int> integer( -32768, 32767 );
+	std::vector<float> planes[2];
+	std::vector<int16_t> packed( 2 * samples );
+	for( auto& p : planes ) {
+		p.resize( samples );
+		std::generate( p.begin(), p.end(), [&]() { return real( rng ); });
+	}
+	std::generate( packed.begin(), packed.end(), [&]() { return (int16_t) integer( rng ); });
+
+	bool ok = true;
+	printf("conversion\tisa\tmaxdiff\tsamples/s\n");
+	for( const Case& c : cases ) {
+		AVChannelLayout inLayout, outLayout;
+		av_channel_layout_from_mask( &inLayout, c.inLayout );
+		av_channel_layout_from_mask( &outLayout, c.outLayout );
+		const uint8_t* in[2];
+		if( c.inFmt == AV_SAMPLE_FMT_S16 ) {
+			in[0] = (const uint8_t*) packed.data();
+		} else {
+			in[0] = (const uint8_t*) planes[0].data();
+			in[1] = (const uint8_t*) planes[1].data();
+		}
+		size_t outBytes = (size_t) samples * outLayout.nb_channels * av_get_bytes_per_sample( c.outFmt );
+
+		//reference
+		SwrContext* swr = nullptr;
+		swr_alloc_set_opts2( &swr, &outLayout, c.outFmt, rate, &inLayout, c.inFmt, rate, 0, NULL );
+		if( !swr || swr_init( swr ) < 0 ) {
+			fprintf( stderr, "Couldn't init swr for %s\n", c.name );
+			return EXIT_FAILURE;
+		}
+		std::vector<uint8_t> ref( outBytes );
+		auto runSwr = [&]() {
+			uint8_t* out = ref.data();
+			swr_convert( swr, &out, samples, in, samples );
+		};
+		runSwr();
+		printf("%s\tswr\t0\t%.0f\n", c.name, measure( runSwr ));
+		swr_free( &swr );
+
+		for( SampleKernels::Isa isa : isas ) {
+			if( !SampleKernels::supported( isa ) ) {
+				continue;
+			}
+			SampleKernels::Kernel kernel = SampleKernels::find( c.inFmt, inLayout.nb_channels,
+				c.outFmt, outLayout.nb_channels, isa );
+			if( !kernel ) {
+				fprintf( stderr, "No kernel for %s\n", c.name );
+				ok = false;
+				continue;
+			}
+			std::vector<uint8_t> out( outBytes );
+			auto runKernel = [&]() {
+				kernel( in, inLayout.nb_channels, samples, out.data() );
+			};
+			runKernel();
+			double diff = difference( c.outFmt, ref, out );
+			double tolerance = c.outFmt == AV_SAMPLE_FMT_S16 ? 1 : 1e-6;
+			if( diff > tolerance ) {
+				ok = false;
+			}
+			printf("%s\t%s\t%g\t%.0f\n", c.name, SampleKernels::name( isa ), diff, measure( runKernel ));
+		}
+	}
+
+	if( !ok ) {
+		fprintf( stderr, "Kernels differ from swresample\n" );
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
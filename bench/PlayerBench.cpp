@@ -0,0 +1,384 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cerrno>
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <fstream>
+#include <vector>
+#include <string>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+
+#include <getopt.h>
+#include <malloc.h>
+#include <sys/resource.h>
+
+#include "OpenAL.h"
+#include "Loader.hpp"
+#include "RingBuffer.hpp"
+#include "OutputFormat.hpp"
+#include "Corpus.hpp"
+
+//Headless benchmark of the playback path: Loader, Converter and the
+//OpenAL wrappers play each file of a generated corpus through an
+//ALC_SOFT_loopback device, which is rendered as fast as possible instead
+//of in real time. Prints one JSON object per scenario:
+//	rt_factor		seconds of audio played per second of wall time
+//	decode_mb_s		PCM the loader produced per second it spent on it
+//	allocs_per_s	heap allocations (malloc & co, all threads) per second
+//	peak_rss_kb		peak resident set size while the scenario ran
+//	read_syscalls	read-like syscalls of the process (/proc/self/io)
+//	major_faults	page faults that waited for I/O, minor_faults the others
+//Each scenario is played with files read through avio's file protocol
+//("io": "read") and from a mapping ("io": "mmap"), unless --io says which,
+//and with each decoder thread count of --codec-threads ("codec_threads",
+//0 is the automatic policy; 1,0 by default), so decode_mb_s shows what
+//threaded decoding gains. Each is also played with every profile of
+//--resampler (native,fast,default,high by default): "native" leaves
+//the resampling to OpenAL, the others resample to the device rate once
+//in the Converter ("engine" says which library did it).
+//cpu_ms_per_audio_s is the CPU time of the whole process, OpenAL's
+//mixing included, per second of audio. expected_s is the length of a
+//generated file (0 for the ones given): audio_s falling short of it
+//means the end of the file was lost, which flatters decode_mb_s.
+//rate_mismatches counts buffers that a resampling profile uploaded at
+//another rate than the device's; any of them fail the run
+
+//counts every heap allocation of the process, ffmpeg's included
+static std::atomic<long> allocations( 0 );
+extern "C" {
+void* __libc_malloc(size_t);
+void* __libc_calloc(size_t, size_t);
+void* __libc_realloc(void*, size_t);
+void* __libc_memalign(size_t, size_t);
+
+void* malloc(size_t size) {
+	allocations.fetch_add( 1, std::memory_order_relaxed );
+	return __libc_malloc( size );
+}
+void* calloc(size_t n, size_t size) {
+	allocations.fetch_add( 1, std::memory_order_relaxed );
+	return __libc_calloc( n, size );
+}
+void* realloc(void* p, size_t size) {
+	allocations.fetch_add( 1, std::memory_order_relaxed );
+	return __libc_realloc( p, size );
+}
+void* memalign(size_t align, size_t size) {
+	allocations.fetch_add( 1, std::memory_order_relaxed );
+	return __libc_memalign( align, size );
+}
+//memalign takes any alignment, these two don't: their callers can rely
+//on getting EINVAL for one they can't honour
+void* aligned_alloc(size_t align, size_t size) {
+	if( align == 0 || (align & (align - 1)) ) {
+		errno = EINVAL;
+		return NULL;
+	}
+	return memalign( align, size );
+}
+int posix_memalign(void** p, size_t align, size_t size) {
+	if( align == 0 || (align & (align - 1)) || align % sizeof(void*) ) {
+		return EINVAL;
+	}
+	void* m = memalign( align, size );
+	if( !m ) {
+		return ENOMEM;
+	}
+	*p = m;
+	return 0;
+}
+}
+
+//the peak RSS is reset before each scenario (Linux >= 4.0)
+static void resetPeakRss() {
+	std::ofstream( "/proc/self/clear_refs" ) << "5";
+}
+static long peakRssKb() {
+	std::ifstream status( "/proc/self/status" );
+	std::string line;
+	while( std::getline( status, line ) ) {
+		if( line.compare( 0, 6, "VmHWM:" ) == 0 ) {
+			return atol( line.c_str() + 6 );
+		}
+	}
+	return 0;
+}
+static long readSyscalls() {
+	std::ifstream io( "/proc/self/io" );
+	std::string line;
+	while( std::getline( io, line ) ) {
+		if( line.compare( 0, 6, "syscr:" ) == 0 ) {
+			return atol( line.c_str() + 6 );
+		}
+	}
+	return 0;
+}
+static double cpuSeconds() {
+	struct rusage ru;
+	getrusage( RUSAGE_SELF, &ru );
+	return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+}
+static void pageFaults(long& major, long& minor) {
+	struct rusage ru;
+	getrusage( RUSAGE_SELF, &ru );
+	major = ru.ru_majflt;
+	minor = ru.ru_minflt;
+}
+
+struct Options {
+	int buffers = 4;
+	int latency = 200;
+	bool spatial = true;
+	int deviceRate = 48000;
+	int period = 1024;	//samples rendered at a time
+	bool mapped = false;
+	int codecThreads = 0;
+	bool nativeRate = true;
+	Converter::Quality resampler = Converter::Default;
+};
+
+struct Result {
+	double audioSeconds = 0;
+	double wallSeconds = 0;
+	double decodeSeconds = 0;
+	long pcmBytes = 0;
+	long allocs = 0;
+	long peakRss = 0;
+	long readCalls = 0;
+	long majorFaults = 0;
+	long minorFaults = 0;
+	double cpuSeconds = 0;
+	long rateMismatches = 0;
+};
+
+//plays file through the loopback device, the same way the player does
+Result play(OpenAL& al, OutputFormat& formats, const std::string& file, const Options& opt) {
+	typedef std::chrono::steady_clock clock;
+	Result r;
+	resetPeakRss();
+	long allocs = allocations;
+	long reads = readSyscalls();
+	long major, minor;
+	pageFaults( major, minor );
+	double cpu = cpuSeconds();
+	clock::time_point start = clock::now();
+	
+	float chunkMs = (float) opt.latency / opt.buffers;
+	Loader load;
+	load.negotiateFormat( &formats ).setChunkDuration( chunkMs ).setMappedInput( opt.mapped )
+		.setCodecThreads( CodecThreads( 2, opt.codecThreads ) )
+		.setOutputRate( opt.nativeRate ? -1 : opt.deviceRate, opt.resampler );
+	load.add( file );
+	PcmRing ring( 2 * opt.buffers, std::max( 1048575, (int) (chunkMs * 192 * 32) + 262144 ) );
+	
+	//decoder thread, timed per chunk
+	std::atomic<long> decodeNs( 0 );
+	std::atomic<long> pcmBytes( 0 );
+	std::thread decoder( [&]() {
+		while( !load.complete() && ring.waitWritable() ) {
+			PcmChunk& chunk = *ring.writeSlot();
+			clock::time_point t = clock::now();
+			load.fillAudioBuffer( chunk );
+			decodeNs += std::chrono::duration_cast<std::chrono::nanoseconds>( clock::now() - t ).count();
+			pcmBytes += chunk.size;
+			if( chunk.size > 0 ) {
+				ring.commitWrite();
+			}
+		}
+		ring.finish();
+	});
+	
+	Source& source = al.sources[0];
+	std::vector<ALuint> spare;
+	std::vector<ALuint> uploaded;
+	for( auto& b : al.buffers ) {
+		spare.push_back( b.buffer );
+	}
+	uploaded.reserve( spare.size() );
+	std::vector<float> mix( 2 * opt.period );
+	while( true ) {
+		size_t n = spare.size();
+		spare.resize( al.buffers.size() );
+		spare.resize( n + source.detachBuffers( &spare[n], spare.size() - n ) );
+		//as fast as possible: wait for the decoder rather than underrun
+		while( !spare.empty() && ring.waitReadable() ) {
+			PcmChunk* chunk = ring.readSlot();
+			Buffer& buffer = al.findBuffer( spare.back() ).setData(
+				formats.alFormat( chunk->channels, chunk->format ), chunk->pcm(), chunk->size, chunk->freq
+			);
+			//audio_s counts at the rate the buffer plays at
+			int freq = buffer.getFrequency();
+			if( !opt.nativeRate && freq != opt.deviceRate ) {
+				r.rateMismatches++;
+			}
+			uploaded.push_back( spare.back() );
+			spare.pop_back();
+			r.audioSeconds += (double) chunk->size / chunk->frameSize / freq;
+			ring.commitRead();
+		}
+		source.attachBuffers( uploaded.data(), uploaded.size() );
+		uploaded.clear();
+		if( source.getState() != AL_PLAYING ) {
+			if( source.getAttachedBuffers() > 0 ) {
+				source.play();
+			} else if( ring.done() ) {
+				break;
+			}
+		}
+		al.renderSamples( mix.data(), opt.period );
+	}
+	ring.close();
+	decoder.join();
+	load.close();
+	
+	r.wallSeconds = std::chrono::duration<double>( clock::now() - start ).count();
+	r.cpuSeconds = cpuSeconds() - cpu;
+	r.decodeSeconds = decodeNs / 1e9;
+	r.pcmBytes = pcmBytes;
+	r.allocs = allocations - allocs;
+	r.peakRss = peakRssKb();
+	r.readCalls = readSyscalls() - reads;
+	pageFaults( r.majorFaults, r.minorFaults );
+	r.majorFaults -= major;
+	r.minorFaults -= minor;
+	return r;
+}
+
+int usage(char* name) {
+	std::cerr << "Usage: " << name << " [-c|--corpus <dir>] [-s|--seconds <s>] [-l|--latency <ms>]"
+		" [-b|--buffers <n>] [-S|--no-spatial] [--io <read|mmap|both>]"
+		" [--codec-threads <n,...>] [--resampler <native|fast|default|high,...>] [file(s)]" << std::endl;
+	return EXIT_FAILURE;
+}
+
+int main(int argc, char** argv) {
+	Options opt;
+	std::string corpusDir = "bench-corpus";
+	float seconds = 30;
+	std::string io = "both";
+	std::vector<int> threadCounts;
+	std::vector<std::string> resamplers;
+	const struct option options[] = {
+		{ "corpus", required_argument, NULL, 'c' },
+		{ "seconds", required_argument, NULL, 's' },
+		{ "latency", required_argument, NULL, 'l' },
+		{ "buffers", required_argument, NULL, 'b' },
+		{ "no-spatial", no_argument, NULL, 'S' },
+		{ "io", required_argument, NULL, 'I' },
+		{ "codec-threads", required_argument, NULL, 'T' },
+		{ "resampler", required_argument, NULL, 'Q' },
+		{ NULL, 0, NULL, 0 }
+	};
+	int o;
+	while( (o = getopt_long( argc, argv, "c:s:l:b:S", options, NULL )) != -1 ) {
+		switch( o ) {
+			case 'c':
+				corpusDir = optarg;
+				break;
+			case 's':
+				seconds = std::max( 0.1, atof( optarg ) );
+				break;
+			case 'l':
+				opt.latency = std::max( 1, atoi( optarg ) );
+				break;
+			case 'b':
+				opt.buffers = std::max( 2, atoi( optarg ) );
+				break;
+			case 'S':
+				opt.spatial = false;
+				break;
+			case 'I':
+				io = optarg;
+				break;
+			case 'T': {
+				std::stringstream ss( optarg );
+				std::string n;
+				while( std::getline( ss, n, ',' ) ) {
+					threadCounts.push_back( std::max( 0, atoi( n.c_str() ) ) );
+				}
+				break;
+			}
+			case 'Q': {
+				std::stringstream ss( optarg );
+				std::string name;
+				Converter::Quality q;
+				while( std::getline( ss, name, ',' ) ) {
+					if( name != "native" && !Converter::parseQuality( name, q ) ) {
+						return usage( argv[0] );
+					}
+					resamplers.push_back( name );
+				}
+				break;
+			}
+			default:
+				return usage( argv[0] );
+		}
+	}
+	
+	std::vector<Corpus::Entry> entries = Corpus( corpusDir, seconds ).generate();
+	for( int i = optind; i < argc; i++ ) {
+		entries.push_back( Corpus::Entry{ argv[i], "", 0, 0, argv[i] } );
+	}
+	if( entries.empty() ) {
+		std::cerr << "Nothing to benchmark." << std::endl;
+		return EXIT_FAILURE;
+	}
+	
+	OpenAL al( OpenAL::Loopback );
+	al.createLoopbackContext( opt.deviceRate ).makeCurrent();
+	al.genSources(1).sources[0].setPitch(1).setGain(1)
+		.setPosition(1, 0, 0).setVelocity(0, 0, 0).disableLooping();
+	al.genBuffers( opt.buffers );
+	OutputFormat formats( opt.spatial );
+	
+	std::vector<bool> modes;
+	if( io != "mmap" ) {
+		modes.push_back( false );
+	}
+	if( io != "read" ) {
+		modes.push_back( true );
+	}
+	if( threadCounts.empty() ) {
+		threadCounts = { 1, 0 };
+	}
+	if( resamplers.empty() ) {
+		resamplers = { "native", "fast", "default", "high" };
+	}
+	bool failed = false;
+	for( const Corpus::Entry& e : entries ) {
+		for( bool mapped : modes ) {
+			for( int threads : threadCounts ) {
+				for( const std::string& resampler : resamplers ) {
+					opt.mapped = mapped;
+					opt.codecThreads = threads;
+					opt.nativeRate = resampler == "native";
+					Converter::parseQuality( resampler, opt.resampler );
+					const char* engine = opt.nativeRate ? "openal" :
+						(opt.resampler == Converter::High && Converter::soxrAvailable() ? "soxr" : "swr");
+					Result r = play( al, formats, e.path, opt );
+					printf( "{\"scenario\": \"%s\", \"codec\": \"%s\", \"rate\": %d, \"channels\": %d, \"io\": \"%s\", "
+						"\"codec_threads\": %d, \"resampler\": \"%s\", \"engine\": \"%s\", "
+						"\"expected_s\": %.3f, \"audio_s\": %.3f, \"wall_s\": %.3f, \"rt_factor\": %.1f, \"decode_mb_s\": %.1f, "
+						"\"cpu_ms_per_audio_s\": %.2f, "
+						"\"allocs_per_s\": %.0f, \"peak_rss_kb\": %ld, \"read_syscalls\": %ld, "
+						"\"major_faults\": %ld, \"minor_faults\": %ld, \"rate_mismatches\": %ld}\n",
+						e.name.c_str(), e.codec.c_str(), e.rate, e.channels, mapped ? "mmap" : "read",
+						threads, resampler.c_str(), engine,
+						e.rate > 0 ? seconds : 0.0f, r.audioSeconds, r.wallSeconds,
+						r.wallSeconds > 0 ? r.audioSeconds / r.wallSeconds : 0,
+						r.decodeSeconds > 0 ? r.pcmBytes / 1048576.0 / r.decodeSeconds : 0,
+						r.audioSeconds > 0 ? r.cpuSeconds * 1000 / r.audioSeconds : 0,
+						r.wallSeconds > 0 ? r.allocs / r.wallSeconds : 0, r.peakRss,
+						r.readCalls, r.majorFaults, r.minorFaults, r.rateMismatches );
+					fflush( stdout );
+					failed = failed || r.rateMismatches > 0;
+				}
+			}
+		}
+	}
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,148 @@
+#pragma once
+
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <sstream>
+#include <iomanip>
+#include <iostream>
+#include <stdexcept>
+#include <algorithm>
+
+#include "OpenAL.h"
+#include "Stats.hpp"
+
+//Moves sources along trajectories on a thread of its own, at a fixed
+//rate (e.g. 250-1000 Hz) instead of once per iteration of the playback
+//loop. Trajectories are functions of the seconds since an origin the
+//playback loop sets, e.g. the start of the song; the origin is an atomic,
+//so nothing here waits for the playback loop or the decoder. The AL error
+//state and deferred updates belong to the context, not to a thread, and
+//the playback loop checks and batches its own calls; so positions are set
+//here without error checks or deferral, leaving both to the playback
+//thread. How late each tick wakes up compared to its schedule is kept as
+//a histogram of the jitter
+
+class Animator {
+	public:
+		typedef std::chrono::steady_clock clock;
+		//position at seconds since the origin
+		typedef std::function<void(double seconds, ALfloat& x, ALfloat& y, ALfloat& z)> Trajectory;
+	
+	private:
+		struct Animated {
+			Source* source;
+			Trajectory trajectory;
+		};
+		std::vector<Animated> animated;
+		
+		clock::duration period;
+		std::atomic<clock::rep> origin;
+		
+		std::thread threadAnimate;
+		std::atomic<bool> stop;
+		
+		Stats::Histogram jitter;
+		std::atomic<long> ticks;
+		std::atomic<long> skipped;	//ticks missed entirely
+		Stats* stats = nullptr;
+		
+		void tick() {
+			double seconds = std::chrono::duration<double>( clock::now() - clock::time_point( clock::duration( origin.load() ) ) ).count();
+			Stats::Timer timer( stats, Stats::Animate );
+			ALfloat x, y, z;
+			for( auto& a : animated ) {
+				a.trajectory( seconds, x, y, z );
+				alSource3f( a.source->source, AL_POSITION, x, y, z );
+			}
+		}
+		
+		//sleeps until each tick is due rather than for a period, so the
+		//schedule doesn't drift; ticks that are more than a period late
+		//are skipped. a trajectory that throws stops the animation, not
+		//the player
+		void run() {
+			try {
+				animate();
+			} catch(const std::exception& e) {
+				std::cerr << '\r' << "Animation stopped: " << e.what() << std::endl;
+			}
+		}
+		void animate() {
+			clock::time_point due = clock::now();
+			while( !stop ) {
+				std::this_thread::sleep_until( due );
+				clock::time_point now = clock::now();
+				clock::duration late = now - due;
+				jitter.record( std::chrono::duration_cast<std::chrono::nanoseconds>( late ).count() );
+				if( stats ) {
+					stats->record( Stats::Jitter, late );
+				}
+				tick();
+				ticks++;
+				due += period;
+				if( late > period ) {
+					long missed = late / period;
+					skipped += missed;
+					due += missed * period;
+				}
+			}
+		}
+	
+	public:
+		Animator(double hz): origin(clock::now().time_since_epoch().count()),
+			stop(false), ticks(0), skipped(0)
+		{
+			period = std::chrono::duration_cast<clock::duration>( std::chrono::duration<double>( 1 / std::max( 1.0, hz ) ) );
+		}
+		~Animator() {
+			stopAnimating();
+		}
+		Animator(const Animator&) = delete;
+		Animator& operator=(const Animator&) = delete;
+		
+		//sources can only be added before start()
+		Animator& add(Source& source, Trajectory trajectory) {
+			animated.push_back( Animated{ &source, trajectory } );
+			
+			return *this;
+		}
+		Animator& setStats(Stats* stats_) {
+			stats = stats_;
+			
+			return *this;
+		}
+		//trajectories are evaluated at the time since origin
+		Animator& setOrigin(clock::time_point t) {
+			origin.store( t.time_since_epoch().count(), std::memory_order_relaxed );
+			
+			return *this;
+		}
+		
+		Animator& start() {
+			if( !threadAnimate.joinable() && !animated.empty() ) {
+				threadAnimate = std::thread( &Animator::run, this );
+			}
+			
+			return *this;
+		}
+		void stopAnimating() {
+			stop = true;
+			if( threadAnimate.joinable() ) {
+				threadAnimate.join();
+			}
+		}
+		
+		//ticks so far and how late they woke up
+		std::string json() {
+			std::stringstream ss;
+			ss << std::fixed << std::setprecision(3);
+			ss << "{\"hz\": " << 1 / std::chrono::duration<double>( period ).count()
+				<< ", \"ticks\": " << ticks << ", \"skipped\": " << skipped << ", \"jitter\": ";
+			jitter.json( ss );
+			ss << "}";
+			return ss.str();
+		}
+};
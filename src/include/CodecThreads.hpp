@@ -0,0 +1,78 @@
+#pragma once
+
+#include <thread>
+#include <algorithm>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+}
+
+//Decides how many threads a decoder gets and how it uses them. Only the
+//codecs that are expensive to decode at high rates are threaded: lossless
+//ones (frame threads) and DSD (slice threads, a channel each). Lossy
+//codecs decode far faster than real time on one core, and frame threads
+//would only add a frame of delay per thread. The cores are shared among
+//the decoders that run at the same time, so a player with a decoder and
+//a preroll gets more threads per decoder than a mixer with dozens of
+//streams, which gets none
+
+class CodecThreads {
+	private:
+		int decoders;
+		int threads;	//0: from the cores
+		
+		static const int maxThreads = 4;
+	
+	public:
+		//decoders: how many decode at the same time. threads: per decoder,
+		//0 for as many as the cores allow, 1 to never thread
+		CodecThreads(int decoders_ = 1, int threads_ = 0): decoders(std::max( 1, decoders_ )), threads(std::max( 0, threads_ )) {}
+		
+		static bool expensive(enum AVCodecID id) {
+			switch( id ) {
+				case AV_CODEC_ID_FLAC:
+				case AV_CODEC_ID_ALAC:
+				case AV_CODEC_ID_WAVPACK:
+				case AV_CODEC_ID_APE:
+				case AV_CODEC_ID_TTA:
+				case AV_CODEC_ID_TRUEHD:
+				case AV_CODEC_ID_MLP:
+				case AV_CODEC_ID_DSD_LSBF:
+				case AV_CODEC_ID_DSD_MSBF:
+				case AV_CODEC_ID_DSD_LSBF_PLANAR:
+				case AV_CODEC_ID_DSD_MSBF_PLANAR:
+					return true;
+				default:
+					return false;
+			}
+		}
+		
+		//threads a decoder of codec gets
+		int count(const AVCodec* codec) const {
+			if( !(codec->capabilities & (AV_CODEC_CAP_FRAME_THREADS | AV_CODEC_CAP_SLICE_THREADS)) ) {
+				return 1;
+			}
+			if( threads > 0 ) {
+				return threads;
+			}
+			if( !expensive( codec->id ) ) {
+				return 1;
+			}
+			int cores = std::max( 1u, std::thread::hardware_concurrency() );
+			return std::max( 1, std::min( maxThreads, cores / decoders ) );
+		}
+		
+		//to be called before avcodec_open2. frame threads where the codec
+		//has them, otherwise slice threads
+		void apply(AVCodecContext* ctx, const AVCodec* codec) const {
+			int n = count( codec );
+			ctx->thread_count = n;
+			if( n <= 1 ) {
+				ctx->thread_type = 0;
+			} else if( codec->capabilities & AV_CODEC_CAP_FRAME_THREADS ) {
+				ctx->thread_type = FF_THREAD_FRAME;
+			} else {
+				ctx->thread_type = FF_THREAD_SLICE;
+			}
+		}
+};
@@ -1,20 +1,42 @@
 #pragma once
 
+#include <algorithm>
+
+#include "SampleKernels.hpp"
+
 extern "C" {
 //https://rodic.fr/blog/libavcodec-tutorial-decode-audio-file/
+#include <libavcodec/avcodec.h>
 #include <libswresample/swresample.h>
+#include <libavutil/opt.h>
 }
 
-//uses SWResample library to convert any input to MONO PCM format with
-//16 bits
+//uses SWResample library to convert any input to the packed PCM format
+//negotiated with the device (by default MONO with 16 bits). converts
+//straight into the caller's memory; the scratch buffer is only used by
+//the returning convert() and only grows, so in steady state no frame
+//costs a heap allocation. common conversions that keep the sample rate
+//use a SIMD kernel instead of swr. Resampling is done with one of three
+//profiles: Fast (short filter, linearly interpolated phases), Default
+//(swr as it comes) and High (soxr at 28 bits if ffmpeg has it, else a
+//long swr filter)
 
 class Converter {
+	public:
+		enum Quality { Fast, Default, High };
+	
 	private:
-		SwrContext* swr;
+		SwrContext* swr = nullptr;
+		SampleKernels::Kernel kernel = nullptr;
+		int inChannels = 0;
 		AVChannelLayout outChannelLayout;
 		
 		enum AVSampleFormat outSampleFmt = AV_SAMPLE_FMT_S16;
-		int channels = 2;
+		int outSampleRate = 0;
+		
+		uint8_t* scratch = nullptr;
+		int scratchSamples = 0;
+		long allocs = 0;
 		
 		void ce(int errnum, std::string msg) {
 			if( errnum < 0 ) {
@@ -28,20 +50,60 @@ class Converter {
 			}
 		}
 		
+		//resampler options of the profile, set before swr_init
+		static void setQuality(SwrContext* swr, Quality quality, bool soxr) {
+			switch( quality ) {
+				case Fast:
+					av_opt_set_int( swr, "filter_size", 4, 0 );
+					av_opt_set_int( swr, "phase_shift", 6, 0 );
+					av_opt_set_int( swr, "linear_interp", 1, 0 );
+					break;
+				case High:
+					if( soxr ) {
+						av_opt_set_int( swr, "resampler", SWR_ENGINE_SOXR, 0 );
+						av_opt_set_double( swr, "precision", 28, 0 );
+					} else {
+						av_opt_set_int( swr, "resampler", SWR_ENGINE_SWR, 0 );
+						av_opt_set_int( swr, "filter_size", 64, 0 );
+						av_opt_set_int( swr, "phase_shift", 12, 0 );
+						av_opt_set_double( swr, "cutoff", 0.97, 0 );
+					}
+					break;
+				case Default:
+					break;
+			}
+		}
+		
 		void init_( AVCodecContext* aCodecCtx,
 						int64_t outChLayout,
 						enum AVSampleFormat outSampleFmt_,
-						int outSampleRate_
+						int outSampleRate_,
+						Quality quality = Default
 		) {
-			int outSampleRate = outSampleRate_ == -1 ? aCodecCtx->sample_rate : outSampleRate_;
+			outSampleRate = outSampleRate_ == -1 ? aCodecCtx->sample_rate : outSampleRate_;
 			outSampleFmt = outSampleFmt_;
 			av_channel_layout_from_mask( &outChannelLayout, outChLayout );
+			
+			//multichannel layouts have to match exactly, swr would remap
+			const AVChannelLayout& in = aCodecCtx->ch_layout;
+			inChannels = in.nb_channels;
+			bool layouts = in.nb_channels <= 2 || av_channel_layout_compare( &in, &outChannelLayout ) == 0;
+			if( outSampleRate == aCodecCtx->sample_rate && layouts ) {
+				kernel = SampleKernels::find( aCodecCtx->sample_fmt, in.nb_channels,
+					outSampleFmt, outChannelLayout.nb_channels );
+			}
+			if( kernel ) {
+				return;
+			}
 			swr_alloc_set_opts2( &swr,
 					&outChannelLayout, outSampleFmt, outSampleRate,
 					&(aCodecCtx->ch_layout), aCodecCtx->sample_fmt, aCodecCtx->sample_rate,
 					0, NULL
 			);
 			ce( -(swr == NULL), "Coudln't alloc swr-context");
+			if( outSampleRate != aCodecCtx->sample_rate ) {
+				setQuality( swr, quality, quality == High && soxrAvailable() );
+			}
 			ce( swr_init( swr ), "Coudn't init swr.");
 		}
 	public:
@@ -49,6 +111,9 @@ class Converter {
 			if( swr ) {
 				swr_free( &swr );
 			}
+			if( scratch ) {
+				av_freep( &scratch );
+			}
 		}
 	
 		void init(AVCodecContext* aCodecCtx) {
@@ -57,18 +122,131 @@ class Converter {
 		void init( AVCodecContext* aCodecCtx,
 						int64_t outChLayout,
 						enum AVSampleFormat outSampleFmt_,
-						int outSampleRate_
+						int outSampleRate_,
+						Quality quality = Default
 		) {
-			init_( aCodecCtx, outChLayout, outSampleFmt_, outSampleRate_ );
+			init_( aCodecCtx, outChLayout, outSampleFmt_, outSampleRate_, quality );
+		}
+		
+		//whether ffmpeg has been built with libsoxr. tried once, by
+		//whichever thread gets here first
+		static bool soxrAvailable() {
+			static const bool available = []() {
+				AVChannelLayout mono;
+				av_channel_layout_from_mask( &mono, AV_CH_LAYOUT_MONO );
+				SwrContext* s = nullptr;
+				swr_alloc_set_opts2( &s, &mono, AV_SAMPLE_FMT_FLT, 48000, &mono, AV_SAMPLE_FMT_FLT, 44100, 0, NULL );
+				if( !s ) {
+					return false;
+				}
+				av_opt_set_int( s, "resampler", SWR_ENGINE_SOXR, 0 );
+				bool ok = swr_init( s ) >= 0;
+				swr_free( &s );
+				return ok;
+			}();
+			return available;
+		}
+		static const char* qualityName(Quality quality) {
+			switch( quality ) {
+				case Fast:
+					return "fast";
+				case High:
+					return "high";
+				default:
+					return "default";
+			}
+		}
+		//false if name isn't a profile
+		static bool parseQuality(const std::string& name, Quality& quality) {
+			for( Quality q : { Fast, Default, High } ) {
+				if( name == qualityName( q ) ) {
+					quality = q;
+					return true;
+				}
+			}
+			return false;
 		}
 		
+		//upper bound of samples the next convert() may output, including
+		//what swr still buffers from previous calls
+		int getOutSamples(int samples) {
+			if( kernel ) {
+				return samples;
+			}
+			int out = swr_get_out_samples( swr, samples );
+			ce( out, "Couldn't compute number of output samples.");
+			
+			return out;
+		}
+		//bytes per output sample over all channels (output is packed)
+		int getFrameSize() {
+			return outChannelLayout.nb_channels * av_get_bytes_per_sample( outSampleFmt );
+		}
+		int getChannels() {
+			return outChannelLayout.nb_channels;
+		}
+		enum AVSampleFormat getSampleFormat() {
+			return outSampleFmt;
+		}
+		int getSampleRate() {
+			return outSampleRate;
+		}
+		//drops what swr buffers, e.g. after a seek
+		void reset() {
+			if( swr ) {
+				ce( swr_init( swr ), "Coudn't reset swr.");
+			}
+		}
+		//whether a SIMD kernel converts instead of swr
+		bool accelerated() {
+			return kernel != nullptr;
+		}
+		//number of heap allocations done by convert(); stays constant
+		//once the scratch buffer fits the largest frame
+		long allocations() {
+			return allocs;
+		}
+		
+		//converts into dst, which has room for dstSamples samples.
+		//returns the number of samples written
+		int convert(uint8_t** data, int samples, uint8_t* dst, int dstSamples) {
+			if( kernel ) {
+				samples = std::min( samples, dstSamples );
+				kernel( data, inChannels, samples, dst );
+				return samples;
+			}
+			int outputSamples = swr_convert( swr, &dst, dstSamples, (const uint8_t**) data, samples );
+			ce( outputSamples, "Couldn't resample decoded audio.");
+			
+			return outputSamples;
+		}
+		
+		//writes what swr still buffers into dst at the end of a song.
+		//returns the number of samples written
+		int flush(uint8_t* dst, int dstSamples) {
+			if( kernel ) {
+				return 0;
+			}
+			int outputSamples = swr_convert( swr, &dst, dstSamples, NULL, 0 );
+			ce( outputSamples, "Couldn't flush the resampler.");
+			
+			return outputSamples;
+		}
+		
+		//converts into the internal scratch buffer. the returned pointer
+		//stays owned by the converter and is valid until the next call
 		uint8_t* convert(uint8_t** data, int samples, int* outputSamples) {
-			uint8_t* output;
-			//convert input to signed 16Bit-Stereo, same freq
-			ce( av_samples_alloc( &output, NULL, channels, samples, outSampleFmt, 0 ), "Couldn't alloc resembled sample output buffer.");
-			*outputSamples = swr_convert( swr, &output, samples, (const uint8_t**) data, samples );
-			ce( *outputSamples, "Couldn't resample decoded audio.");
+			int needed = getOutSamples( samples );
+			if( needed > scratchSamples ) {
+				if( scratch ) {
+					av_freep( &scratch );
+				}
+				ce( av_samples_alloc( &scratch, NULL, outChannelLayout.nb_channels, needed, outSampleFmt, 0 ), "Couldn't alloc resembled sample output buffer.");
+				scratchSamples = needed;
+				allocs++;
+			}
+			*outputSamples = convert( data, samples, scratch, scratchSamples );
 			
-			return output;
+			return scratch;
 		}
 };
@@ -0,0 +1,438 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <mutex>
+
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+//Persistent index of what probing a file found out: banner metadata,
+//audio stream, codec and sample rate, validated by size and mtime of the
+//file. The file is mmap'ed as is; it contains an open addressing hash
+//table over the path hashes, so a lookup touches a few cache lines.
+//Loading only checks that every entry stays within the file, nothing is
+//parsed or copied. New entries are kept in
+//memory and merged into a rewritten file by save(). Files that have been
+//decoded once also get their seek points: where in the file a packet of
+//about every second starts, so seeking doesn't depend on the container's
+//seek table. Files whose loudness has been measured (LoudnessScanner)
+//also keep their integrated loudness and true peak
+
+class LibraryIndex {
+	public:
+		//time in AV_TIME_BASE units, pos the byte offset of the packet
+		struct SeekPoint {
+			int64_t time;
+			int64_t pos;
+		};
+		
+		//seekPoints aren't filled by lookup(), see seekPoints()
+		struct Info {
+			int64_t size = 0;
+			int64_t mtime = 0;
+			int32_t audioStream = -1;
+			int32_t codecId = 0;
+			int32_t sampleRate = 0;
+			double duration = 0;
+			std::string title;
+			std::string artist;
+			std::vector<SeekPoint> seekPoints;
+			//EBU R128 integrated loudness (LUFS) and true peak (dBTP),
+			//if analyzed
+			bool analyzed = false;
+			float loudness = 0;
+			float truePeak = 0;
+		};
+	
+	private:
+		struct Header {
+			char magic[8];
+			uint32_t version;
+			uint32_t count;
+			uint32_t tableSize;	//power of 2
+			uint32_t pad;
+			uint64_t pointsCount;
+			uint64_t stringsSize;
+		};
+		struct Entry {
+			uint64_t hash;
+			int64_t size;
+			int64_t mtime;
+			double duration;
+			uint32_t path, pathLength;
+			uint32_t title, titleLength;
+			uint32_t artist, artistLength;
+			int32_t audioStream;
+			int32_t codecId;
+			int32_t sampleRate;
+			uint32_t points, pointCount;
+			float loudness;
+			float truePeak;
+			int32_t analyzed;
+		};
+		//file layout: Header, Entry[count], uint32_t table[tableSize]
+		//(entry index + 1, 0 is empty), padding to 8 bytes,
+		//SeekPoint[pointsCount], strings
+		static const char* magic() { return "MMPIDX1"; }
+		static const uint32_t version = 3;
+		
+		std::string fileName;
+		void* base = MAP_FAILED;
+		size_t length = 0;
+		const Header* header = nullptr;
+		const Entry* entries = nullptr;
+		const uint32_t* table = nullptr;
+		const SeekPoint* points = nullptr;
+		const char* strings = nullptr;
+		
+		//entries probed in this run, written by save()
+		std::mutex mutexAdded;
+		std::unordered_map<std::string, Info> added;
+		
+		static uint64_t hash(const std::string& s) {
+			//FNV-1a
+			uint64_t h = 14695981039346656037ull;
+			for( unsigned char c : s ) {
+				h ^= c;
+				h *= 1099511628211ull;
+			}
+			return h;
+		}
+		
+		std::string str(uint32_t off, uint32_t len) {
+			return std::string( strings + off, len );
+		}
+		
+		static size_t align(size_t off) {
+			return (off + 7) & ~(size_t) 7;
+		}
+		
+		const Entry* find(const std::string& path) {
+			if( !header || !header->tableSize ) {
+				return nullptr;
+			}
+			uint64_t h = hash( path );
+			uint32_t mask = header->tableSize - 1;
+			for( uint32_t slot = h & mask, n = 0; n < header->tableSize; slot = (slot + 1) & mask, n++ ) {
+				uint32_t e = table[slot];
+				if( !e ) {
+					return nullptr;
+				}
+				const Entry& entry = entries[e - 1];
+				if( entry.hash == h && entry.pathLength == path.size() &&
+					memcmp( strings + entry.path, path.data(), path.size() ) == 0 )
+				{
+					return &entry;
+				}
+			}
+			return nullptr;
+		}
+		
+		void read(const Entry* e, Info& info) {
+			info.size = e->size;
+			info.mtime = e->mtime;
+			info.audioStream = e->audioStream;
+			info.codecId = e->codecId;
+			info.sampleRate = e->sampleRate;
+			info.duration = e->duration;
+			info.title = str( e->title, e->titleLength );
+			info.artist = str( e->artist, e->artistLength );
+			info.analyzed = e->analyzed;
+			info.loudness = e->loudness;
+			info.truePeak = e->truePeak;
+		}
+		void readPoints(const Entry* e, std::vector<SeekPoint>& out) {
+			out.assign( points + e->points, points + e->points + e->pointCount );
+		}
+		
+		//whether the table and every entry only refer to what's in the
+		//file, so nothing read through them can be out of bounds
+		bool inBounds() {
+			for( uint32_t slot = 0; slot < header->tableSize; slot++ ) {
+				if( table[slot] > header->count ) {
+					return false;
+				}
+			}
+			uint64_t size = header->stringsSize;
+			for( uint32_t i = 0; i < header->count; i++ ) {
+				const Entry& e = entries[i];
+				if( (uint64_t) e.path + e.pathLength > size || (uint64_t) e.title + e.titleLength > size ||
+					(uint64_t) e.artist + e.artistLength > size ||
+					(uint64_t) e.points + e.pointCount > header->pointsCount )
+				{
+					return false;
+				}
+			}
+			return true;
+		}
+		
+		void unmap() {
+			if( base != MAP_FAILED ) {
+				munmap( base, length );
+			}
+			base = MAP_FAILED;
+			header = nullptr;
+		}
+		
+		void map() {
+			int fd = open( fileName.c_str(), O_RDONLY );
+			if( fd < 0 ) {
+				return;
+			}
+			struct stat st;
+			if( fstat( fd, &st ) == 0 && (size_t) st.st_size >= sizeof(Header) ) {
+				length = st.st_size;
+				base = mmap( NULL, length, PROT_READ, MAP_SHARED, fd, 0 );
+			}
+			close( fd );
+			if( base == MAP_FAILED ) {
+				return;
+			}
+			
+			//an index that doesn't add up is ignored and rewritten
+			const Header* h = (const Header*) base;
+			if( h->pointsCount > length / sizeof(SeekPoint) || h->stringsSize > length ) {
+				unmap();
+				return;
+			}
+			size_t tableOffset = sizeof(Header) + (size_t) h->count * sizeof(Entry);
+			size_t pointsOffset = align( tableOffset + (size_t) h->tableSize * sizeof(uint32_t) );
+			size_t stringsOffset = pointsOffset + (size_t) h->pointsCount * sizeof(SeekPoint);
+			if( memcmp( h->magic, magic(), sizeof(h->magic) ) != 0 || h->version != version ||
+				(h->tableSize & (h->tableSize - 1)) || h->tableSize < h->count ||
+				stringsOffset + h->stringsSize != length )
+			{
+				unmap();
+				return;
+			}
+			header = h;
+			entries = (const Entry*) ((const char*) base + sizeof(Header));
+			table = (const uint32_t*) ((const char*) base + tableOffset);
+			points = (const SeekPoint*) ((const char*) base + pointsOffset);
+			strings = (const char*) base + stringsOffset;
+			if( !inBounds() ) {
+				unmap();
+			}
+		}
+	
+	public:
+		LibraryIndex(std::string fileName_): fileName(fileName_) {
+			map();
+		}
+		~LibraryIndex() {
+			unmap();
+		}
+		LibraryIndex(const LibraryIndex&) = delete;
+		LibraryIndex& operator=(const LibraryIndex&) = delete;
+		
+		//size and mtime of a file as stored in the index
+		static bool identify(const std::string& path, int64_t& size, int64_t& mtime) {
+			struct stat st;
+			if( stat( path.c_str(), &st ) < 0 ) {
+				return false;
+			}
+			size = st.st_size;
+			mtime = (int64_t) st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+			return true;
+		}
+		
+		//what the index knows about path. the caller validates size and
+		//mtime when the file is opened anyway
+		bool lookup(const std::string& path, Info& info) {
+			{
+				std::lock_guard<std::mutex> lck( mutexAdded );
+				auto it = added.find( path );
+				if( it != added.end() ) {
+					info = it->second;
+					return true;
+				}
+			}
+			const Entry* e = find( path );
+			if( !e ) {
+				return false;
+			}
+			read( e, info );
+			return true;
+		}
+		
+		//seek points of path, empty if it hasn't been decoded through yet
+		bool seekPoints(const std::string& path, std::vector<SeekPoint>& out) {
+			{
+				std::lock_guard<std::mutex> lck( mutexAdded );
+				auto it = added.find( path );
+				if( it != added.end() ) {
+					out = it->second.seekPoints;
+					return !out.empty();
+				}
+			}
+			const Entry* e = find( path );
+			if( !e ) {
+				return false;
+			}
+			readPoints( e, out );
+			return !out.empty();
+		}
+		
+		//records a freshly probed file; called from the probing workers.
+		//a loudness measured for the same file is kept
+		void put(const std::string& path, const Info& info) {
+			std::lock_guard<std::mutex> lck( mutexAdded );
+			Info& a = added[path];
+			bool keep = a.analyzed && !info.analyzed && a.size == info.size && a.mtime == info.mtime;
+			bool analyzed = a.analyzed;
+			float loudness = a.loudness, truePeak = a.truePeak;
+			a = info;
+			if( keep ) {
+				a.analyzed = analyzed;
+				a.loudness = loudness;
+				a.truePeak = truePeak;
+			}
+		}
+		//records the loudness of a file. if the index doesn't know the
+		//file as it is (size and mtime), info is recorded as a whole
+		void putLoudness(const std::string& path, const Info& info) {
+			std::lock_guard<std::mutex> lck( mutexAdded );
+			auto it = added.find( path );
+			if( it == added.end() ) {
+				const Entry* e = find( path );
+				Info& a = added[path];
+				if( e ) {
+					read( e, a );
+					readPoints( e, a.seekPoints );
+				}
+				it = added.find( path );
+			}
+			Info& a = it->second;
+			if( a.size != info.size || a.mtime != info.mtime ) {
+				a = info;
+			}
+			a.analyzed = true;
+			a.loudness = info.loudness;
+			a.truePeak = info.truePeak;
+		}
+		//records the seek points of a file that is in the index already
+		void putSeekPoints(const std::string& path, const std::vector<SeekPoint>& seekPoints) {
+			std::lock_guard<std::mutex> lck( mutexAdded );
+			auto it = added.find( path );
+			if( it == added.end() ) {
+				const Entry* e = find( path );
+				if( !e ) {
+					return;
+				}
+				read( e, added[path] );
+				it = added.find( path );
+			}
+			it->second.seekPoints = seekPoints;
+		}
+		
+		int size() {
+			return header ? header->count : 0;
+		}
+		
+		//writes the mapped entries merged with the new ones to a new index
+		//file and replaces the old one with it
+		bool save() {
+			std::lock_guard<std::mutex> lck( mutexAdded );
+			if( added.empty() ) {
+				return true;
+			}
+			
+			std::vector<Entry> out;
+			std::vector<SeekPoint> outPoints;
+			std::string outStrings;
+			auto addString = [&outStrings](const std::string& s, uint32_t& off, uint32_t& len) {
+				off = outStrings.size();
+				len = s.size();
+				outStrings += s;
+			};
+			auto addEntry = [&](const std::string& path, const Info& info) {
+				Entry e;
+				memset( &e, 0, sizeof(e) );
+				e.hash = hash( path );
+				e.size = info.size;
+				e.mtime = info.mtime;
+				e.duration = info.duration;
+				e.audioStream = info.audioStream;
+				e.codecId = info.codecId;
+				e.sampleRate = info.sampleRate;
+				e.analyzed = info.analyzed;
+				e.loudness = info.loudness;
+				e.truePeak = info.truePeak;
+				addString( path, e.path, e.pathLength );
+				addString( info.title, e.title, e.titleLength );
+				addString( info.artist, e.artist, e.artistLength );
+				e.points = outPoints.size();
+				e.pointCount = info.seekPoints.size();
+				outPoints.insert( outPoints.end(), info.seekPoints.begin(), info.seekPoints.end() );
+				out.push_back( e );
+			};
+			for( uint32_t i = 0; header && i < header->count; i++ ) {
+				std::string path = str( entries[i].path, entries[i].pathLength );
+				if( added.count( path ) ) {
+					continue;
+				}
+				Info info;
+				read( &entries[i], info );
+				readPoints( &entries[i], info.seekPoints );
+				addEntry( path, info );
+			}
+			for( auto& a : added ) {
+				addEntry( a.first, a.second );
+			}
+			
+			//load factor <= 0.5
+			uint32_t tableSize = 1;
+			while( tableSize < 2 * out.size() ) {
+				tableSize <<= 1;
+			}
+			std::vector<uint32_t> outTable( tableSize, 0 );
+			for( uint32_t i = 0; i < out.size(); i++ ) {
+				uint32_t slot = out[i].hash & (tableSize - 1);
+				while( outTable[slot] ) {
+					slot = (slot + 1) & (tableSize - 1);
+				}
+				outTable[slot] = i + 1;
+			}
+			
+			Header h;
+			memset( &h, 0, sizeof(h) );
+			memcpy( h.magic, magic(), sizeof(h.magic) );
+			h.version = version;
+			h.count = out.size();
+			h.tableSize = tableSize;
+			h.pointsCount = outPoints.size();
+			h.stringsSize = outStrings.size();
+			
+			std::string tmp = fileName + ".tmp";
+			FILE* f = fopen( tmp.c_str(), "wb" );
+			if( !f ) {
+				return false;
+			}
+			const char zeros[8] = { 0 };
+			size_t padding = align( tableSize * sizeof(uint32_t) ) - tableSize * sizeof(uint32_t);
+			bool ok = fwrite( &h, sizeof(h), 1, f ) == 1 &&
+				fwrite( out.data(), sizeof(Entry), out.size(), f ) == out.size() &&
+				fwrite( outTable.data(), sizeof(uint32_t), tableSize, f ) == tableSize &&
+				fwrite( zeros, 1, padding, f ) == padding &&
+				fwrite( outPoints.data(), sizeof(SeekPoint), outPoints.size(), f ) == outPoints.size() &&
+				fwrite( outStrings.data(), 1, outStrings.size(), f ) == outStrings.size();
+			ok = fclose( f ) == 0 && ok;
+			if( !ok || rename( tmp.c_str(), fileName.c_str() ) < 0 ) {
+				unlink( tmp.c_str() );
+				return false;
+			}
+			
+			added.clear();
+			unmap();
+			map();
+			return true;
+		}
+};
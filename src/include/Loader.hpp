@@ -1,8 +1,27 @@
 #pragma once
 
 #include <vector>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <iostream>
+
+#include <time.h>
 
 #include "Converter.hpp"
+#include "RingBuffer.hpp"
+#include "Track.hpp"
+#include "WorkerPool.hpp"
+#include "PcmCache.hpp"
+#include "LibraryIndex.hpp"
+#include "OutputFormat.hpp"
+#include "Stats.hpp"
+#include "Prefetcher.hpp"
+#include "Playlist.hpp"
+#include "LoudnessScanner.hpp"
 
 extern "C" {
 //https://rodic.fr/blog/libavcodec-tutorial-decode-audio-file/
@@ -12,29 +31,139 @@ extern "C" {
 }
 
 //Uses FFMPEG's libraries to open media files, find the first auto stream
-//and decode it. Uses Converter-class for a MONO-16bit output to it's
-//buffer ready to be played using OpenAL
+//and decode it. Each song is output in the format negotiated with the
+//device, by default MONO-16bit; the Converter-class is only used if the
+//decoder's output isn't in that format already. The result is a PCM
+//chunk ready to be played using OpenAL. Files are probed lazily: a small
+//pool of workers probes them in the background, and the decoder probes
+//a file itself if it gets there first. Seeks are requested by the
+//playback loop and carried out by the decoder before its next chunk;
+//chunks are tagged with the number of seeks done, so the playback loop
+//can tell stale ones from those of the new position. With a crossfade
+//the last seconds of a song are interleaved with the first ones of the
+//next, which come from its preroll; chunks are tagged with the lane
+//(source) they're to be played on. Only a window of the playlist is held
+//in memory: songs are read from the Playlist as the decoder gets within
+//lookahead of them and dropped once they're keepBehind songs behind it,
+//and a song's file is only open from shortly before it's decoded until
+//it has been, so memory and open files don't grow with the playlist.
+//Songs are numbered by their position in the whole playlist
 
 class Loader {
 	private:
-		//vectors for multiple files
-		std::vector<std::string> fileNames;
-		std::vector<AVFormatContext*> pFormatCtxs;
+		Playlist playlist;
+		
+		//songs first..first+size()-1 of the playlist. a deque, so workers
+		//can keep references. it's only changed by the decoder thread,
+		//under mutexTracks, as the other threads look songs up
+		std::deque<Track> tracks;
+		int first = 0;
+		std::mutex mutexTracks;
+		//song the decoder is at; past the last song once it's done
+		int current = 0;
+		//songs ahead of current that are read and probed, and songs
+		//behind it kept for the banner and seeks back
+		int lookahead = 4;
+		int keepBehind = 64;
+		
+		//optional: measures the songs as they're read from the playlist
+		LoudnessScanner* loudness = nullptr;
+		
+		//output format the converters are set up for
+		int64_t outChLayout = AV_CH_LAYOUT_MONO;
+		enum AVSampleFormat outSampleFmt = AV_SAMPLE_FMT_S16;
+		//-1: each song keeps its rate and the device resamples it
+		int outSampleRate = -1;
+		Converter::Quality resampler = Converter::Default;
+		//if set, the layout and sample format are negotiated per song
+		OutputFormat* formats = nullptr;
+		
+		bool dumpFormats = false;
+		std::mutex mutexDump;
+		
+		//files are read from a mapping, see MappedInput
+		bool mappedInput = false;
+		
+		//the decoder and the preroll decode at the same time
+		CodecThreads codecThreads = CodecThreads( 2 );
+		
+		//optional index of probed files; indexed files are only opened
+		//when they're decoded and skip avformat_find_stream_info
+		LibraryIndex* index = nullptr;
 		
-		std::vector<int> audioStreams;
-		std::vector<AVCodecContext*> aCodecCtxs;
-		std::vector<const AVCodec*> aCodecs;
+		WorkerPool* pool = nullptr;
+		std::mutex mutexProbe;
+		std::condition_variable condProbe;
 		
-		AVFrame* frame = NULL;
-		AVPacket* packet = NULL;
-		bool noNewRead = false;
+		//decoding state of one file. as ffmpeg may decode more than there
+		//is room to store it, noNewRead stores this information to not
+		//decode more when the next buffer is filled
+		struct Decoder {
+			AVFrame* frame = NULL;
+			AVPacket* packet = NULL;
+			bool noNewRead = false;
+			//the file has ended, the frames the codec holds back are
+			//taken (frame threads keep up to one per thread)
+			bool draining = false;
+			//after a seek: samples to drop, -1 if they're computed from
+			//the first frame's timestamp and target
+			int64_t skip = 0;
+			int64_t target = 0;
+		};
+		Decoder dec;
+		int decSong = -1;
 		
-		std::vector<Converter*> convs;
+		//lookahead: the first seconds of the next song are decoded by a
+		//separate thread while the current one plays. at the boundary its
+		//decoder is swapped in, so the new song starts without a stall
+		float prerollSeconds = 5;
+		std::thread threadPreroll;
+		Decoder prerollDec;
+		std::vector<uint8_t> prerollData;
+		int prerollSize = 0;
+		int prerollRead = 0;
+		int prerollSong = -1;	//song the preroll buffer holds
+		int prerolled = 0;		//last song a preroll was started for
 		
-		std::vector<int> completes;
+		//crossfade: for the last fadeSeconds of a song, chunks of the
+		//next one are handed out in step with it, for the other lane
+		float fadeSeconds = 0;
+		int lane = 0;			//lane of the current song
+		bool overlapping = false;
+		long songFrames = 0;	//of the current song handed out so far, the
+								//position of its next chunk
+		long outFrames = 0;		//of the outgoing song since the fade began
+		long inFrames = 0;		//of the incoming song
 		
-		int bufferSize = 1048575;//1MB
-		std::vector<int> freqs;
+		//optional cache of decoded songs. a cached song is played from the
+		//mapped cache file, otherwise it's written to the cache as decoded
+		PcmCache* cache = nullptr;
+		PcmCache::Writer cacheWriter;
+		
+		//optional: warms the page cache with the files of the next songs
+		Prefetcher* prefetcher = nullptr;
+		std::shared_ptr<PcmCache::Mapping> cached;
+		size_t cachedRead = 0;
+		
+		//chunks hold at most chunkMs of audio, so a queue of small
+		//buffers keeps the latency low. 0: fill chunks to capacity
+		float chunkMs = 0;
+		
+		std::atomic<long> frames;
+		std::atomic<long> allocs;
+		
+		//optional per-stage timings of decode()
+		Stats* stats = nullptr;
+		
+		//seek requested by the playback loop. idle: the decoder has
+		//finished and won't look for seeks any more
+		std::mutex mutexSeek;
+		bool seekPending = false;
+		int seekSong = 0;
+		double seekSeconds = 0;
+		int seeks = 0;
+		int epoch = 0;	//seeks carried out by the decoder
+		bool idle = false;
 	
 		//error checking function
 		void ce(int errnum, std::string msg) {
@@ -56,56 +185,223 @@ class Loader {
 #pragma GCC diagnostic pop
 	
 	public:
-		uint8_t* audioBuffer = nullptr;
-		int size;
-		
 		~Loader() {
 			close();
 		}
 		
-		Loader() {
+		Loader(): frames(0), allocs(0) {
 			av_log_set_callback(avLogCallback);
 		}
 	
-		Loader(char** name) {
+		Loader(char** name): frames(0), allocs(0) {
 			av_log_set_callback(avLogCallback);
 			
 			if( *name ) {
-				init( name );
+				add( *name );
 			}
 		}
 		
-		Loader& init(char** name) {
-			//adds the required data structures to the class variables
-			fileNames.push_back(*name);
-			completes.push_back( 2 );
+		//adds a file, directory or playlist to the playlist. it's only
+		//read once the decoder gets close to it
+		Loader& add(std::string name) {
+			playlist.add( name );
 			
-			AVFormatContext* pFormatCtx = NULL;
-			ce( 
-				avformat_open_input( &pFormatCtx, *name, NULL, NULL),
-				"Coudln't open file"
-			);			
-			pFormatCtxs.push_back( pFormatCtx );
+			return *this;
+		}
+		
+		//starts the playlist at the first song called name instead, the
+		//songs before it are skipped unread. returns its number, or 0 if
+		//there is none. only before playback starts
+		int skipTo(const std::string& name) {
+			tracks.clear();
+			playlist.rewind();
+			std::string entry;
+			for( int i = 0; playlist.next( entry ); i++ ) {
+				if( entry == name ) {
+					first = current = i;
+					append( entry );
+					return i;
+				}
+			}
+			playlist.rewind();
+			first = current = 0;
+			return 0;
+		}
+		
+		//songs are handed to loudness as they're read from the playlist
+		Loader& setLoudness(LoudnessScanner* loudness_) {
+			loudness = loudness_;
+			
+			return *this;
+		}
+		
+		//threads of each song's decoder; only takes effect for songs that
+		//haven't been probed yet
+		Loader& setCodecThreads(const CodecThreads& threads) {
+			codecThreads = threads;
+			
+			return *this;
+		}
+		
+		Loader& setIndex(LibraryIndex* index_) {
+			index = index_;
+			
+			return *this;
+		}
+		
+		Loader& setOutputFormat(int64_t outChLayout_, enum AVSampleFormat outSampleFmt_, int outSampleRate_) {
+			outChLayout = outChLayout_;
+			outSampleFmt = outSampleFmt_;
+			outSampleRate = outSampleRate_;
+			
+			return *this;
+		}
+		//resamples every song to rate, usually the device's, with the
+		//given profile, so it's resampled once and the device doesn't do
+		//it again. -1 keeps each song's rate
+		Loader& setOutputRate(int rate, Converter::Quality quality = Converter::Default) {
+			outSampleRate = rate;
+			resampler = quality;
+			
+			return *this;
+		}
+		//negotiates layout and sample format of each song with the device
+		//instead of converting everything to the output format
+		Loader& negotiateFormat(OutputFormat* formats_) {
+			formats = formats_;
+			if( formats ) {
+				outChLayout = formats->spatial() ? AV_CH_LAYOUT_MONO : 0;
+				outSampleFmt = AV_SAMPLE_FMT_NONE;
+			}
+			
+			return *this;
+		}
+		//reads local files from a mapping instead of read() calls
+		Loader& setMappedInput(bool mapped) {
+			mappedInput = mapped;
+			
+			return *this;
+		}
+		//av_dump_format for every file when it's probed
+		Loader& setDumpFormat(bool dump) {
+			dumpFormats = dump;
+			
+			return *this;
+		}
+		
+		//opens the file, its decoder and a converter for song i. done
+		//by exactly one thread, whoever gets to the song first
+		void probe(int i) {
+			Track* song;
+			{
+				//claimed under the lock, so it isn't dropped meanwhile
+				std::lock_guard<std::mutex> lck( mutexTracks );
+				song = at( i );
+				int expected = song ? (int) song->state : Track::Probing;
+				if( (expected != Track::Unprobed && expected != Track::Closed) ||
+					!song->state.compare_exchange_strong( expected, Track::Probing ) )
+				{
+					return;
+				}
+			}
+			Track& t = *song;
+			int result = Track::Ready;
+			try {
+				//an indexed file that hasn't changed is opened without
+				//probing its streams
+				int64_t size, mtime;
+				bool identified = index && LibraryIndex::identify( t.fileName, size, mtime );
+				bool known = t.indexed && identified && t.known.size == size && t.known.mtime == mtime;
+				
+				t.init( mappedInput );
+				if( dumpFormats ) {
+					std::lock_guard<std::mutex> lck( mutexDump );
+					t.dumpFormat();
+				}
+				if( !known || !t.useAudioStream( t.known.audioStream, t.known.codecId ) ) {
+					t.findStreamInfo().findAudioStream();
+					known = false;
+				}
+				t.createAudioContext().findDecoder().openDecoder( codecThreads );
+				if( known ) {
+					t.useSeekPoints( index );
+				} else {
+					t.readMetadata();
+					if( identified ) {
+						index->put( t.fileName, t.indexInfo( size, mtime ) );
+					}
+				}
+				int64_t layout = outChLayout;
+				enum AVSampleFormat fmt = outSampleFmt;
+				if( formats ) {
+					formats->choose( t.aCodecCtx, layout, fmt );
+				}
+				t.createConverter( layout, fmt, outSampleRate, resampler );
+				if( formats && !formats->alFormat( t.getChannels(), t.getSampleFormat() ) ) {
+					throw std::runtime_error("Device can't play the format of " + t.fileName);
+				}
+			} catch(const std::runtime_error& e) {
+				std::cerr << '\r' << e.what() << std::endl;
+				t.close();
+				result = Track::Failed;
+			}
+			{
+				std::lock_guard<std::mutex> lck( mutexProbe );
+				t.state = result;
+			}
+			condProbe.notify_all();
+		}
+		//probes the next lookahead songs in the background, in playlist
+		//order, and every song once it gets that close. indexed files are
+		//left to the decoder
+		Loader& probeAhead(int workers = 4) {
+			if( !pool ) {
+				pool = new WorkerPool( workers );
+				for( int i = first; i < end(); i++ ) {
+					if( !at( i )->indexed ) {
+						pool->submit( [this, i]() { probe(i); } );
+					}
+				}
+			}
+			extend();
 			
 			return *this;
 		}
+		//makes sure song i has been probed, probing it right away if no
+		//worker has started on it. the song, or nullptr if it can't be
+		//played or isn't held any more
+		Track* waitProbed(int i) {
+			Track* song = find( i );
+			if( !song ) {
+				return nullptr;
+			}
+			Track& t = *song;
+			if( t.state == Track::Unprobed || t.state == Track::Closed ) {
+				probe( i );
+			}
+			if( t.state < Track::Ready ) {
+				std::unique_lock<std::mutex> lck( mutexProbe );
+				condProbe.wait( lck, [&t]() { return t.state >= Track::Ready; });
+			}
+			return t.state == Track::Ready ? song : nullptr;
+		}
 		
 		void printBanner(int i = 0) {
 			//printes some meta information (title, artist etc.)
-			if( (uint) i >= completes.size() )
-				return;
 			if( i < 0 ) {
 				throw std::runtime_error("printBanner(): uninitialized i");
 			}
-			float duration = pFormatCtxs[i]->duration / 1e6;
-			AVDictionaryEntry* tmp;
-			tmp = av_dict_get(pFormatCtxs[i]->metadata, "title", NULL, AV_DICT_IGNORE_SUFFIX);
-			std::string title((tmp ? tmp->value : ""));
-			tmp = av_dict_get(pFormatCtxs[i]->metadata, "artist", NULL, AV_DICT_IGNORE_SUFFIX);
-			std::string artist((tmp ? tmp->value : ""));
+			std::lock_guard<std::mutex> lck( mutexTracks );
+			if( !at( i ) )
+				return;
+			Track& t = *at( i );
+			bool probed = t.state == Track::Ready || t.state == Track::Closed || t.indexed;
+			float duration = probed ? t.duration : 0;
+			std::string title( probed ? t.title : "" );
+			std::string artist( probed ? t.artist : "" );
 			
 			std::stringstream ss;
-			ss << '\r' << "Now playing »" << fileNames[i] << "« (";
+			ss << '\r' << "Now playing »" << t.fileName << "« (";
 			if( !title.empty() ) {
 				ss << "'" << title << "' ";
 			}
@@ -129,191 +425,765 @@ class Loader {
 		//functions to navigate the data structures when a media file
 		//is finished playing
 		bool complete() {
-			return completes.back() == 0;
+			extend();
+			return current >= end();
+		}
+		//whether the decoder has more to do, i.e. songs left or a seek.
+		//once it says no, the decoder has to be restarted for a seek
+		bool running() {
+			std::lock_guard<std::mutex> lck( mutexSeek );
+			idle = complete() && !seekPending;
+			return !idle;
+		}
+		
+		//requests a seek to seconds into song i. returns the epoch the
+		//chunks of the new position will have; restart is set if the
+		//decoder had already stopped (see running())
+		int seek(int i, double seconds, bool& restart) {
+			std::lock_guard<std::mutex> lck( mutexSeek );
+			seekPending = true;
+			seekSong = i;
+			seekSeconds = seconds;
+			restart = idle;
+			idle = false;
+			return ++seeks;
 		}
 		int actSong() {
-			int i = completes.size() - 1;
-			while( i > 0 && completes[i] > 1 ) {
-				i--;
-			}
-			return i;
+			return current;
 		}
 		int nextSong() {
-			uint i = 0;
-			while( i + 1 < completes.size() && completes[i] < 2 ) {
-				i++;
-			}
-			return i;
+			return current + 1;
 		}
+		//the current song has been decoded: its file is closed and the
+		//window moves on
 		void songCompleted() {
-			uint i = completes.size() - 1;
-			while( completes[i] == 2 && i > 0 ) {
-				i--;
-			}
-			completes[i] = 0;
-			if( completes.size() > i + 1 ) {
-				completes[i+1] = 1;
+			current++;
+			retire();
+			extend();
+		}
+		
+		int getFreq() {
+			std::lock_guard<std::mutex> lck( mutexTracks );
+			Track* t = at( current );
+			return t ? t->outFreq : 0;
+		}
+		//empty if song i isn't held (any more)
+		std::string songName(int i) {
+			std::lock_guard<std::mutex> lck( mutexTracks );
+			Track* t = at( i );
+			return t ? t->fileName : "";
+		}
+		//decoded frames, and the buffers (packets, frames, converter
+		//scratch) allocated to decode them; those stay constant in steady
+		//state. allocations inside ffmpeg aren't counted
+		long decodedFrames() {
+			return frames;
+		}
+		long bufferAllocations() {
+			std::lock_guard<std::mutex> lck( mutexTracks );
+			long n = allocs;
+			for( auto& t : tracks ) {
+				if( t.state == Track::Ready && t.conv ) {
+					n += t.conv->allocations();
+				}
 			}
+			return n;
 		}
 		
-		//interface to ffmpeg's functions
-		Loader& findStreamInfo() {
-			ce( avformat_find_stream_info( pFormatCtxs.back(), NULL ), "Couldn't find stream-info");
+		Loader& setCache(PcmCache* cache_) {
+			cache = cache_;
 			
 			return *this;
 		}
 		
-		Loader& dumpFormat() {
-			av_dump_format( pFormatCtxs.back(), 0, fileNames.back().c_str(), 0 );
+		//when a song starts, the files of the next filesAhead() songs are
+		//read ahead
+		Loader& setPrefetcher(Prefetcher* prefetcher_) {
+			prefetcher = prefetcher_;
 			
 			return *this;
 		}
 		
-		//checks all streams for type audio. terminates when it founds one
-		Loader& findAudioStream() {
-			audioStreams.push_back( -1 );
-			for( uint i = 0; i < pFormatCtxs.back()->nb_streams; i++ ) {
-				if( pFormatCtxs.back()->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_AUDIO &&
-					audioStreams.back() < 0 )
-				{
-					audioStreams.back() = i;
-				}
-			}
-			ce( audioStreams.back(), "Couldn't find audio-stream.");
+		Loader& setChunkDuration(float ms) {
+			chunkMs = ms;
 			
 			return *this;
 		}
 		
-		Loader& createAudioContext() {
-			aCodecCtxs.push_back(avcodec_alloc_context3(NULL) );
-			ce(
-				avcodec_parameters_to_context( aCodecCtxs.back(), pFormatCtxs.back()->streams[audioStreams.back()]->codecpar ),
-				"Couldn't create audio context."
-			);
-			freqs.push_back(aCodecCtxs.back() -> sample_rate );
+		Loader& setStats(Stats* stats_) {
+			stats = stats_;
 			
 			return *this;
 		}
 		
-		Loader& findDecoder() {
-			aCodecs.push_back( avcodec_find_decoder(aCodecCtxs.back()->codec_id) );
-			ce( -(aCodecs.back() == NULL), "Couldn't find matching codec.");
+		Loader& setPreroll(float seconds) {
+			prerollSeconds = std::max( seconds, fadeSeconds > 0 ? fadeSeconds + 1 : 0 );
 			
 			return *this;
 		}
-		Loader& openDecoder() {
-			ce( avcodec_open2( aCodecCtxs.back(), aCodecs.back(), NULL ), "Couldn't open decoder.");
+		//the incoming song is taken from the preroll, which has to cover
+		//the fade
+		Loader& setCrossfade(float seconds) {
+			fadeSeconds = seconds;
+			setPreroll( prerollSeconds );
 			
 			return *this;
 		}
 		
-		Loader& setAudioBufferSize(int size) {
-			bufferSize = size;
-			if( audioBuffer ) {
-				audioBuffer = (uint8_t*) realloc( audioBuffer, bufferSize );
+	private:
+		//song i, if it's held; the caller holds mutexTracks or is the
+		//decoder thread. songs leave the window in retire(), so callers
+		//check for nullptr rather than assume an index is still held
+		Track* at(int i) {
+			return i >= first && i < end() ? &tracks[i - first] : nullptr;
+		}
+		int end() {
+			return first + (int) tracks.size();
+		}
+		Track* find(int i) {
+			std::lock_guard<std::mutex> lck( mutexTracks );
+			return at( i );
+		}
+		
+		//adds the next song of the playlist
+		void append(const std::string& name) {
+			{
+				std::lock_guard<std::mutex> lck( mutexTracks );
+				tracks.emplace_back( name );
+			}
+			Track& t = tracks.back();
+			LibraryIndex::Info info;
+			if( index && index->lookup( name, info ) ) {
+				t.useIndex( info );
+			}
+			if( loudness ) {
+				loudness->scan( name );
+			}
+			if( pool && !t.indexed ) {
+				int i = end() - 1;
+				pool->submit( [this, i]() { probe(i); } );
 			}
-			
-			return *this;
 		}
-		int getFreq() {
-			return freqs[actSong()];
+		//reads songs from the playlist until the next lookahead ones after
+		//current (and the ones to be prefetched) are held
+		void extend() {
+			int ahead = std::max( lookahead, prefetcher ? prefetcher->filesAhead() : 0 );
+			std::string name;
+			while( end() <= current + ahead && playlist.next( name ) ) {
+				append( name );
+			}
 		}
-		AVCodecContext* getAudioCodecContext() {
-			return aCodecCtxs.back();
+		//closes the files of the songs outside the window (and lets the
+		//prefetcher forget them), and drops the songs more than keepBehind
+		//behind current. songs being probed by a worker are left alone
+		//until a later call
+		void retire() {
+			int ahead = std::max( lookahead, prefetcher ? prefetcher->filesAhead() : 0 );
+			for( int i = first; i < end(); i++ ) {
+				if( i < current || i > current + ahead ) {
+					release( tracks[i - first] );
+					unprefetch( i, ahead );
+				}
+			}
+			std::lock_guard<std::mutex> lck( mutexTracks );
+			while( !tracks.empty() && first < current - keepBehind && tracks.front().state != Track::Probing ) {
+				release( tracks.front() );
+				tracks.pop_front();
+				first++;
+			}
 		}
-		Loader& registerConverter( Converter* conv_ ) {
-			convs.push_back( conv_ );
-			return *this;
+		//song i left the window: its file gives back its share of the
+		//prefetch budget, unless a song in the window is the same file
+		void unprefetch(int i, int ahead) {
+			if( !prefetcher ) {
+				return;
+			}
+			const std::string& name = tracks[i - first].fileName;
+			for( int j = std::max( first, current ); j <= current + ahead && j < end(); j++ ) {
+				if( tracks[j - first].fileName == name ) {
+					return;
+				}
+			}
+			prefetcher->forget( name );
 		}
-		Loader& registerConverter(  ) {
-			convs.push_back( nullptr );
-			return *this;
+		void release(Track& t) {
+			if( t.state != Track::Ready ) {
+				return;
+			}
+			if( t.conv ) {
+				allocs += t.conv->allocations();
+			}
+			t.close();
+			t.state = Track::Closed;
 		}
-		Loader& unregisterConverter() {
-			convs.back() = nullptr;
-			
-			return *this;
+		
+		void allocDecoder(Decoder& d) {
+			d.packet = av_packet_alloc();
+			d.frame = av_frame_alloc();
+			ce( -(d.packet == NULL || d.frame == NULL), "Couldn't allocate mem for packet or frame");
+			allocs += 2;
+		}
+		//forgets a frame that didn't fit and any pending skip
+		void resetDecoder(Decoder& d) {
+			if( d.packet ) {
+				av_packet_unref( d.packet );
+				av_frame_unref( d.frame );
+			}
+			d.noNewRead = false;
+			d.draining = false;
+			d.skip = 0;
+		}
+		void freeDecoder(Decoder& d) {
+			if( d.packet ) {
+				av_packet_free( &d.packet );
+			}
+			if( d.frame ) {
+				av_frame_free( &d.frame );
+			}
+		}
+		
+		//timed calls into ffmpeg
+		int readPacket(Track& t, AVPacket* packet) {
+			Stats::Timer timer( stats, Stats::Read );
+			return av_read_frame( t.pFormatCtx, packet );
+		}
+		int receiveFrame(Track& t, AVFrame* frame) {
+			Stats::Timer timer( stats, Stats::ReceiveFrame );
+			return avcodec_receive_frame( t.aCodecCtx, frame );
+		}
+		
+		//drops the samples before a seek target; false if all of frame
+		//is dropped
+		bool trim(Track& t, Decoder& d, AVFrame* frame) {
+			if( d.skip < 0 ) {
+				d.skip = t.samplesUntil( frame, d.target );
+			}
+			if( d.skip == 0 ) {
+				return true;
+			}
+			if( d.skip >= frame->nb_samples ) {
+				d.skip -= frame->nb_samples;
+				return false;
+			}
+			enum AVSampleFormat fmt = (enum AVSampleFormat) frame->format;
+			int channels = frame->ch_layout.nb_channels;
+			int bytes = d.skip * av_get_bytes_per_sample( fmt );
+			if( av_sample_fmt_is_planar( fmt ) ) {
+				for( int c = 0; c < channels; c++ ) {
+					frame->extended_data[c] += bytes;
+					if( frame->extended_data != frame->data && c < AV_NUM_DATA_POINTERS ) {
+						frame->data[c] += bytes;
+					}
+				}
+			} else {
+				frame->data[0] += bytes * channels;
+				if( frame->extended_data != frame->data ) {
+					frame->extended_data[0] += bytes * channels;
+				}
+			}
+			frame->nb_samples -= d.skip;
+			d.skip = 0;
+			return true;
 		}
 		
-		//uses ffmpeg functions to fill the audio buffer, until its size
-		//is reached. as ffmpeg may decode more than there is room to
-		//store it, noNewRead stores this information to not decode more
-		//when the buffer needs to be refilled
-		void fillAudioBuffer() {
-			if( ! audioBuffer ) {
-				audioBuffer = (uint8_t*) malloc( bufferSize );
+		//reads the next packet. at the end of the file the codec is sent
+		//the flush packet instead, so it gives out what it holds back
+		bool nextPacket(Track& t, Decoder& d) {
+			if( readPacket( t, d.packet ) < 0 ) {
+				avcodec_send_packet( t.aCodecCtx, NULL );
+				d.draining = true;
 			}
-			size = 0;
+			return true;
+		}
+		
+		//uses ffmpeg functions to decode song i into dst, until limit
+		//bytes are reached (returns true) or the file ends (false). a
+		//frame is always taken if dst is empty and it fits the capacity.
+		//at the end the codec and the resampler are drained
+		bool decode(int i, Decoder& d, uint8_t* dst, int limit, int capacity, int& size) {
 			int dataSize, outputSamples;
-			if( !noNewRead ) {
-				packet = av_packet_alloc();
-				frame = av_frame_alloc();
-				ce( -(packet == NULL || frame == NULL), "Couldn't allocate mem for packet or frame");
+			AVPacket* packet = d.packet;
+			AVFrame* frame = d.frame;
+			Track* song = find( i );
+			if( !song ) {
+				return false;
 			}
-			while( noNewRead || av_read_frame( pFormatCtxs[actSong()], packet ) >= 0 )
+			Track& t = *song;
+			Converter* conv = t.conv;
+			while( d.noNewRead || d.draining || nextPacket( t, d ) )
 			{
-				if( noNewRead || packet->stream_index == audioStreams[actSong()] ) {
-					if( ! noNewRead ) {
+				if( d.noNewRead || d.draining || packet->stream_index == t.audioStream ) {
+					if( !d.noNewRead && !d.draining ) {
+						t.notePacket( packet );
 						try {
-						    ce( avcodec_send_packet( aCodecCtxs[actSong()], packet ) ,"Coudln't send packet");
+							Stats::Timer timer( stats, Stats::SendPacket );
+						    ce( avcodec_send_packet( t.aCodecCtx, packet ) ,"Coudln't send packet");
 						} catch(const std::runtime_error& e) {
 							std::cerr << '\r' << e.what() << std::endl;
+							av_packet_unref( packet );
 							continue;
 						}
 					}
 					
-					while( noNewRead || avcodec_receive_frame( aCodecCtxs[actSong()], frame ) == 0) 
+					while( d.noNewRead || receiveFrame( t, frame ) == 0) 
 					{
-						dataSize = av_samples_get_buffer_size( NULL, aCodecCtxs[actSong()]->ch_layout.nb_channels, frame->nb_samples, aCodecCtxs[actSong()]->sample_fmt, 1 );
-						ce( dataSize, "Couldn't compute size of decoded audio");
-												
-						if( size + dataSize >= bufferSize ) {
-							noNewRead = true;
-							return;
+						if( !d.noNewRead && !trim( t, d, frame ) ) {
+							av_frame_unref( frame );
+							continue;
+						}
+						if( conv ) {
+							//worst case of what the resampler may output
+							dataSize = conv->getOutSamples( frame->nb_samples ) * conv->getFrameSize();
+						} else {
+							dataSize = av_samples_get_buffer_size( NULL, t.aCodecCtx->ch_layout.nb_channels, frame->nb_samples, t.aCodecCtx->sample_fmt, 1 );
+							ce( dataSize, "Couldn't compute size of decoded audio");
+						}
+						
+						if( size + dataSize >= capacity || (size > 0 && size + dataSize > limit) ) {
+							d.noNewRead = true;
+							return true;
 						}
 						assert( dataSize > 0 );
+						frames++;
+						if( stats ) {
+							stats->add( Stats::Frames );
+						}
 						
-						if( convs[actSong()] ) {
-							uint8_t* output = convs[actSong()]->convert( frame->data, frame->nb_samples, &outputSamples );
-							memcpy( audioBuffer + size, output, 2 * outputSamples );
-							av_freep( &output );
-							size += 2 * outputSamples;
+						if( conv ) {
+							//resample straight into the destination, no copy
+							Stats::Timer timer( stats, Stats::Convert );
+							outputSamples = conv->convert( frame->data, frame->nb_samples,
+								dst + size, (capacity - size) / conv->getFrameSize() );
+							size += outputSamples * conv->getFrameSize();
 						}
 						else {
-							memcpy( audioBuffer + size, frame->data[0], dataSize );
+							Stats::Timer timer( stats, Stats::Copy );
+							memcpy( dst + size, frame->data[0], dataSize );
 							size += dataSize;
 						}
-						noNewRead = false;
+						d.noNewRead = false;
 						
 						av_frame_unref( frame );
 					}
 				}
 				
 				av_packet_unref( packet );
+				if( d.draining ) {
+					break;
+				}
+			}
+			//samples the resampler still buffers
+			if( conv ) {
+				int pending = conv->getOutSamples( 0 ) * conv->getFrameSize();
+				if( pending > 0 && size + pending >= capacity ) {
+					return true;
+				}
+				size += conv->flush( dst + size, (capacity - size) / conv->getFrameSize() ) * conv->getFrameSize();
+			}
+			d.draining = false;
+			return false;
+		}
+		
+		//song i starts: its file is read now (unless cached), so the next
+		//ones are read ahead
+		void prefetchAfter(int i) {
+			if( !prefetcher ) {
+				return;
+			}
+			Track* t = find( i );
+			if( t && !cached ) {
+				prefetcher->claim( t->fileName );
+			}
+			for( int j = i + 1; j <= i + prefetcher->filesAhead(); j++ ) {
+				if( !(t = find( j )) ) {
+					break;
+				}
+				prefetcher->prefetch( t->fileName );
+			}
+		}
+		
+		//decodes the first prerollSeconds of song i on the preroll thread
+		void startPreroll(int i) {
+			Track* song = find( i );
+			if( prerollSeconds <= 0 || !song || i <= prerolled ) {
+				return;
+			}
+			prerolled = i;
+			PcmCache::Key key;
+			if( fadeSeconds <= 0 && cacheKey( i, key ) && cache->contains( key ) ) {
+				return;
+			}
+			if( prefetcher ) {
+				prefetcher->claim( song->fileName );
+			}
+			prerollSong = i;
+			prerollSize = 0;
+			prerollRead = 0;
+			if( !prerollDec.packet ) {
+				allocDecoder( prerollDec );
+			}
+			threadPreroll = std::thread( [this, i]() {
+				Track* song = waitProbed( i );
+				if( !song ) {
+					return;
+				}
+				Track& t = *song;
+				prerollData.resize( (size_t) (prerollSeconds * t.outFreq) * t.getFrameSize() );
+				decode( i, prerollDec, prerollData.data(), prerollData.size(), prerollData.size(), prerollSize );
+			});
+		}
+		
+		//at the first chunk of song i: if it has been prerolled, waits for
+		//the preroll thread and continues with its decoder
+		void takePreroll(int i) {
+			if( prerollSong != i ) {
+				return;
+			}
+			if( threadPreroll.joinable() ) {
+				threadPreroll.join();
+			}
+			std::swap( dec, prerollDec );
+		}
+		//song i is played from the cache, the preroll isn't needed
+		void dropPreroll(int i) {
+			if( prerollSong != i ) {
+				return;
+			}
+			if( threadPreroll.joinable() ) {
+				threadPreroll.join();
+			}
+			resetDecoder( prerollDec );
+			prerollSong = -1;
+		}
+		
+		//carries out a pending seek: drops the preroll and whatever the
+		//decoder holds, marks song i as the playing one and positions its
+		//cache mapping or demuxer
+		void applySeek() {
+			int i;
+			double seconds;
+			{
+				std::lock_guard<std::mutex> lck( mutexSeek );
+				if( !seekPending ) {
+					return;
+				}
+				seekPending = false;
+				i = seekSong;
+				seconds = seekSeconds;
+				epoch = seeks;
+			}
+			if( threadPreroll.joinable() ) {
+				threadPreroll.join();
+			}
+			resetDecoder( dec );
+			resetDecoder( prerollDec );
+			//a dropped preroll has read into its song; it's closed, so it's
+			//opened again from the start when it's prerolled once more
+			Track* dropped = prerollSong != i ? find( prerollSong ) : nullptr;
+			if( dropped ) {
+				release( *dropped );
+			}
+			prerollSong = -1;
+			//songs dropped already can't be sought to
+			current = std::max( i, first );
+			extend();
+			current = i = std::min( current, end() );
+			prerolled = i;
+			retire();
+			decSong = i;
+			overlapping = false;
+			inFrames = 0;
+			songFrames = 0;
+			
+			//a cached song is simply read from the new position on
+			cacheWriter.abort();
+			cached.reset();
+			if( i >= end() ) {
+				return;
+			}
+			PcmCache::Key key;
+			if( cacheKey( i, key ) && (cached = cache->open( key )) ) {
+				cachedRead = std::min( cached->size, (size_t) (seconds * cached->freq) * cached->frameSize );
+				songFrames = cachedRead / cached->frameSize;
+				return;
+			}
+			Track* song = waitProbed( i );
+			if( !song ) {
+				return;
+			}
+			songFrames = seconds * song->outFreq;
+			try {
+				dec.target = song->seek( seconds, dec.skip );
+			} catch(const std::runtime_error& e) {
+				std::cerr << '\r' << e.what() << std::endl;
+			}
+		}
+		
+		//negotiated output is cached per set of device formats, resampled
+		//output per profile
+		bool cacheKey(int i, PcmCache::Key& key) {
+			Track* t = find( i );
+			return cache && t && cache->key( t->fileName, outChLayout, outSampleFmt, outSampleRate,
+				formats ? formats->mask() : 0, outSampleRate > 0 ? resampler : -1, key );
+		}
+		
+		//at the first chunk of song i: maps its cache file, or starts
+		//writing one if there is none yet. the preroll thread may still
+		//be sizing prerollData, so it's waited for first
+		void lookupCache(int i) {
+			cached.reset();
+			cachedRead = 0;
+			cacheWriter.abort();
+			PcmCache::Key key;
+			if( !cacheKey( i, key ) ) {
+				return;
+			}
+			if( threadPreroll.joinable() ) {
+				threadPreroll.join();
+			}
+			//what a crossfade took from the preroll has been played already,
+			//or has to be written to the cache first
+			int played = prerollSong == i ? prerollRead : 0;
+			cached = cache->open( key );
+			if( cached ) {
+				cachedRead = std::min( cached->size, (size_t) played );
+				dropPreroll( i );
+			} else {
+				cacheWriter.begin( cache, key );
+				cacheWriter.append( prerollData.data(), played );
+			}
+		}
+		
+		//starts the crossfade once song i is within fadeSeconds of its end,
+		//if the next song's preroll is there to fade in
+		void startFade(int i) {
+			Track* t = find( i );
+			if( fadeSeconds <= 0 || overlapping || prerollSong != i + 1 || !t || t->duration <= fadeSeconds ||
+				songFrames < (t->duration - fadeSeconds) * t->outFreq )
+			{
+				return;
+			}
+			if( threadPreroll.joinable() ) {
+				threadPreroll.join();
+			}
+			//songs shorter than the fade aren't faded in
+			Track* in = find( i + 1 );
+			if( !in || in->state != Track::Ready || prerollRead > 0 ||
+				prerollSize < (long) (fadeSeconds * in->outFreq) * in->getFrameSize() )
+			{
+				return;
+			}
+			overlapping = true;
+			outFrames = 0;
+			inFrames = 0;
+			if( stats ) {
+				stats->add( Stats::Crossfades );
+			}
+		}
+		//while crossfading: fills chunk with the incoming song if it's
+		//not ahead of the outgoing one. once the incoming song covers the
+		//fade, the outgoing one is cut, as it's silent by then
+		bool fillIncoming(PcmChunk& chunk) {
+			int i = actSong();
+			Track* outgoing = find( i );
+			Track* incoming = find( i + 1 );
+			//both are in the window while overlapping; should that ever
+			//fail, the crossfade is abandoned rather than read past it
+			if( !outgoing || !incoming ) {
+				overlapping = false;
+				return false;
+			}
+			Track& out = *outgoing;
+			Track& in = *incoming;
+			if( inFrames * out.outFreq > outFrames * in.outFreq ) {
+				return false;
+			}
+			if( inFrames >= fadeSeconds * in.outFreq || prerollRead >= prerollSize ) {
+				overlapping = false;
+				lane = 1 - lane;
+				resetDecoder( dec );
+				cacheWriter.abort();
+				songCompleted();
+				return false;
+			}
+			int n = std::min( prerollSize - prerollRead, chunkLimit( chunk, in.outFreq, in.getFrameSize() ) );
+			memcpy( chunk.data, prerollData.data() + prerollRead, n );
+			prerollRead += n;
+			chunk.song = i + 1;
+			chunk.size = n;
+			chunk.freq = in.outFreq;
+			chunk.channels = in.getChannels();
+			chunk.format = in.getSampleFormat();
+			chunk.frameSize = in.getFrameSize();
+			chunk.lane = 1 - lane;
+			chunk.pts = inFrames;
+			chunk.fadeIn = inFrames == 0;
+			inFrames += n / in.getFrameSize();
+			return true;
+		}
+		//book-keeping after a chunk of the current song has been filled
+		void handedOut(int i, const PcmChunk& chunk) {
+			long n = chunk.frameSize > 0 ? chunk.size / chunk.frameSize : 0;
+			songFrames += n;
+			if( overlapping ) {
+				outFrames += n;
+			} else if( i == actSong() ) {
+				startFade( i );
+			}
+		}
+		//song i ended on its own
+		void songEnded() {
+			if( overlapping ) {
+				overlapping = false;
+				lane = 1 - lane;
 			}
 			songCompleted();
 		}
+		//bytes of audio a chunk is filled with
+		int chunkLimit(const PcmChunk& chunk, int freq, int frameSize) {
+			if( chunkMs <= 0 || freq <= 0 || frameSize <= 0 ) {
+				return chunk.capacity;
+			}
+			long frames = std::max( 1L, (long) (chunkMs * freq / 1000) );
+			return std::min( (long) chunk.capacity, frames * frameSize );
+		}
 		
-		void close() {
-			for(auto aCodecCtx : aCodecCtxs ) {
-				if( aCodecCtx ) {
-					avcodec_free_context( &aCodecCtx );
-					aCodecCtx = NULL;
+		//hands the next piece of the mapped cache file to the chunk
+		void fillFromCache(PcmChunk& chunk) {
+			int limit = chunkLimit( chunk, cached->freq, cached->frameSize );
+			size_t n = std::min( cached->size - cachedRead, (size_t) limit );
+			chunk.view = cached->data + cachedRead;
+			chunk.keep = cached;
+			chunk.size = n;
+			chunk.freq = cached->freq;
+			chunk.channels = cached->channels;
+			chunk.format = cached->format;
+			chunk.frameSize = cached->frameSize;
+			cachedRead += n;
+			cache->servedBytes += n;
+			if( cachedRead >= cached->size ) {
+				cached.reset();
+				songEnded();
+			}
+		}
+		
+		static int64_t threadCpuNs() {
+			struct timespec ts;
+			clock_gettime( CLOCK_THREAD_CPUTIME_ID, &ts );
+			return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+		}
+	
+	public:
+		//fills the chunk with the current song, until its capacity or
+		//chunk duration is reached or the song ends. a chunk never spans
+		//two songs
+		void fillAudioBuffer(PcmChunk& chunk) {
+			applySeek();
+			Stats::Timer timer( stats, overlapping ? Stats::FillOverlap : Stats::Fill );
+			chunk.epoch = epoch;
+			chunk.view = nullptr;
+			chunk.keep.reset();
+			chunk.fadeIn = false;
+			if( overlapping && fillIncoming( chunk ) ) {
+				return;
+			}
+			int i = actSong();
+			chunk.song = i;
+			chunk.size = 0;
+			chunk.lane = lane;
+			//nothing left after a seek past the end
+			if( i >= end() ) {
+				return;
+			}
+			
+			bool boundary = i != decSong;
+			decSong = i;
+			if( boundary ) {
+				songFrames = inFrames;
+				inFrames = 0;
+				lookupCache( i );
+				prefetchAfter( i );
+			}
+			chunk.pts = songFrames;
+			if( cached ) {
+				fillFromCache( chunk );
+				handedOut( i, chunk );
+				return;
+			}
+			
+			//a song that can't be played gives up its preroll, or no other
+			//song would be prerolled again
+			Track* song = waitProbed( i );
+			if( !song ) {
+				cacheWriter.abort();
+				dropPreroll( i );
+				songEnded();
+				return;
+			}
+			Track& t = *song;
+			chunk.freq = t.outFreq;
+			chunk.channels = t.getChannels();
+			chunk.format = t.getSampleFormat();
+			chunk.frameSize = t.getFrameSize();
+			if( !dec.packet ) {
+				allocDecoder( dec );
+			}
+			if( boundary ) {
+				takePreroll( i );
+			}
+			
+			int limit = chunkLimit( chunk, t.outFreq, t.getFrameSize() );
+			bool full = false;
+			if( prerollSong == i ) {
+				int n = std::min( prerollSize - prerollRead, limit );
+				memcpy( chunk.data, prerollData.data() + prerollRead, n );
+				prerollRead += n;
+				chunk.size = n;
+				full = prerollRead < prerollSize;
+				if( !full ) {
+					prerollSong = -1;
 				}
 			}
-			for( auto pFormatCtx : pFormatCtxs ) {
-				if( pFormatCtx ) {
-					avformat_close_input( &pFormatCtx );
-					pFormatCtx = NULL;
+			if( !full ) {
+				int64_t cpu = cacheWriter.active() ? threadCpuNs() : 0;
+				int size = chunk.size;
+				full = decode( i, dec, chunk.data, limit, chunk.capacity, chunk.size );
+				if( cacheWriter.active() ) {
+					cache->decodeNs += threadCpuNs() - cpu;
+					cache->decodedBytes += chunk.size - size;
 				}
 			}
-			for( auto conv : convs) {
-				if( conv ) {
-					delete conv;
+			cacheWriter.append( chunk.data, chunk.size );
+			
+			if( full ) {
+				if( prerollSong < 0 ) {
+					startPreroll( i + 1 );
+				}
+				handedOut( i, chunk );
+			} else {
+				t.decodedToEnd( index );
+				//songs whose converter failed aren't in the requested format
+				if( !t.raw ) {
+					cacheWriter.commit( t.outFreq, t.getChannels(), t.getSampleFormat(), t.getFrameSize() );
 				}
+				cacheWriter.abort();
+				songEnded();
+			}
+		}
+		
+		void close() {
+			if( pool ) {
+				delete pool;
+				pool = nullptr;
 			}
-			if( audioBuffer ) {
-				free( audioBuffer );
+			if( threadPreroll.joinable() ) {
+				threadPreroll.join();
 			}
+			freeDecoder( dec );
+			freeDecoder( prerollDec );
+			cacheWriter.abort();
+			cached.reset();
+			std::lock_guard<std::mutex> lck( mutexTracks );
+			tracks.clear();
 		}
 };
@@ -0,0 +1,254 @@
+#pragma once
+
+#include <vector>
+#include <cmath>
+#include <algorithm>
+
+#include "SampleKernels.hpp"
+
+//EBU R128 / ITU-R BS.1770-4 meter for one track: integrated loudness
+//with the absolute (-70 LUFS) and relative (-10 LU) gates over 400 ms
+//blocks overlapping by 75 %, and the true peak from 4x oversampling.
+//Takes planar float. The K-weighting filters are recursive and run per
+//channel in double; the oversampling FIR, where most of the time goes,
+//has SSE2 and AVX2 versions picked at runtime like SampleKernels. In a
+//5.1 layout the LFE is left out and the surrounds weigh 1.41
+
+class Loudness {
+	private:
+		static const int factor = 4;			//oversampling
+		static const int taps = 12;			//per phase
+		
+		//direct form II transposed
+		struct Biquad {
+			double b0, b1, b2, a1, a2;
+			double z1 = 0, z2 = 0;
+			
+			inline double run(double x) {
+				double y = b0 * x + z1;
+				z1 = b1 * x - a1 * y + z2;
+				z2 = b2 * x - a2 * y;
+				return y;
+			}
+		};
+		struct Channel {
+			Biquad shelf;
+			Biquad highpass;
+			double weight;
+			float history[taps - 1];	//last input samples, for the FIR
+		};
+		
+		//the FIR's phases, taps reversed so output n is the dot product
+		//of a phase with input n..n+taps-1
+		float fir[factor][taps];
+		
+		typedef float (*PeakKernel)(const float* x, int n, const float (*h)[taps]);
+		PeakKernel peakKernel;
+		
+		std::vector<Channel> channels;
+		std::vector<float> scratch;
+		
+		int hop;				//samples per 100 ms
+		int hopFill = 0;
+		double hopEnergy = 0;
+		std::vector<double> hops;	//weighted mean square of each 100 ms
+		float peak = 0;
+		long samples = 0;
+		
+		//max |y| over the oversampled outputs of x[0..n+taps-1)
+		static float peakScalar(const float* x, int n, const float (*h)[taps]) {
+			float m = 0;
+			for( int i = 0; i < n; i++ ) {
+				for( int p = 0; p < factor; p++ ) {
+					float y = 0;
+					for( int k = 0; k < taps; k++ ) {
+						y += h[p][k] * x[i + k];
+					}
+					m = std::max( m, std::fabs( y ) );
+				}
+			}
+			return m;
+		}
+#ifdef SAMPLE_KERNELS_X86
+		//4 or 8 consecutive outputs of a phase at a time
+		__attribute__((target("sse2")))
+		static float peakSse2(const float* x, int n, const float (*h)[taps]) {
+			const __m128 abs = _mm_castsi128_ps( _mm_set1_epi32( 0x7fffffff ) );
+			__m128 m = _mm_setzero_ps();
+			int i = 0;
+			for( ; i + 4 <= n; i += 4 ) {
+				for( int p = 0; p < factor; p++ ) {
+					__m128 y = _mm_setzero_ps();
+					for( int k = 0; k < taps; k++ ) {
+						y = _mm_add_ps( y, _mm_mul_ps( _mm_set1_ps( h[p][k] ), _mm_loadu_ps( x + i + k ) ) );
+					}
+					m = _mm_max_ps( m, _mm_and_ps( y, abs ) );
+				}
+			}
+			float lanes[4];
+			_mm_storeu_ps( lanes, m );
+			float r = std::max( std::max( lanes[0], lanes[1] ), std::max( lanes[2], lanes[3] ) );
+			return std::max( r, peakScalar( x + i, n - i, h ) );
+		}
+		__attribute__((target("avx2")))
+		static float peakAvx2(const float* x, int n, const float (*h)[taps]) {
+			const __m256 abs = _mm256_castsi256_ps( _mm256_set1_epi32( 0x7fffffff ) );
+			__m256 m = _mm256_setzero_ps();
+			int i = 0;
+			for( ; i + 8 <= n; i += 8 ) {
+				for( int p = 0; p < factor; p++ ) {
+					__m256 y = _mm256_setzero_ps();
+					for( int k = 0; k < taps; k++ ) {
+						y = _mm256_add_ps( y, _mm256_mul_ps( _mm256_set1_ps( h[p][k] ), _mm256_loadu_ps( x + i + k ) ) );
+					}
+					m = _mm256_max_ps( m, _mm256_and_ps( y, abs ) );
+				}
+			}
+			float lanes[8];
+			_mm256_storeu_ps( lanes, m );
+			float r = *std::max_element( lanes, lanes + 8 );
+			return std::max( r, peakScalar( x + i, n - i, h ) );
+		}
+#endif
+
+		//K-weighting: a high shelf of about +4 dB above 1.5 kHz and a high
+		//pass at 38 Hz, for any sample rate
+		void kWeighting(int rate, Biquad& shelf, Biquad& highpass) {
+			double f0 = 1681.974450955533;
+			double g = 3.999843853973347;
+			double q = 0.7071752369554196;
+			double k = tan( M_PI * f0 / rate );
+			double vh = pow( 10.0, g / 20 );
+			double vb = pow( vh, 0.4996667741545416 );
+			double a0 = 1 + k / q + k * k;
+			shelf.b0 = (vh + vb * k / q + k * k) / a0;
+			shelf.b1 = 2 * (k * k - vh) / a0;
+			shelf.b2 = (vh - vb * k / q + k * k) / a0;
+			shelf.a1 = 2 * (k * k - 1) / a0;
+			shelf.a2 = (1 - k / q + k * k) / a0;
+			
+			f0 = 38.13547087602444;
+			q = 0.5003270373238773;
+			k = tan( M_PI * f0 / rate );
+			a0 = 1 + k / q + k * k;
+			highpass.b0 = 1;
+			highpass.b1 = -2;
+			highpass.b2 = 1;
+			highpass.a1 = 2 * (k * k - 1) / a0;
+			highpass.a2 = (1 - k / q + k * k) / a0;
+		}
+		
+		//windowed sinc cutting off at the input's Nyquist frequency
+		void designFir() {
+			const int n = factor * taps;
+			for( int t = 0; t < n; t++ ) {
+				double x = (t - (n - 1) / 2.0) / factor;
+				double sinc = x == 0 ? 1 : sin( M_PI * x ) / (M_PI * x);
+				double window = 0.5 - 0.5 * cos( 2 * M_PI * (t + 0.5) / n );
+				fir[t % factor][taps - 1 - t / factor] = sinc * window;
+			}
+		}
+		
+		static double lufs(double energy) {
+			return -0.691 + 10 * log10( energy );
+		}
+	
+	public:
+		Loudness(int rate, int numChannels, SampleKernels::Isa isa = SampleKernels::best()):
+			channels(std::max( 1, numChannels )), hop(std::max( 1, rate / 10 ))
+		{
+			for( size_t c = 0; c < channels.size(); c++ ) {
+				Channel& ch = channels[c];
+				kWeighting( rate, ch.shelf, ch.highpass );
+				std::fill( ch.history, ch.history + taps - 1, 0.0f );
+				ch.weight = 1;
+				if( channels.size() == 6 ) {
+					ch.weight = c == 3 ? 0 : (c >= 4 ? 1.41 : 1);
+				}
+			}
+			designFir();
+			peakKernel = peakScalar;
+#ifdef SAMPLE_KERNELS_X86
+			if( isa == SampleKernels::AVX2 ) {
+				peakKernel = peakAvx2;
+			} else if( isa == SampleKernels::SSE2 ) {
+				peakKernel = peakSse2;
+			}
+#endif
+		}
+		
+		//n samples of each channel
+		void add(const float* const* planes, int n) {
+			samples += n;
+			//filtered in pieces up to the next 100 ms
+			for( int done = 0; done < n; ) {
+				int len = std::min( n - done, hop - hopFill );
+				for( size_t c = 0; c < channels.size(); c++ ) {
+					Channel& ch = channels[c];
+					if( ch.weight == 0 ) {
+						continue;
+					}
+					const float* x = planes[c] + done;
+					double sum = 0;
+					for( int i = 0; i < len; i++ ) {
+						double y = ch.highpass.run( ch.shelf.run( x[i] ) );
+						sum += y * y;
+					}
+					hopEnergy += ch.weight * sum;
+				}
+				hopFill += len;
+				done += len;
+				if( hopFill == hop ) {
+					hops.push_back( hopEnergy / hop );
+					hopEnergy = 0;
+					hopFill = 0;
+				}
+			}
+			
+			//true peak
+			scratch.resize( taps - 1 + n );
+			for( size_t c = 0; c < channels.size(); c++ ) {
+				Channel& ch = channels[c];
+				std::copy( ch.history, ch.history + taps - 1, scratch.begin() );
+				std::copy( planes[c], planes[c] + n, scratch.begin() + taps - 1 );
+				peak = std::max( peak, peakKernel( scratch.data(), n, fir ) );
+				std::copy( scratch.end() - (taps - 1), scratch.end(), ch.history );
+			}
+		}
+		
+		//gated loudness of what has been added, in LUFS. -inf if it's
+		//silent or shorter than a block
+		double integrated() const {
+			std::vector<double> blocks;
+			for( size_t i = 0; i + 4 <= hops.size(); i++ ) {
+				double z = (hops[i] + hops[i + 1] + hops[i + 2] + hops[i + 3]) / 4;
+				if( z > 0 && lufs( z ) > -70 ) {
+					blocks.push_back( z );
+				}
+			}
+			if( blocks.empty() ) {
+				return -INFINITY;
+			}
+			double sum = 0;
+			for( double z : blocks ) {
+				sum += z;
+			}
+			double gate = lufs( sum / blocks.size() ) - 10;
+			sum = 0;
+			int n = 0;
+			for( double z : blocks ) {
+				if( lufs( z ) > gate ) {
+					sum += z;
+					n++;
+				}
+			}
+			return lufs( sum / n );
+		}
+		//in dBTP; -inf if silent
+		double truePeak() const {
+			return peak > 0 ? 20 * log10( peak ) : -INFINITY;
+		}
+		long length() const {
+			return samples;
+		}
+};
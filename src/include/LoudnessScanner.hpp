@@ -0,0 +1,246 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <sstream>
+#include <iomanip>
+#include <cmath>
+#include <algorithm>
+
+#include <time.h>
+
+#include "Track.hpp"
+#include "Loudness.hpp"
+#include "LibraryIndex.hpp"
+#include "WorkerPool.hpp"
+#include "CodecThreads.hpp"
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libswresample/swresample.h>
+}
+
+//Measures the loudness of files in the background, so each song can be
+//played at the same loudness by the gain of its source alone. Every
+//file is decoded on its own by a job on a pool of workers and run
+//through a Loudness meter; each decoder is single threaded, files are
+//done in parallel instead. Results go into the library index if there
+//is one, keyed by path, size and mtime like everything else there, so
+//a file is only decoded again once it has changed. gain() aims at
+//target LUFS (-18, as ReplayGain 2.0) without pushing the true peak
+//over -1 dBTP
+
+class LoudnessScanner {
+	public:
+		struct Result {
+			float loudness;		//LUFS
+			float truePeak;		//dBTP
+		};
+	
+	private:
+		LibraryIndex* index;
+		double target;
+		int workers;
+		WorkerPool* pool = nullptr;
+		
+		std::mutex mutexResults;
+		std::unordered_map<std::string, Result> results;
+		
+		std::atomic<bool> stopping;
+		std::atomic<long> analyzed;
+		std::atomic<long> cached;
+		std::atomic<long> failed;
+		double audioSeconds = 0;
+		double cpuSeconds = 0;
+		
+		static double threadCpu() {
+			struct timespec ts;
+			clock_gettime( CLOCK_THREAD_CPUTIME_ID, &ts );
+			return ts.tv_sec + ts.tv_nsec / 1e9;
+		}
+		
+		//decodes file to planar float for the meter
+		bool measure(const std::string& file, LibraryIndex::Info& info) {
+			Track t( file );
+			AVPacket* packet = nullptr;
+			AVFrame* frame = nullptr;
+			SwrContext* swr = nullptr;
+			bool complete = false;
+			try {
+				t.init( true ).findStreamInfo().findAudioStream().createAudioContext().findDecoder()
+					.openDecoder( CodecThreads( workers, 1 ) ).readMetadata();
+				AVCodecContext* ctx = t.aCodecCtx;
+				int channels = ctx->ch_layout.nb_channels;
+				Loudness meter( ctx->sample_rate, channels );
+				bool planar = ctx->sample_fmt == AV_SAMPLE_FMT_FLTP ||
+					(ctx->sample_fmt == AV_SAMPLE_FMT_FLT && channels == 1);
+				if( !planar ) {
+					swr_alloc_set_opts2( &swr, &ctx->ch_layout, AV_SAMPLE_FMT_FLTP, ctx->sample_rate,
+						&ctx->ch_layout, ctx->sample_fmt, ctx->sample_rate, 0, NULL );
+					if( !swr || swr_init( swr ) < 0 ) {
+						throw std::runtime_error("Couldn't convert " + file);
+					}
+				}
+				std::vector<std::vector<float>> planes( channels );
+				std::vector<uint8_t*> out( channels );
+				
+				packet = av_packet_alloc();
+				frame = av_frame_alloc();
+				bool draining = false;
+				while( !stopping ) {
+					int ret = avcodec_receive_frame( ctx, frame );
+					if( ret == AVERROR(EAGAIN) ) {
+						if( draining ) {
+							break;
+						}
+						if( av_read_frame( t.pFormatCtx, packet ) < 0 ) {
+							avcodec_send_packet( ctx, NULL );
+							draining = true;
+						} else {
+							if( packet->stream_index == t.audioStream ) {
+								avcodec_send_packet( ctx, packet );
+							}
+							av_packet_unref( packet );
+						}
+						continue;
+					}
+					if( ret < 0 ) {
+						complete = ret == AVERROR_EOF;
+						break;
+					}
+					if( planar ) {
+						meter.add( (const float* const*) frame->extended_data, frame->nb_samples );
+					} else {
+						for( int c = 0; c < channels; c++ ) {
+							if( planes[c].size() < (size_t) frame->nb_samples ) {
+								planes[c].resize( frame->nb_samples );
+							}
+							out[c] = (uint8_t*) planes[c].data();
+						}
+						int n = swr_convert( swr, out.data(), frame->nb_samples,
+							(const uint8_t**) frame->extended_data, frame->nb_samples );
+						if( n > 0 ) {
+							meter.add( (const float* const*) out.data(), n );
+						}
+					}
+					av_frame_unref( frame );
+				}
+				
+				info.audioStream = t.audioStream;
+				info.codecId = ctx->codec_id;
+				info.sampleRate = ctx->sample_rate;
+				info.duration = t.duration;
+				info.title = t.title;
+				info.artist = t.artist;
+				info.loudness = meter.integrated();
+				info.truePeak = meter.truePeak();
+				std::lock_guard<std::mutex> lck( mutexResults );
+				audioSeconds += (double) meter.length() / ctx->sample_rate;
+			} catch(const std::runtime_error&) {
+				complete = false;
+			}
+			av_packet_free( &packet );
+			av_frame_free( &frame );
+			if( swr ) {
+				swr_free( &swr );
+			}
+			return complete;
+		}
+		
+		void scanFile(const std::string& file) {
+			int64_t size = 0, mtime = 0;
+			bool identified = LibraryIndex::identify( file, size, mtime );
+			LibraryIndex::Info info;
+			if( index && identified && index->lookup( file, info ) && info.analyzed &&
+				info.size == size && info.mtime == mtime )
+			{
+				std::lock_guard<std::mutex> lck( mutexResults );
+				results[file] = Result{ info.loudness, info.truePeak };
+				cached++;
+				return;
+			}
+			
+			double cpu = threadCpu();
+			info = LibraryIndex::Info();
+			info.size = size;
+			info.mtime = mtime;
+			bool ok = measure( file, info );
+			{
+				std::lock_guard<std::mutex> lck( mutexResults );
+				cpuSeconds += threadCpu() - cpu;
+				if( ok ) {
+					results[file] = Result{ info.loudness, info.truePeak };
+				}
+			}
+			if( !ok ) {
+				failed++;
+				return;
+			}
+			analyzed++;
+			if( index && identified ) {
+				index->putLoudness( file, info );
+			}
+		}
+	
+	public:
+		//workers <= 0: one per core but one, which is left to playback
+		LoudnessScanner(LibraryIndex* index_, double target_ = -18, int workers_ = 0):
+			index(index_), target(target_), stopping(false), analyzed(0), cached(0), failed(0)
+		{
+			workers = workers_ > 0 ? workers_ : std::max( 1, (int) std::thread::hardware_concurrency() - 1 );
+			pool = new WorkerPool( workers );
+		}
+		//files still being measured are given up, queued ones dropped
+		~LoudnessScanner() {
+			stopping = true;
+			delete pool;
+		}
+		LoudnessScanner(const LoudnessScanner&) = delete;
+		LoudnessScanner& operator=(const LoudnessScanner&) = delete;
+		
+		//measures file in the background, unless the index knows it
+		void scan(const std::string& file) {
+			pool->submit( [this, file]() { scanFile( file ); } );
+		}
+		
+		bool result(const std::string& file, Result& r) {
+			std::lock_guard<std::mutex> lck( mutexResults );
+			auto it = results.find( file );
+			if( it == results.end() ) {
+				return false;
+			}
+			r = it->second;
+			return true;
+		}
+		//linear gain that brings file to the target loudness; false if it
+		//hasn't been measured (yet) or is silent
+		bool gain(const std::string& file, float& g) {
+			Result r;
+			if( !result( file, r ) || !std::isfinite( r.loudness ) ) {
+				return false;
+			}
+			double db = target - r.loudness;
+			if( std::isfinite( r.truePeak ) ) {
+				db = std::min( db, -1 - (double) r.truePeak );
+			}
+			g = pow( 10.0, db / 20 );
+			return true;
+		}
+		
+		std::string report() {
+			std::lock_guard<std::mutex> lck( mutexResults );
+			std::stringstream ss;
+			ss << "Loudness: " << analyzed << " analyzed";
+			if( cpuSeconds > 0 ) {
+				ss << " (" << std::setprecision(0) << std::fixed << audioSeconds / cpuSeconds << "x real time per core)";
+			}
+			ss << ", " << cached << " from the index, " << failed << " failed";
+			return ss.str();
+		}
+};
@@ -0,0 +1,140 @@
+#pragma once
+
+#include <string>
+#include <algorithm>
+
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+extern "C" {
+#include <libavformat/avformat.h>
+#include <libavformat/avio.h>
+#include <libavutil/mem.h>
+}
+
+//Serves a local file to libavformat from a read-only mapping instead of
+//the read() calls of its file protocol. The kernel is told the file is
+//read sequentially, and the next readahead bytes are asked for
+//(MADV_WILLNEED) whenever the demuxer gets within half of that of the
+//end of what has been asked for, so it rarely waits for a page fault.
+//Seeking only moves the position; readahead starts over from there.
+//The file mustn't be truncated while it's mapped (SIGBUS)
+
+class MappedInput {
+	private:
+		const uint8_t* data = nullptr;
+		size_t size = 0;
+		size_t pos = 0;
+		//range asked to be read ahead so far
+		size_t advisedFrom = 0;
+		size_t advisedTo = 0;
+		
+		AVIOContext* avio = nullptr;
+		static const int bufferSize = 65536;
+		static const size_t readahead = 4 << 20;
+		
+		MappedInput() {}
+		
+		void advise() {
+			if( pos >= advisedFrom && pos + readahead / 2 < advisedTo ) {
+				return;
+			}
+			size_t page = sysconf( _SC_PAGESIZE );
+			size_t from = pos / page * page;
+			size_t to = std::min( size, from + readahead );
+			madvise( (void*) (data + from), to - from, MADV_WILLNEED );
+			advisedFrom = from;
+			advisedTo = to;
+		}
+		
+		static int read(void* opaque, uint8_t* buf, int n) {
+			MappedInput* in = (MappedInput*) opaque;
+			if( in->pos >= in->size ) {
+				return AVERROR_EOF;
+			}
+			n = std::min( (size_t) n, in->size - in->pos );
+			in->advise();
+			memcpy( buf, in->data + in->pos, n );
+			in->pos += n;
+			return n;
+		}
+		static int64_t seek(void* opaque, int64_t offset, int whence) {
+			MappedInput* in = (MappedInput*) opaque;
+			switch( whence & ~AVSEEK_FORCE ) {
+				case AVSEEK_SIZE:
+					return in->size;
+				case SEEK_SET:
+					break;
+				case SEEK_CUR:
+					offset += in->pos;
+					break;
+				case SEEK_END:
+					offset += in->size;
+					break;
+				default:
+					return AVERROR(EINVAL);
+			}
+			if( offset < 0 || (size_t) offset > in->size ) {
+				return AVERROR(EINVAL);
+			}
+			in->pos = offset;
+			return offset;
+		}
+	
+	public:
+		~MappedInput() {
+			if( avio ) {
+				av_freep( &avio->buffer );
+				avio_context_free( &avio );
+			}
+			if( data ) {
+				munmap( (void*) data, size );
+			}
+		}
+		MappedInput(const MappedInput&) = delete;
+		MappedInput& operator=(const MappedInput&) = delete;
+		
+		//nullptr if the file can't be mapped, e.g. it isn't a regular
+		//file; it's opened the usual way then
+		static MappedInput* open(const std::string& fileName) {
+			int fd = ::open( fileName.c_str(), O_RDONLY | O_CLOEXEC );
+			if( fd < 0 ) {
+				return nullptr;
+			}
+			struct stat st;
+			void* base = MAP_FAILED;
+			if( fstat( fd, &st ) == 0 && S_ISREG( st.st_mode ) && st.st_size > 0 ) {
+				base = mmap( NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+			}
+			::close( fd );
+			if( base == MAP_FAILED ) {
+				return nullptr;
+			}
+			madvise( base, st.st_size, MADV_SEQUENTIAL );
+			
+			MappedInput* in = new MappedInput();
+			in->data = (const uint8_t*) base;
+			in->size = st.st_size;
+			unsigned char* buffer = (unsigned char*) av_malloc( bufferSize );
+			if( buffer ) {
+				in->avio = avio_alloc_context( buffer, bufferSize, 0, in, &MappedInput::read, NULL, &MappedInput::seek );
+			}
+			if( !in->avio ) {
+				av_free( buffer );
+				delete in;
+				return nullptr;
+			}
+			return in;
+		}
+		
+		//to be set as pb of a format context with AVFMT_FLAG_CUSTOM_IO
+		AVIOContext* context() {
+			return avio;
+		}
+};
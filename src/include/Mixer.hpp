@@ -0,0 +1,264 @@
+#pragma once
+
+#include <deque>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <thread>
+#include <string>
+#include <sstream>
+#include <iomanip>
+
+#include "OpenAL.h"
+#include "Loader.hpp"
+#include "RingBuffer.hpp"
+#include "OutputFormat.hpp"
+#include "Scheduler.hpp"
+#include "StealingPool.hpp"
+#include "Stats.hpp"
+
+//Plays many files at once, each on a source of its own at its own
+//position: every stream has its own Loader, ring of decoded chunks and
+//buffer queue. Instead of a decoder thread per stream, the next chunks
+//of a stream are decoded by a job on a StealingPool whenever its ring
+//has room; at most one job per stream is queued or running, so each
+//Loader is still used by one thread at a time. The playback thread
+//calls service(), which uploads what has been decoded, restarts sources
+//that ran dry and counts that as an underrun of the stream
+
+class Mixer {
+	public:
+		struct Stream {
+			std::string fileName;
+			Loader load;
+			PcmRing ring;
+			Source* source;
+			int queue;					//number of the source in the scheduler
+			std::vector<ALuint> spare;
+			std::vector<ALuint> uploaded;	//by this service(), not queued yet
+			
+			//decoder side
+			std::atomic<bool> scheduled;
+			std::atomic<bool> ended;	//the ring has been finished
+			long decoded = 0;			//bytes since the last restart
+			
+			//playback side
+			bool started = false;
+			long underruns = 0;
+			long chunks = 0;
+			double seconds = 0;			//of audio uploaded
+			
+			Stream(std::string fileName_, int ringChunks, int chunkSize):
+				fileName(fileName_), ring(ringChunks, chunkSize), scheduled(false), ended(false) {}
+		};
+	
+	private:
+		OpenAL& al;
+		OutputFormat& formats;
+		StealingPool& pool;
+		Stats* stats = nullptr;
+		
+		//a deque, so the decode jobs can keep references
+		std::deque<Stream> streams;
+		std::unique_ptr<Scheduler> sched;
+		
+		int numBuffers;
+		int ringChunks;
+		int chunkSize;
+		float chunkMs;
+		bool loop = true;
+		
+		std::atomic<bool> stopping;
+		
+		//decodes into the ring of s until it's full. a looping stream
+		//starts over at its end, unless nothing of it could be played
+		void decode(Stream& s) {
+			PcmChunk* chunk;
+			while( !stopping && (chunk = s.ring.writeSlot()) ) {
+				s.load.fillAudioBuffer( *chunk );
+				if( chunk->size > 0 ) {
+					s.decoded += chunk->size;
+					s.ring.commitWrite();
+				}
+				if( s.load.complete() ) {
+					if( !loop || s.decoded == 0 ) {
+						s.ended = true;
+						s.ring.finish();
+						break;
+					}
+					bool restart;
+					s.load.seek( 0, 0, restart );
+					s.decoded = 0;
+				}
+			}
+			s.scheduled = false;
+		}
+		
+	
+	public:
+		//generates a source and buffers for each of num streams. the
+		//OpenAL object mustn't generate any more afterwards, as that moves
+		//its sources and buffers
+		Mixer(OpenAL& al_, OutputFormat& formats_, StealingPool& pool_, int num, int buffers, float chunkMs_):
+			al(al_), formats(formats_), pool(pool_), numBuffers(buffers), chunkMs(chunkMs_), stopping(false)
+		{
+			//the source's queue covers the latency, the ring only has to
+			//keep the decoder a queue ahead. chunks have room for chunkMs of
+			//float at 192 kHz, mono if spatialized, plus a decoded frame
+			ringChunks = numBuffers;
+			int channels = formats.spatial() ? 1 : 8;
+			chunkSize = (int) (chunkMs * 192 * 4 * channels) + 65536;
+			al.genSources( num ).genBuffers( num * numBuffers );
+		}
+		~Mixer() {
+			stopping = true;
+			for( auto& s : streams ) {
+				while( s.scheduled ) {
+					std::this_thread::yield();
+				}
+			}
+		}
+		Mixer(const Mixer&) = delete;
+		Mixer& operator=(const Mixer&) = delete;
+		
+		Mixer& setStats(Stats* stats_) {
+			stats = stats_;
+			
+			return *this;
+		}
+		//streams start over at their end (default) or stop
+		Mixer& setLoop(bool loop_) {
+			loop = loop_;
+			
+			return *this;
+		}
+		
+		//plays file on the next source, at x, y, z
+		Mixer& add(std::string file, ALfloat x, ALfloat y, ALfloat z, ALfloat gain = 1) {
+			int n = streams.size();
+			if( (uint) n >= al.sources.size() ) {
+				throw std::runtime_error("No source left for " + file);
+			}
+			streams.emplace_back( file, ringChunks, chunkSize );
+			Stream& s = streams.back();
+			s.load.negotiateFormat( &formats ).setChunkDuration( chunkMs ).setPreroll( 0 ).setStats( stats )
+				.setCodecThreads( CodecThreads( pool.size() ) );
+			s.load.add( file );
+			s.source = &al.sources[n];
+			s.source->setPitch(1).setGain(gain).setPosition(x, y, z).setVelocity(0, 0, 0).disableLooping();
+			for( int b = 0; b < numBuffers; b++ ) {
+				s.spare.push_back( al.buffers[n * numBuffers + b].buffer );
+			}
+			s.uploaded.reserve( numBuffers );
+			if( !sched ) {
+				sched.reset( new Scheduler( *s.source ) );
+				s.queue = 0;
+			} else {
+				s.queue = sched->addSource( *s.source );
+			}
+			
+			return *this;
+		}
+		
+		//one pass over all streams: takes back played buffers, uploads
+		//decoded chunks, (re)starts sources and schedules decode jobs.
+		//false once every stream has played to its end
+		bool service() {
+			bool playing = false;
+			for( auto& s : streams ) {
+				bool stopped = s.source->getState() != AL_PLAYING;
+				//played buffers come back in one call
+				size_t n = s.spare.size();
+				s.spare.resize( numBuffers );
+				ALsizei played = s.source->detachBuffers( &s.spare[n], numBuffers - n );
+				s.spare.resize( n + played );
+				for( ALsizei i = 0; i < played; i++ ) {
+					sched->unqueue( s.queue );
+				}
+				
+				PcmChunk* chunk;
+				while( !s.spare.empty() && (chunk = s.ring.readSlot()) ) {
+					{
+						Stats::Timer timer( stats, Stats::Upload );
+						al.findBuffer( s.spare.back() ).setData(
+							formats.alFormat( chunk->channels, chunk->format ), chunk->pcm(), chunk->size, chunk->freq
+						);
+					}
+					s.uploaded.push_back( s.spare.back() );
+					s.spare.pop_back();
+					sched->queue( chunk->size / chunk->frameSize, chunk->freq, s.queue );
+					s.chunks++;
+					s.seconds += (double) chunk->size / chunk->frameSize / chunk->freq;
+					if( stats ) {
+						stats->add( Stats::UploadedBytes, chunk->size );
+					}
+					s.ring.commitRead();
+				}
+				s.source->attachBuffers( s.uploaded.data(), s.uploaded.size() );
+				s.uploaded.clear();
+				
+				//a source that stopped with buffers queued ran dry
+				bool attached = s.source->getAttachedBuffers() > 0;
+				if( stopped && attached ) {
+					if( s.started ) {
+						s.underruns++;
+						if( stats ) {
+							stats->add( Stats::Underruns );
+						}
+					}
+					s.started = true;
+					s.source->play();
+				}
+				
+				if( !s.ended && !s.scheduled && s.ring.filled() < (size_t) ringChunks ) {
+					s.scheduled = true;
+					Stream* p = &s;
+					pool.submit( [this, p]() { decode( *p ); } );
+				}
+				if( !s.ring.done() || attached || !stopped ) {
+					playing = true;
+				}
+			}
+			return playing;
+		}
+		
+		//sleeps until a buffer of any stream has been played, at most
+		//maxSeconds
+		void wait(double maxSeconds) {
+			if( sched ) {
+				sched->wait( maxSeconds );
+			} else {
+				std::this_thread::sleep_for( std::chrono::duration<double>( maxSeconds ) );
+			}
+		}
+		
+		int size() {
+			return streams.size();
+		}
+		Stream& stream(int i) {
+			return streams[i];
+		}
+		long underruns() {
+			long n = 0;
+			for( auto& s : streams ) {
+				n += s.underruns;
+			}
+			return n;
+		}
+		
+		//underruns and uploads per stream as one line of JSON
+		std::string json() {
+			std::stringstream ss;
+			ss << std::fixed << std::setprecision(3);
+			ss << "{\"streams\": " << streams.size() << ", \"workers\": " << pool.size()
+				<< ", \"stolen\": " << pool.stolen() << ", \"underruns\": " << underruns()
+				<< ", \"per_stream\": [";
+			for( uint i = 0; i < streams.size(); i++ ) {
+				Stream& s = streams[i];
+				ss << (i ? ", " : "") << "{\"file\": \"" << s.fileName << "\", \"underruns\": " << s.underruns
+					<< ", \"chunks\": " << s.chunks << ", \"seconds\": " << s.seconds << "}";
+			}
+			ss << "]}";
+			return ss.str();
+		}
+};
@@ -1,3 +1,5 @@
+#pragma once
+
 #include <AL/al.h>
 #include <AL/alc.h>
 #include <AL/alext.h>
@@ -5,6 +7,11 @@
 #include <stdexcept>
 #include <sstream>
 #include <array>
+#include <vector>
+#include <algorithm>
+#include <utility>
+#include <unordered_map>
+#include <cstdint>
 
 #include <string.h>
 #include <assert.h>
@@ -17,13 +24,24 @@ class OpenALError {
 		ALint error;
 		
 		void resetErrorStack() { alGetError(); }
-		void errorCheck(std::string errorMsg) {
+		void errorCheck(const char* errorMsg) {
 			if((error = alGetError()) != AL_NO_ERROR) {
 				std::stringstream msg;
 				msg << errorMsg << " 0x" << std::hex << error << std::endl;
 				throw std::runtime_error(msg.str());
 			}
 		}
+		
+		//checks after setting properties, queueing and uploading, which
+		//may run for many sources at high rates. built with AL_UNCHECKED
+		//they're left out; creating objects is checked either way
+#ifdef AL_UNCHECKED
+		void resetHotErrors() {}
+		void checkHot(const char*) {}
+#else
+		void resetHotErrors() { resetErrorStack(); }
+		void checkHot(const char* errorMsg) { errorCheck( errorMsg ); }
+#endif
 };
 
 //implementing the listener
@@ -33,84 +51,97 @@ class Listener: OpenALError {
 		~Listener() {};
 		
 		Listener& setPosition(ALfloat x, ALfloat y, ALfloat z) {
-			resetErrorStack();
+			resetHotErrors();
 			alListener3f(AL_POSITION, x, y, z);
-			errorCheck("Couldn't set Listener-Position.");
+			checkHot("Couldn't set Listener-Position.");
 			
 			return *this;
 		}
 		Listener& setPosition(std::vector<ALfloat> pos) {
 			assert(pos.size() == 3);
-			resetErrorStack();
+			resetHotErrors();
 			alListenerfv(AL_POSITION, pos.data());
-			errorCheck("Couldn't set Listener-Position.");
+			checkHot("Couldn't set Listener-Position.");
 			
 			return *this;
 		}
 		void getPosition(ALfloat* x, ALfloat* y, ALfloat* z) {
-			resetErrorStack();
+			resetHotErrors();
 			alGetListener3f(AL_POSITION, x, y, z);
-			errorCheck("Couldn't retrieve position.");
+			checkHot("Couldn't retrieve position.");
 		}
 		std::vector<ALfloat> getPosition() {
 			std::vector<ALfloat> pos(3);
-			resetErrorStack();
+			resetHotErrors();
 			alGetListenerfv(AL_POSITION, pos.data());
-			errorCheck("Couldn't retrieve position.");
+			checkHot("Couldn't retrieve position.");
 			return pos;
 		}
 		
 		Listener& setVelocity(ALfloat vx, ALfloat vy, ALfloat vz) {
-			resetErrorStack();
+			resetHotErrors();
 			alListener3f(AL_VELOCITY, vx, vy, vz);
-			errorCheck("Couldn't set Listener-Velocity.");
+			checkHot("Couldn't set Listener-Velocity.");
 			
 			return *this;
 		}
 		Listener& setVelocity(std::array<ALfloat,3> v) {
-			resetErrorStack();
+			resetHotErrors();
 			alListenerfv(AL_VELOCITY, v.data());
-			errorCheck("Couldn't set Listener-Velocity.");
+			checkHot("Couldn't set Listener-Velocity.");
 			return *this;
 		}
 		void getVelocity(ALfloat* x, ALfloat* y, ALfloat* z) {
-			resetErrorStack();
+			resetHotErrors();
 			alGetListener3f(AL_VELOCITY, x, y, z);
-			errorCheck("Couldn't retrieve velocity.");
+			checkHot("Couldn't retrieve velocity.");
 		}
 		std::array<ALfloat,3> getVelocity() {
 			std::array<ALfloat,3> v;
-			resetErrorStack();
+			resetHotErrors();
 			alGetListenerfv(AL_VELOCITY, v.data());
-			errorCheck("Couldn't retrieve velocity.");
+			checkHot("Couldn't retrieve velocity.");
 			
 			return v;
 		}
 		
 		
 		Listener& setOrientation(std::array<ALfloat,6> ori) {
-			resetErrorStack();
+			resetHotErrors();
 			alListenerfv(AL_ORIENTATION, ori.data());
-			errorCheck("Couldn't set orientation.");
+			checkHot("Couldn't set orientation.");
 			
 			return *this;
 		}
 		std::array<ALfloat,6> getOrientation() {
 			std::array<ALfloat,6> ori;
-			resetErrorStack();
+			resetHotErrors();
 			alGetListenerfv(AL_ORIENTATION, ori.data());
-			errorCheck("Couldn't retrieve orientation.");
+			checkHot("Couldn't retrieve orientation.");
 			
 			return ori;
 		}
 };
 
-//implementing a buffer
+//implementing a buffer. it owns the AL buffer, so it can be moved but
+//not copied: a copy's destructor would delete the buffer
 class Buffer: OpenALError {
 	private:
 	
 	public:
-		ALuint buffer;
+		ALuint buffer = 0;
+		
+		Buffer() {}
+		Buffer(Buffer&& other) noexcept: buffer(other.buffer) {
+			other.buffer = 0;
+		}
+		Buffer& operator=(Buffer&& other) noexcept {
+			std::swap( buffer, other.buffer );
+			
+			return *this;
+		}
+		Buffer(const Buffer&) = delete;
+		Buffer& operator=(const Buffer&) = delete;
 		
 		void genBuffer() {
 			resetErrorStack();
@@ -118,24 +149,48 @@ class Buffer: OpenALError {
 			errorCheck("Coudln't create buffer");
 		}
 		~Buffer() {
-			alDeleteBuffers(1, &buffer);
+			if( buffer ) {
+				alDeleteBuffers(1, &buffer);
+			}
 		}
 		
-		Buffer& setData(ALenum format, ALvoid* data, ALsizei size, ALsizei freq) {
-			resetErrorStack();
+		Buffer& setData(ALenum format, const ALvoid* data, ALsizei size, ALsizei freq) {
+			resetHotErrors();
 			alBufferData(buffer, format, data, size, freq);
-			errorCheck("Coudln't load data to buffer.");
+			checkHot("Coudln't load data to buffer.");
 			
 			return *this;
 		}
+		//sample rate the data has been loaded with
+		ALint getFrequency() {
+			ALint freq;
+			resetHotErrors();
+			alGetBufferi(buffer, AL_FREQUENCY, &freq);
+			checkHot("Couldn't retrieve buffer frequency");
+			
+			return freq;
+		}
 };
 
-//implementing the source
+//implementing the source. like Buffer it owns the AL source and is
+//move-only
 class Source: OpenALError {
 	protected:
 		
 	public:
-		ALuint source;
+		ALuint source = 0;
+		
+		Source() {}
+		Source(Source&& other) noexcept: source(other.source) {
+			other.source = 0;
+		}
+		Source& operator=(Source&& other) noexcept {
+			std::swap( source, other.source );
+			
+			return *this;
+		}
+		Source(const Source&) = delete;
+		Source& operator=(const Source&) = delete;
 		
 		void genSource() {
 			resetErrorStack();
@@ -143,202 +198,275 @@ class Source: OpenALError {
 			errorCheck("Couldn't create source");
 		}
 		~Source() {
-			alDeleteSources(1, &source);
+			if( source ) {
+				alDeleteSources(1, &source);
+			}
 		}
 		
 		Source& setPitch(ALfloat pitch) {
-			resetErrorStack();
+			resetHotErrors();
 			alSourcef(source, AL_PITCH, pitch);
-			errorCheck("Couldn't set pitch");
+			checkHot("Couldn't set pitch");
 			
 			return *this;
 		}
 		ALfloat getPitch() {
 			ALfloat pitch;
-			resetErrorStack();
+			resetHotErrors();
 			alGetSourcef(source, AL_PITCH, &pitch);
-			errorCheck("Couldn't retrieve pitch.");
+			checkHot("Couldn't retrieve pitch.");
 			
 			return pitch;
 		}
 		
 		Source& setGain(ALfloat gain) {
-			resetErrorStack();
+			resetHotErrors();
 			alSourcef(source, AL_GAIN, gain);
-			errorCheck("Couldn't set source-gain.");
+			checkHot("Couldn't set source-gain.");
+			
+			return *this;
+		}
+		//AL_GAIN is clamped to this, 1 by default
+		Source& setMaxGain(ALfloat gain) {
+			resetHotErrors();
+			alSourcef(source, AL_MAX_GAIN, gain);
+			checkHot("Couldn't set max. source-gain.");
 			
 			return *this;
 		}
 		ALfloat getGain() {
 			ALfloat gain;
-			resetErrorStack();
+			resetHotErrors();
 			alGetSourcef(source, AL_GAIN, &gain);
-			errorCheck("Couldn't get source-gain.");
+			checkHot("Couldn't get source-gain.");
 			
 			return gain;
 		}
 		
 		Source& setPosition(ALfloat x, ALfloat y, ALfloat z) {
-			resetErrorStack();
+			resetHotErrors();
 			alSource3f(source, AL_POSITION, x, y, z);
-			errorCheck("Couldn't set source-Position.");
+			checkHot("Couldn't set source-Position.");
 			
 			return *this;
 		}
 		Source& setPosition(std::array<ALfloat,3> pos) {
-			resetErrorStack();
+			resetHotErrors();
 			alSourcefv(source, AL_POSITION, pos.data());
-			errorCheck("Couldn't set source-Position.");
+			checkHot("Couldn't set source-Position.");
 			
 			return *this;
 		}
 		Source& getPosition(ALfloat* x, ALfloat* y, ALfloat* z) {
-			resetErrorStack();
+			resetHotErrors();
 			alGetSource3f(source, AL_POSITION, x, y, z);
-			errorCheck("Couldn't retrieve position.");
+			checkHot("Couldn't retrieve position.");
 			
 			return *this;
 		}
 		std::array<ALfloat,3> getPosition() {
 			std::array<ALfloat,3> pos;
-			resetErrorStack();
+			resetHotErrors();
 			alGetSourcefv(source, AL_POSITION, pos.data());
-			errorCheck("Couldn't retrieve position.");
+			checkHot("Couldn't retrieve position.");
 			return pos;
 		}
 		
 		Source& setVelocity(ALfloat vx, ALfloat vy, ALfloat vz) {
-			resetErrorStack();
+			resetHotErrors();
 			alSource3f(source, AL_VELOCITY, vx, vy, vz);
-			errorCheck("Couldn't set source-Velocity.");
+			checkHot("Couldn't set source-Velocity.");
 			
 			return *this;
 		}
 		Source& setVelocity(std::array<ALfloat,3> v) {
-			resetErrorStack();
+			resetHotErrors();
 			alSourcefv(source, AL_VELOCITY, v.data());
-			errorCheck("Couldn't set source-Velocity.");
+			checkHot("Couldn't set source-Velocity.");
 			
 			return *this;
 		}
 		Source& getVelocity(ALfloat* x, ALfloat* y, ALfloat* z) {
-			resetErrorStack();
+			resetHotErrors();
 			alGetSource3f(source, AL_VELOCITY, x, y, z);
-			errorCheck("Couldn't retrieve velocity.");
+			checkHot("Couldn't retrieve velocity.");
 			
 			return *this;
 		}
 		std::array<ALfloat,3> getVelocity() {
 			std::array<ALfloat,3> v;
-			resetErrorStack();
+			resetHotErrors();
 			alGetSourcefv(source, AL_VELOCITY, v.data());
-			errorCheck("Couldn't retrieve velocity.");
+			checkHot("Couldn't retrieve velocity.");
 			
 			return v;
 		}
 		
 		Source& setLooping(ALint loop) {
-			resetErrorStack();
+			resetHotErrors();
 			alSourcei(source, AL_LOOPING, loop);
-			errorCheck("Couldn't set source-looping.");
+			checkHot("Couldn't set source-looping.");
 			
 			return *this;
 		}
 		ALint getLooping() {
 			ALint loop;
-			resetErrorStack();
+			resetHotErrors();
 			alGetSourcei(source, AL_LOOPING, &loop);
-			errorCheck("Couldn't retrieve source-looping.");
+			checkHot("Couldn't retrieve source-looping.");
 			
 			return loop;
 		}
 		Source& enableLooping() {
-			resetErrorStack();
+			resetHotErrors();
 			alSourcei(source, AL_LOOPING, AL_TRUE);
-			errorCheck("Couldn't retrieve source-looping.");
+			checkHot("Couldn't retrieve source-looping.");
 			
 			return *this;
 		}
 		Source& disableLooping() {
-			resetErrorStack();
+			resetHotErrors();
 			alSourcei(source, AL_LOOPING, AL_FALSE);
-			errorCheck("Couldn't retrieve source-looping.");
+			checkHot("Couldn't retrieve source-looping.");
 			
 			return *this;
 		}
 		
 		ALint getState() {
 			ALint sourceState;
-			resetErrorStack();
+			resetHotErrors();
 			alGetSourcei(source, AL_SOURCE_STATE, &sourceState);
-			errorCheck("Couldn't retrieve source-state");
+			checkHot("Couldn't retrieve source-state");
 			
 			return sourceState;
 		}
 		
+		//playback position in samples within the buffer currently playing
+		ALint getSampleOffset() {
+			ALint offset;
+			resetHotErrors();
+			alGetSourcei(source, AL_SAMPLE_OFFSET, &offset);
+			checkHot("Couldn't retrieve sample offset.");
+			
+			return offset;
+		}
+		//sample offset and how long until it's heard, in seconds. with
+		//AL_SOFT_source_latency both come from the same mixer update,
+		//otherwise the latency is unknown (0)
+		Source& getSampleOffsetLatency(int64_t& offset, double& latency) {
+#ifdef AL_SOFT_source_latency
+			static LPALGETSOURCEI64VSOFT getSourcei64v = alIsExtensionPresent("AL_SOFT_source_latency") ?
+				(LPALGETSOURCEI64VSOFT) alGetProcAddress("alGetSourcei64vSOFT") : NULL;
+			if( getSourcei64v ) {
+				ALint64SOFT v[2];
+				resetHotErrors();
+				getSourcei64v( source, AL_SAMPLE_OFFSET_LATENCY_SOFT, v );
+				checkHot("Couldn't retrieve sample offset and latency.");
+				//32.32 fixed point samples, nanoseconds
+				offset = v[0] >> 32;
+				latency = v[1] / 1e9;
+				
+				return *this;
+			}
+#endif
+			offset = getSampleOffset();
+			latency = 0;
+			
+			return *this;
+		}
+		
 		Source& play() {
 			alSourcePlay(source);
 			
 			return *this;
 		}
+		//all queued buffers count as processed afterwards
+		Source& stop() {
+			alSourceStop(source);
+			
+			return *this;
+		}
 		
-		Source& setBuffer( Buffer buf ) {
-			resetErrorStack();
+		Source& setBuffer( const Buffer& buf ) {
+			resetHotErrors();
 			alSourcei( source, AL_BUFFER, buf.buffer );
-			errorCheck("Couldn't attach buffer to source.");
+			checkHot("Couldn't attach buffer to source.");
 			
 			return *this;
 		}
 		
-		Source& attachBuffer( Buffer buf ) {
-			resetErrorStack();
+		Source& attachBuffer( const Buffer& buf ) {
+			resetHotErrors();
 			alSourceQueueBuffers(source, 1, &buf.buffer);
-			errorCheck("Couldn't attach buffer to source.");
+			checkHot("Couldn't attach buffer to source.");
 			
 			return *this;
 		}
-		Source& attachBuffers( std::vector<Buffer> attachBuffs ) {
+		//queues n buffers in one call, in the order given
+		Source& attachBuffers( const ALuint* bufs, ALsizei n ) {
+			if( n <= 0 ) {
+				return *this;
+			}
+			resetHotErrors();
+			alSourceQueueBuffers(source, n, bufs);
+			checkHot("Couldn't attach buffers to source.");
+			
+			return *this;
+		}
+		Source& attachBuffers( const std::vector<Buffer>& attachBuffs ) {
 			std::vector<ALuint> bufs(attachBuffs.size());
 			for(ulong i = 0; i < attachBuffs.size(); i++) {
 				bufs[i] = attachBuffs[i].buffer;
 			}
 			
-			resetErrorStack();
+			resetHotErrors();
 			alSourceQueueBuffers(source, bufs.size(), bufs.data());
-			errorCheck("Couldn't attach buffers to source.");
+			checkHot("Couldn't attach buffers to source.");
 			
 			return *this;			
 		}
 		
 		ALint getAttachedBuffers() {
 			ALint num;
-			resetErrorStack();
+			resetHotErrors();
 			alGetSourcei( source, AL_BUFFERS_QUEUED, &num );
-			errorCheck("Couldn't fetch number of attached buffers");
+			checkHot("Couldn't fetch number of attached buffers");
 			
 			return num;
 		}
 		ALint getProcessedBuffers() {
 			ALint num;
-			resetErrorStack();
+			resetHotErrors();
 			alGetSourcei( source, AL_BUFFERS_PROCESSED, &num );
-			errorCheck("Couldn't fetch number of processed buffers.");
+			checkHot("Couldn't fetch number of processed buffers.");
 			
 			return num;
 		}
 		std::vector<ALuint> detachBuffers(int n) {
 			std::vector<ALuint> bufs(n);
-			resetErrorStack();
+			resetHotErrors();
 			alSourceUnqueueBuffers( source, n, bufs.data() );
-			errorCheck( "Couldn't detach buffers." );
+			checkHot( "Couldn't detach buffers." );
 			
 			return bufs;
 		}
+		//detaches the processed buffers, at most max of them, into bufs in
+		//one call. returns how many
+		ALsizei detachBuffers(ALuint* bufs, ALsizei max) {
+			ALsizei n = std::min( (ALsizei) getProcessedBuffers(), max );
+			if( n > 0 ) {
+				resetHotErrors();
+				alSourceUnqueueBuffers( source, n, bufs );
+				checkHot( "Couldn't detach buffers." );
+			}
+			
+			return n;
+		}
 		ALuint detachBuffer() {
 			ALuint detached;
-			resetErrorStack();
+			resetHotErrors();
 			alSourceUnqueueBuffers( source, 1, &detached );
-			errorCheck("Couldn't detach buffer.");
+			checkHot("Couldn't detach buffer.");
 			
 			return detached;
 		}
@@ -347,14 +475,23 @@ class Source: OpenALError {
 //very basic class for global info, and some book-keeping
 class OpenAL: OpenALError {
 	private:
-		ALCdevice* device;
-		ALCcontext* context;
+		ALCdevice* device = NULL;
+		ALCcontext* context = NULL;
+		
+		//ALC_SOFT_loopback: the device doesn't play, the mix is pulled
+		LPALCRENDERSAMPLESSOFT alcRenderSamplesSOFT = NULL;
 		ALint error;
 		
+		//AL_SOFT_deferred_updates, looked up once the context is current
+		LPALDEFERUPDATESSOFT alDeferUpdatesSOFT = NULL;
+		LPALPROCESSUPDATESSOFT alProcessUpdatesSOFT = NULL;
+		
 	public:
 		std::vector<Source> sources;
 		std::vector<Buffer> buffers;
 		Listener listener;
+		//index into buffers by AL name, for findBuffer
+		std::unordered_map<ALuint, size_t> bufferIndex;
 		
 		LPALGENEFFECTS alGenEffects;
 		LPALDELETEEFFECTS alDeleteEffects;
@@ -365,11 +502,11 @@ class OpenAL: OpenALError {
 		}
 	
 	
-		std::vector<Source> getSources() {
+		std::vector<Source>& getSources() {
 			return sources;
 		}
 	
-		std::vector<Buffer> getBuffers() {
+		std::vector<Buffer>& getBuffers() {
 			return buffers;
 		}
 	
@@ -388,19 +525,52 @@ class OpenAL: OpenALError {
 			buffers.resize( sizes + num);
 			for(uint i = sizes; i < sizes + num; i++) {
 				buffers[i].genBuffer();
+				bufferIndex[buffers[i].buffer] = i;
 			}
 			
 			return *this;
 		}
 		
 		Buffer& findBuffer(ALuint buf) {
-			for( uint i = 0; i < buffers.size(); i++ ) {
-				if( buffers[i].buffer == buf ) {
-					return buffers[i];
-				}
+			auto it = bufferIndex.find( buf );
+			if( it == bufferIndex.end() ) {
+				throw std::runtime_error("Couldn't find corresponding buffer.");
+			}
+			return buffers[it->second];
+		}
+		
+		//source and listener changes made between deferUpdates() and
+		//processUpdates() take effect together, in the same mix. without
+		//AL_SOFT_deferred_updates each one takes effect right away
+		OpenAL& deferUpdates() {
+			if( alDeferUpdatesSOFT && alProcessUpdatesSOFT ) {
+				alDeferUpdatesSOFT();
+			}
+			
+			return *this;
+		}
+		OpenAL& processUpdates() {
+			if( alDeferUpdatesSOFT && alProcessUpdatesSOFT ) {
+				alProcessUpdatesSOFT();
 			}
-			throw std::runtime_error("Couldn't find corresponding buffer.");
+			
+			return *this;
 		}
+		//defers updates for as long as it lives
+		class Batch {
+			private:
+				OpenAL& al;
+			
+			public:
+				Batch(OpenAL& al_): al(al_) {
+					al.deferUpdates();
+				}
+				~Batch() {
+					al.processUpdates();
+				}
+				Batch(const Batch&) = delete;
+				Batch& operator=(const Batch&) = delete;
+		};
 		
 		OpenAL& getEFXFuncPointers() {
 			alGenEffects 	= (LPALGENEFFECTS) 		alGetProcAddress("alGenEffects");
@@ -418,12 +588,23 @@ class OpenAL: OpenALError {
 			resetErrorStack();
 			alcMakeContextCurrent( context );
 			errorCheck("Couldn't make context current.");
+#ifdef AL_SOFT_deferred_updates
+			if( alIsExtensionPresent("AL_SOFT_deferred_updates") ) {
+				alDeferUpdatesSOFT = (LPALDEFERUPDATESSOFT) alGetProcAddress("alDeferUpdatesSOFT");
+				alProcessUpdatesSOFT = (LPALPROCESSUPDATESSOFT) alGetProcAddress("alProcessUpdatesSOFT");
+			}
+#endif
 			
 			return *this;
 		}
 	
-		OpenAL& createContext() {
+		//monoSources: sources mixed at once, if more than the device's
+		//default (256 with OpenAL Soft)
+		OpenAL& createContext(int monoSources = 0) {
 			std::vector<ALint> auxSends{ALC_MAX_AUXILIARY_SENDS, 4,0,0};
+			if( monoSources > 0 ) {
+				auxSends.insert( auxSends.begin() + 2, { ALC_MONO_SOURCES, monoSources } );
+			}
 			resetErrorStack();
 			context = alcCreateContext( device, auxSends.data() );
 			if(!context) {
@@ -464,6 +645,55 @@ class OpenAL: OpenALError {
 			buffers.clear();
 		}
 		
+		//opens a loopback device instead of a real one. nothing is played;
+		//createLoopbackContext() sets the format and renderSamples() mixes
+		enum DeviceType { Loopback };
+		OpenAL(DeviceType) {
+			LPALCLOOPBACKOPENDEVICESOFT alcLoopbackOpenDeviceSOFT = NULL;
+			if( alcIsExtensionPresent( NULL, "ALC_SOFT_loopback" ) ) {
+				alcLoopbackOpenDeviceSOFT = (LPALCLOOPBACKOPENDEVICESOFT)
+					alcGetProcAddress( NULL, "alcLoopbackOpenDeviceSOFT" );
+				alcRenderSamplesSOFT = (LPALCRENDERSAMPLESSOFT)
+					alcGetProcAddress( NULL, "alcRenderSamplesSOFT" );
+			}
+			if( !alcLoopbackOpenDeviceSOFT || !alcRenderSamplesSOFT ) {
+				throw std::runtime_error("ALC_SOFT_loopback isn't supported.");
+			}
+			device = alcLoopbackOpenDeviceSOFT( NULL );
+			if( !device ) {
+				throw std::runtime_error("Couldn't open loopback device.");
+			}
+		}
+		
+		//renders stereo float at freq
+		OpenAL& createLoopbackContext(ALCint freq) {
+			std::vector<ALCint> attrs{
+				ALC_FREQUENCY, freq,
+				ALC_FORMAT_CHANNELS_SOFT, ALC_STEREO_SOFT,
+				ALC_FORMAT_TYPE_SOFT, ALC_FLOAT_SOFT,
+				0
+			};
+			context = alcCreateContext( device, attrs.data() );
+			if( !context ) {
+				throw std::runtime_error("Couldn't create loopback context.");
+			}
+			
+			return *this;
+		}
+		//rate the device mixes at, which sources of another rate are
+		//resampled to
+		int frequency() {
+			ALCint freq = 0;
+			alcGetIntegerv( device, ALC_FREQUENCY, 1, &freq );
+			return freq;
+		}
+		//mixes the next samples of the loopback device into buf
+		OpenAL& renderSamples(ALvoid* buf, ALCsizei samples) {
+			alcRenderSamplesSOFT( device, buf, samples );
+			
+			return *this;
+		}
+		
 		~OpenAL() {
 			//~ device = alcGetContextsDevice(context);
 			//~ alcMakeContextCurrent(NULL);
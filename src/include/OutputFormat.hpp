@@ -0,0 +1,145 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+
+#include "OpenAL.h"
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavutil/channel_layout.h>
+#include <libavutil/samplefmt.h>
+}
+
+//Negotiates the PCM format songs are played in with the OpenAL device.
+//The device is asked which buffer formats it accepts (AL_EXT_float32,
+//AL_EXT_MCFORMATS); each song is played in the closest one to what its
+//decoder outputs, so nothing is converted that doesn't have to be.
+//Only if the source is spatialized everything is mixed down to mono, as
+//OpenAL doesn't position multichannel buffers. A source only queues
+//buffers of one format and rate, so the player lets a source run dry
+//before it queues a song in another one
+
+class OutputFormat {
+	public:
+		struct Format {
+			const char* name;	//AL_FORMAT_* enum name
+			uint64_t layout;
+			enum AVSampleFormat fmt;
+			ALenum al;			//0 if the device doesn't accept it
+		};
+	
+	private:
+		//fixed order, the index is the bit in mask()
+		std::vector<Format> formats;
+		bool spatialize;
+		
+		static bool sameLayout(const AVChannelLayout& in, uint64_t layout) {
+			if( in.nb_channels <= 2 ) {
+				return in.nb_channels == av_popcount64( layout );
+			}
+			if( in.order != AV_CHANNEL_ORDER_NATIVE ) {
+				return false;
+			}
+			//5.1 with side or back surrounds is played the same way
+			if( layout == AV_CH_LAYOUT_5POINT1_BACK ) {
+				return in.u.mask == AV_CH_LAYOUT_5POINT1_BACK || in.u.mask == AV_CH_LAYOUT_5POINT1;
+			}
+			return in.u.mask == layout;
+		}
+	
+	public:
+		//needs a current context to query the device
+		OutputFormat(bool spatialize_): spatialize(spatialize_) {
+			formats = {
+				{ "AL_FORMAT_MONO8", AV_CH_LAYOUT_MONO, AV_SAMPLE_FMT_U8, 0 },
+				{ "AL_FORMAT_MONO16", AV_CH_LAYOUT_MONO, AV_SAMPLE_FMT_S16, 0 },
+				{ "AL_FORMAT_STEREO8", AV_CH_LAYOUT_STEREO, AV_SAMPLE_FMT_U8, 0 },
+				{ "AL_FORMAT_STEREO16", AV_CH_LAYOUT_STEREO, AV_SAMPLE_FMT_S16, 0 },
+				{ "AL_FORMAT_MONO_FLOAT32", AV_CH_LAYOUT_MONO, AV_SAMPLE_FMT_FLT, 0 },
+				{ "AL_FORMAT_STEREO_FLOAT32", AV_CH_LAYOUT_STEREO, AV_SAMPLE_FMT_FLT, 0 },
+				{ "AL_FORMAT_QUAD16", AV_CH_LAYOUT_QUAD, AV_SAMPLE_FMT_S16, 0 },
+				{ "AL_FORMAT_51CHN16", AV_CH_LAYOUT_5POINT1_BACK, AV_SAMPLE_FMT_S16, 0 },
+				{ "AL_FORMAT_61CHN16", AV_CH_LAYOUT_6POINT1, AV_SAMPLE_FMT_S16, 0 },
+				{ "AL_FORMAT_71CHN16", AV_CH_LAYOUT_7POINT1, AV_SAMPLE_FMT_S16, 0 },
+				{ "AL_FORMAT_QUAD32", AV_CH_LAYOUT_QUAD, AV_SAMPLE_FMT_FLT, 0 },
+				{ "AL_FORMAT_51CHN32", AV_CH_LAYOUT_5POINT1_BACK, AV_SAMPLE_FMT_FLT, 0 },
+				{ "AL_FORMAT_61CHN32", AV_CH_LAYOUT_6POINT1, AV_SAMPLE_FMT_FLT, 0 },
+				{ "AL_FORMAT_71CHN32", AV_CH_LAYOUT_7POINT1, AV_SAMPLE_FMT_FLT, 0 }
+			};
+			bool float32 = alIsExtensionPresent("AL_EXT_float32");
+			bool mcformats = alIsExtensionPresent("AL_EXT_MCFORMATS");
+			for( auto& f : formats ) {
+				bool multi = av_popcount64( f.layout ) > 2;
+				if( (multi && !mcformats) || (f.fmt == AV_SAMPLE_FMT_FLT && !float32) ||
+					(spatialize && f.layout != AV_CH_LAYOUT_MONO) )
+				{
+					continue;
+				}
+				f.al = alGetEnumValue( f.name );
+				alGetError();
+			}
+		}
+		
+		bool spatial() {
+			return spatialize;
+		}
+		//formats the device accepts, one bit each. part of the cache key,
+		//as it decides what a song is converted to
+		uint32_t mask() {
+			uint32_t m = 0;
+			for( uint i = 0; i < formats.size(); i++ ) {
+				if( formats[i].al ) {
+					m |= 1u << i;
+				}
+			}
+			return m;
+		}
+		
+		//OpenAL format of packed PCM; 0 if the device can't play it
+		ALenum alFormat(int channels, int fmt) {
+			for( auto& f : formats ) {
+				if( f.al && f.fmt == fmt && av_popcount64( f.layout ) == channels ) {
+					return f.al;
+				}
+			}
+			return 0;
+		}
+		
+		//picks the output format for a decoder: its own layout and sample
+		//format if the device accepts them, otherwise stereo (or mono) and
+		//float or 16 bits, whatever is closest
+		void choose(const AVCodecContext* ctx, int64_t& layout, enum AVSampleFormat& fmt) {
+			enum AVSampleFormat in = av_get_packed_sample_fmt( ctx->sample_fmt );
+			std::vector<enum AVSampleFormat> fmts;
+			if( in == AV_SAMPLE_FMT_U8 || in == AV_SAMPLE_FMT_S16 ) {
+				fmts = { in, AV_SAMPLE_FMT_S16 };
+			} else {
+				//wider integers and doubles lose the least as float
+				fmts = { AV_SAMPLE_FMT_FLT, AV_SAMPLE_FMT_S16 };
+			}
+			for( enum AVSampleFormat want : fmts ) {
+				for( auto& f : formats ) {
+					if( f.al && f.fmt == want && sameLayout( ctx->ch_layout, f.layout ) ) {
+						layout = ctx->ch_layout.nb_channels > 2 ? ctx->ch_layout.u.mask : f.layout;
+						fmt = want;
+						return;
+					}
+				}
+			}
+			//mix down, stereo if possible
+			for( uint64_t down : { (uint64_t) AV_CH_LAYOUT_STEREO, (uint64_t) AV_CH_LAYOUT_MONO } ) {
+				for( enum AVSampleFormat want : fmts ) {
+					for( auto& f : formats ) {
+						if( f.al && f.fmt == want && f.layout == down ) {
+							layout = down;
+							fmt = want;
+							return;
+						}
+					}
+				}
+			}
+			layout = AV_CH_LAYOUT_MONO;
+			fmt = AV_SAMPLE_FMT_S16;
+		}
+};
@@ -0,0 +1,369 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <stdexcept>
+
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+//On-disk cache of decoded and converted PCM, one file per song. A cache
+//file is a small header, the source path and the raw output of the
+//Converter. It's keyed by path, size and mtime of the source and by the
+//requested output format, the resampler profile and the formats the
+//device accepts, so a changed file or format is a miss. Hits
+//are mmap'ed and played straight from the mapping. The cache directory
+//is kept below a size cap by removing the least recently used files;
+//the mtime of a cache file is its last use
+
+class PcmCache {
+	public:
+		struct Key {
+			std::string path;
+			int64_t size;
+			int64_t mtime;
+			int64_t chLayout;
+			int32_t sampleFmt;
+			int32_t sampleRate;
+			uint32_t formats;
+			int32_t quality;	//resampler profile, if resampled
+		};
+		
+		//a mapped cache file; munmap'ed when the last chunk using it is
+		//overwritten
+		class Mapping {
+			private:
+				void* base;
+				size_t length;
+			public:
+				const uint8_t* data;
+				size_t size;
+				int freq;
+				int channels;
+				int format;
+				int frameSize;
+				
+				Mapping(void* base_, size_t length_, size_t offset, size_t size_,
+					int freq_, int channels_, int format_, int frameSize_):
+					base(base_), length(length_), data((uint8_t*) base_ + offset),
+					size(size_), freq(freq_), channels(channels_), format(format_),
+					frameSize(frameSize_) {}
+				~Mapping() {
+					munmap( base, length );
+				}
+				Mapping(const Mapping&) = delete;
+				Mapping& operator=(const Mapping&) = delete;
+		};
+		
+		//writes a cache file while its song is decoded. the file only
+		//gets its final name on commit(), so aborted songs never hit
+		class Writer {
+			private:
+				PcmCache* cache = nullptr;
+				Key key;
+				int fd = -1;
+				int64_t bytes = 0;
+				
+				void fail() {
+					::close( fd );
+					fd = -1;
+					unlink( cache->tmpName( key ).c_str() );
+				}
+			public:
+				~Writer() {
+					abort();
+				}
+				
+				bool active() {
+					return fd >= 0;
+				}
+				void begin(PcmCache* cache_, const Key& key_) {
+					abort();
+					cache = cache_;
+					key = key_;
+					bytes = 0;
+					fd = ::open( cache->tmpName( key ).c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644 );
+					if( fd < 0 ) {
+						return;
+					}
+					//header is written on commit, when the size is known
+					if( lseek( fd, cache->dataOffset( key ), SEEK_SET ) < 0 ) {
+						fail();
+					}
+				}
+				void append(const uint8_t* data, int size) {
+					if( fd < 0 ) {
+						return;
+					}
+					while( size > 0 ) {
+						ssize_t n = write( fd, data, size );
+						if( n <= 0 ) {
+							fail();
+							return;
+						}
+						data += n;
+						size -= n;
+						bytes += n;
+					}
+				}
+				void commit(int freq, int channels, int format, int frameSize) {
+					if( fd < 0 ) {
+						return;
+					}
+					std::vector<uint8_t> head = cache->header( key, freq, channels, format, frameSize, bytes );
+					if( pwrite( fd, head.data(), head.size(), 0 ) != (ssize_t) head.size() ) {
+						fail();
+						return;
+					}
+					::close( fd );
+					fd = -1;
+					if( rename( cache->tmpName( key ).c_str(), cache->fileName( key ).c_str() ) < 0 ) {
+						unlink( cache->tmpName( key ).c_str() );
+						return;
+					}
+					cache->stored++;
+					cache->evict( cache->fileName( key ) );
+				}
+				void abort() {
+					if( fd >= 0 ) {
+						fail();
+					}
+				}
+		};
+	
+	private:
+		struct Header {
+			char magic[8];
+			uint32_t version;
+			uint32_t pathLength;
+			int64_t size;
+			int64_t mtime;
+			int64_t chLayout;
+			int32_t sampleFmt;
+			int32_t sampleRate;
+			uint32_t formats;
+			int32_t quality;
+			int32_t freq;
+			int32_t channels;
+			int32_t format;
+			int32_t frameSize;
+			int64_t dataBytes;
+		};
+		static const char* magic() { return "MMPPCM1"; }
+		static const uint32_t version = 4;
+		
+		std::string dir;
+		int64_t capacity;
+		
+		uint64_t hash(const Key& key) {
+			//FNV-1a
+			uint64_t h = 14695981039346656037ull;
+			auto add = [&h](const void* p, size_t n) {
+				for( size_t i = 0; i < n; i++ ) {
+					h ^= ((const uint8_t*) p)[i];
+					h *= 1099511628211ull;
+				}
+			};
+			add( key.path.data(), key.path.size() );
+			add( &key.size, sizeof(key.size) );
+			add( &key.mtime, sizeof(key.mtime) );
+			add( &key.chLayout, sizeof(key.chLayout) );
+			add( &key.sampleFmt, sizeof(key.sampleFmt) );
+			add( &key.sampleRate, sizeof(key.sampleRate) );
+			add( &key.formats, sizeof(key.formats) );
+			add( &key.quality, sizeof(key.quality) );
+			return h;
+		}
+		std::string baseName(const Key& key) {
+			char name[17];
+			snprintf( name, sizeof(name), "%016llx", (unsigned long long) hash( key ) );
+			return dir + "/" + name;
+		}
+		std::string fileName(const Key& key) {
+			return baseName( key ) + ".pcm";
+		}
+		std::string tmpName(const Key& key) {
+			return baseName( key ) + ".tmp";
+		}
+		//PCM starts after header and path, aligned for any sample format
+		size_t dataOffset(const Key& key) {
+			return (sizeof(Header) + key.path.size() + 15) & ~(size_t) 15;
+		}
+		std::vector<uint8_t> header(const Key& key, int freq, int channels, int format, int frameSize, int64_t bytes) {
+			Header h;
+			memset( &h, 0, sizeof(h) );
+			memcpy( h.magic, magic(), sizeof(h.magic) );
+			h.version = version;
+			h.pathLength = key.path.size();
+			h.size = key.size;
+			h.mtime = key.mtime;
+			h.chLayout = key.chLayout;
+			h.sampleFmt = key.sampleFmt;
+			h.sampleRate = key.sampleRate;
+			h.formats = key.formats;
+			h.quality = key.quality;
+			h.freq = freq;
+			h.channels = channels;
+			h.format = format;
+			h.frameSize = frameSize;
+			h.dataBytes = bytes;
+			
+			std::vector<uint8_t> head( sizeof(h) + key.path.size() );
+			memcpy( head.data(), &h, sizeof(h) );
+			memcpy( head.data() + sizeof(h), key.path.data(), key.path.size() );
+			return head;
+		}
+		
+		//removes the least recently used files until the cache fits into
+		//its capacity. keep is only removed if it's too large on its own
+		void evict(const std::string& keep) {
+			struct File {
+				std::string name;
+				int64_t size;
+				int64_t used;
+			};
+			std::vector<File> files;
+			int64_t total = 0;
+			DIR* d = opendir( dir.c_str() );
+			if( !d ) {
+				return;
+			}
+			struct dirent* e;
+			while( (e = readdir( d )) ) {
+				std::string name = e->d_name;
+				if( name.size() < 4 || name.compare( name.size() - 4, 4, ".pcm" ) != 0 ) {
+					continue;
+				}
+				struct stat st;
+				name = dir + "/" + name;
+				if( stat( name.c_str(), &st ) == 0 ) {
+					files.push_back( File{ name, (int64_t) st.st_size,
+						(int64_t) st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec } );
+					total += st.st_size;
+				}
+			}
+			closedir( d );
+			
+			std::sort( files.begin(), files.end(), [&keep](const File& a, const File& b) {
+				if( (a.name == keep) != (b.name == keep) ) {
+					return b.name == keep;
+				}
+				return a.used < b.used;
+			});
+			for( auto& f : files ) {
+				if( total <= capacity ) {
+					break;
+				}
+				if( unlink( f.name.c_str() ) == 0 ) {
+					total -= f.size;
+					evicted++;
+				}
+			}
+		}
+	
+	public:
+		//statistics
+		long hits = 0;
+		long misses = 0;
+		long stored = 0;
+		long evicted = 0;
+		int64_t servedBytes = 0;
+		//decode cost of misses, to estimate what the hits saved
+		int64_t decodedBytes = 0;
+		int64_t decodeNs = 0;
+		
+		double cpuSaved() {
+			if( !decodedBytes ) {
+				return 0;
+			}
+			return servedBytes * ((double) decodeNs / decodedBytes) / 1e9;
+		}
+		
+		PcmCache(std::string dir_, int64_t capacity_): dir(dir_), capacity(capacity_) {
+			//create the directory and its parents
+			for( size_t pos = 0; pos != std::string::npos; ) {
+				pos = dir.find( '/', pos + 1 );
+				mkdir( dir.substr( 0, pos ).c_str(), 0755 );
+			}
+			struct stat st;
+			if( stat( dir.c_str(), &st ) < 0 || !S_ISDIR( st.st_mode ) ) {
+				throw std::runtime_error("Couldn't create cache directory " + dir);
+			}
+		}
+		
+		//cache key of a source file for the given output format, resampler
+		//profile and device formats. false if the file can't be stat'ed
+		//(e.g. it's a URL)
+		bool key(const std::string& path, int64_t chLayout, int sampleFmt, int sampleRate, uint32_t formats,
+			int quality, Key& key)
+		{
+			struct stat st;
+			if( stat( path.c_str(), &st ) < 0 || !S_ISREG( st.st_mode ) ) {
+				return false;
+			}
+			key.path = path;
+			key.size = st.st_size;
+			key.mtime = (int64_t) st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+			key.chLayout = chLayout;
+			key.sampleFmt = sampleFmt;
+			key.sampleRate = sampleRate;
+			key.formats = formats;
+			key.quality = quality;
+			return true;
+		}
+		
+		bool contains(const Key& key) {
+			return access( fileName( key ).c_str(), R_OK ) == 0;
+		}
+		
+		//maps the cache file of key. nullptr on a miss
+		std::shared_ptr<Mapping> open(const Key& key) {
+			std::string name = fileName( key );
+			int fd = ::open( name.c_str(), O_RDONLY );
+			if( fd < 0 ) {
+				misses++;
+				return nullptr;
+			}
+			struct stat st;
+			void* base = MAP_FAILED;
+			size_t offset = dataOffset( key );
+			if( fstat( fd, &st ) == 0 && (size_t) st.st_size >= offset ) {
+				base = mmap( NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0 );
+			}
+			::close( fd );
+			if( base == MAP_FAILED ) {
+				misses++;
+				return nullptr;
+			}
+			
+			//a stale or colliding file is a miss
+			const Header* h = (const Header*) base;
+			bool valid = memcmp( h->magic, magic(), sizeof(h->magic) ) == 0 && h->version == version &&
+				h->pathLength == key.path.size() && h->size == key.size && h->mtime == key.mtime &&
+				h->chLayout == key.chLayout && h->sampleFmt == key.sampleFmt &&
+				h->sampleRate == key.sampleRate && h->formats == key.formats && h->quality == key.quality && h->dataBytes >= 0 &&
+				(size_t) st.st_size >= offset + h->dataBytes &&
+				memcmp( (const char*) base + sizeof(Header), key.path.data(), key.path.size() ) == 0;
+			if( !valid ) {
+				munmap( base, st.st_size );
+				misses++;
+				return nullptr;
+			}
+			madvise( base, st.st_size, MADV_SEQUENTIAL );
+			//mark as recently used
+			utimensat( AT_FDCWD, name.c_str(), NULL, 0 );
+			
+			hits++;
+			return std::make_shared<Mapping>( base, st.st_size, offset, h->dataBytes,
+				h->freq, h->channels, h->format, h->frameSize );
+		}
+};
@@ -0,0 +1,186 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <fstream>
+#include <algorithm>
+
+#include <cctype>
+#include <cstring>
+
+#include <dirent.h>
+#include <sys/stat.h>
+
+//The files to be played, in order, read as they're needed. Arguments are
+//files, directories or playlists: a directory is walked recursively, its
+//entries sorted by name and only files with an audio extension taken; a
+//playlist (.m3u, .m3u8, .pls) is read a line at a time, its relative
+//paths resolved against its own directory. Only the directories and
+//playlists being read are held open, so a playlist of any length costs
+//the same memory. Playlists and directories may nest, up to maxDepth
+
+class Playlist {
+	private:
+		enum Kind { Directory, M3u, Pls };
+		struct Source {
+			Kind kind;
+			std::string base;		//directory entries are relative to
+			std::unique_ptr<std::ifstream> file;
+			std::vector<std::string> entries;	//of a directory
+			size_t pos = 0;
+			bool first = true;		//no line read yet
+		};
+		std::vector<Source> stack;
+		
+		std::vector<std::string> args;
+		size_t arg = 0;
+		
+		static const int maxDepth = 16;
+		
+		static std::string extension(const std::string& name) {
+			size_t dot = name.rfind( '.' );
+			if( dot == std::string::npos || name.find( '/', dot ) != std::string::npos ) {
+				return "";
+			}
+			std::string ext = name.substr( dot + 1 );
+			std::transform( ext.begin(), ext.end(), ext.begin(), ::tolower );
+			return ext;
+		}
+		static bool isAudio(const std::string& name) {
+			static const char* known[] = { "mp3", "flac", "ogg", "oga", "opus", "m4a", "m4b", "aac", "wav",
+				"wv", "ape", "aif", "aiff", "alac", "mka", "dsf", "dff", "tta", "mpc", "wma", "ac3", "mp2", nullptr };
+			std::string ext = extension( name );
+			for( const char** k = known; *k; k++ ) {
+				if( ext == *k ) {
+					return true;
+				}
+			}
+			return false;
+		}
+		static bool isDirectory(const std::string& name) {
+			struct stat st;
+			return stat( name.c_str(), &st ) == 0 && S_ISDIR( st.st_mode );
+		}
+		//relative paths of a playlist are relative to its directory; urls
+		//and absolute paths are taken as they are
+		static std::string resolve(const std::string& base, const std::string& name) {
+			if( base.empty() || name[0] == '/' || name.find( "://" ) != std::string::npos ) {
+				return name;
+			}
+			return base + "/" + name;
+		}
+		static std::string directoryOf(const std::string& name) {
+			size_t slash = name.rfind( '/' );
+			return slash == std::string::npos ? "" : name.substr( 0, std::max( (size_t) 1, slash ) );
+		}
+		
+		//starts reading name if it's a directory or a playlist
+		bool open(const std::string& name) {
+			if( (int) stack.size() >= maxDepth ) {
+				return false;
+			}
+			std::string ext = extension( name );
+			Source s;
+			if( isDirectory( name ) ) {
+				DIR* dir = opendir( name.c_str() );
+				if( !dir ) {
+					return false;
+				}
+				s.kind = Directory;
+				s.base = name;
+				while( struct dirent* e = readdir( dir ) ) {
+					if( e->d_name[0] == '.' ) {
+						continue;
+					}
+					std::string path = name + "/" + e->d_name;
+					bool directory = e->d_type == DT_DIR ||
+						((e->d_type == DT_UNKNOWN || e->d_type == DT_LNK) && isDirectory( path ));
+					if( directory || isAudio( path ) ) {
+						s.entries.push_back( path );
+					}
+				}
+				closedir( dir );
+				std::sort( s.entries.begin(), s.entries.end() );
+			} else if( ext == "m3u" || ext == "m3u8" || ext == "pls" ) {
+				s.kind = ext == "pls" ? Pls : M3u;
+				s.base = directoryOf( name );
+				s.file.reset( new std::ifstream( name ) );
+				if( !*s.file ) {
+					return false;
+				}
+			} else {
+				return false;
+			}
+			stack.push_back( std::move( s ) );
+			return true;
+		}
+		
+		//next entry of s; false once it's exhausted
+		bool read(Source& s, std::string& name) {
+			if( s.kind == Directory ) {
+				if( s.pos >= s.entries.size() ) {
+					return false;
+				}
+				name = s.entries[s.pos++];
+				return true;
+			}
+			std::string line;
+			while( std::getline( *s.file, line ) ) {
+				if( s.first && line.compare( 0, 3, "\xEF\xBB\xBF" ) == 0 ) {
+					line.erase( 0, 3 );
+				}
+				s.first = false;
+				while( !line.empty() && isspace( (unsigned char) line.back() ) ) {
+					line.pop_back();
+				}
+				if( s.kind == Pls ) {
+					//FileN=path
+					if( line.compare( 0, 4, "File" ) != 0 || line.find( '=' ) == std::string::npos ) {
+						continue;
+					}
+					line.erase( 0, line.find( '=' ) + 1 );
+				} else if( line[0] == '#' ) {
+					continue;
+				}
+				if( !line.empty() ) {
+					name = resolve( s.base, line );
+					return true;
+				}
+			}
+			return false;
+		}
+	
+	public:
+		//a file, directory or playlist to be played after the ones added
+		//before
+		void add(const std::string& name) {
+			args.push_back( name );
+		}
+		
+		//the next file to be played; false at the end of the playlist
+		bool next(std::string& name) {
+			while( true ) {
+				std::string entry;
+				if( stack.empty() ) {
+					if( arg >= args.size() ) {
+						return false;
+					}
+					entry = args[arg++];
+				} else if( !read( stack.back(), entry ) ) {
+					stack.pop_back();
+					continue;
+				}
+				if( !open( entry ) ) {
+					name = entry;
+					return true;
+				}
+			}
+		}
+		
+		//starts over from the first argument
+		void rewind() {
+			stack.clear();
+			arg = 0;
+		}
+};
@@ -0,0 +1,378 @@
+#pragma once
+
+#include <string>
+#include <map>
+#include <vector>
+#include <mutex>
+#include <chrono>
+#include <sstream>
+#include <iomanip>
+#include <algorithm>
+
+#include <cstdint>
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>) && defined(__NR_io_uring_setup)
+#include <linux/io_uring.h>
+#define PREFETCH_URING
+#endif
+#endif
+
+#include "WorkerPool.hpp"
+
+//Warms the page cache with the files that are played next, so the first
+//reads of a song don't wait for cold storage at the song boundary. The
+//loader asks for the next few files when a song starts; their first
+//bytes (up to a share of the byte budget each) are read and thrown away
+//in the background. Reads are queued with io_uring if the kernel allows
+//it, several at a time from one thread; otherwise a few threads pread()
+//the files. When the decoder gets to a file, it claims it: a hit if the
+//file had been read completely by then, partial if it was still being
+//read, a miss if it hadn't been asked for. The time the reads took for
+//hits is the stall the decoder was spared, roughly. Files the loader no
+//longer holds are forgotten, giving back what they kept of the budget
+
+class Prefetcher {
+	private:
+		enum State { Queued, Reading, Done, Claimed };
+		struct Entry {
+			State state;
+			int64_t reserved;	//of the budget
+			double seconds;	//spent reading
+			long id;		//of the warm() reading it
+		};
+		std::map<std::string, Entry> files;
+		std::mutex mutexFiles;
+		long queued = 0;
+		
+		int64_t budget;
+		int64_t reserved = 0;
+		int ahead;
+		
+		static const int blockSize = 256 * 1024;
+		static const int depth = 8;		//reads in flight per file
+
+#ifdef PREFETCH_URING
+		//bare io_uring: one submission and one completion ring, only used
+		//by the single worker in that mode
+		struct Uring {
+			int fd = -1;
+			unsigned* sqHead;
+			unsigned* sqTail;
+			unsigned* sqMask;
+			unsigned* sqArray;
+			unsigned* cqHead;
+			unsigned* cqTail;
+			unsigned* cqMask;
+			struct io_uring_sqe* sqes = nullptr;
+			struct io_uring_cqe* cqes;
+			void* sq = MAP_FAILED;
+			void* cq = MAP_FAILED;
+			size_t sqLen = 0, cqLen = 0, sqesLen = 0;
+			
+			bool init(unsigned entries) {
+				struct io_uring_params p;
+				memset( &p, 0, sizeof(p) );
+				fd = syscall( __NR_io_uring_setup, entries, &p );
+				if( fd < 0 ) {
+					return false;
+				}
+				sqLen = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+				cqLen = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+				sqesLen = p.sq_entries * sizeof(struct io_uring_sqe);
+				sq = mmap( NULL, sqLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING );
+				cq = mmap( NULL, cqLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING );
+				void* s = mmap( NULL, sqesLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES );
+				if( sq == MAP_FAILED || cq == MAP_FAILED || s == MAP_FAILED ) {
+					return false;
+				}
+				sqes = (struct io_uring_sqe*) s;
+				uint8_t* sqp = (uint8_t*) sq;
+				uint8_t* cqp = (uint8_t*) cq;
+				sqHead = (unsigned*) (sqp + p.sq_off.head);
+				sqTail = (unsigned*) (sqp + p.sq_off.tail);
+				sqMask = (unsigned*) (sqp + p.sq_off.ring_mask);
+				sqArray = (unsigned*) (sqp + p.sq_off.array);
+				cqHead = (unsigned*) (cqp + p.cq_off.head);
+				cqTail = (unsigned*) (cqp + p.cq_off.tail);
+				cqMask = (unsigned*) (cqp + p.cq_off.ring_mask);
+				cqes = (struct io_uring_cqe*) (cqp + p.cq_off.cqes);
+				return true;
+			}
+			~Uring() {
+				if( sqes ) {
+					munmap( sqes, sqesLen );
+				}
+				if( cq != MAP_FAILED ) {
+					munmap( cq, cqLen );
+				}
+				if( sq != MAP_FAILED ) {
+					munmap( sq, sqLen );
+				}
+				if( fd >= 0 ) {
+					::close( fd );
+				}
+			}
+			
+			//queues a read of iov at off, tagged with data
+			void read(int file, struct iovec* iov, off_t off, uint64_t data) {
+				unsigned tail = *sqTail;
+				unsigned i = tail & *sqMask;
+				struct io_uring_sqe* sqe = &sqes[i];
+				memset( sqe, 0, sizeof(*sqe) );
+				sqe->opcode = IORING_OP_READV;
+				sqe->fd = file;
+				sqe->addr = (uint64_t) iov;
+				sqe->len = 1;
+				sqe->off = off;
+				sqe->user_data = data;
+				sqArray[i] = i;
+				__atomic_store_n( sqTail, tail + 1, __ATOMIC_RELEASE );
+			}
+			//submits what's queued and waits for at least one completion.
+			//interrupted waits (e.g. by SIGINT) are simply retried, with
+			//whatever the kernel hadn't taken from the queue yet
+			bool enter() {
+				while( true ) {
+					unsigned submit = *sqTail - __atomic_load_n( sqHead, __ATOMIC_ACQUIRE );
+					if( syscall( __NR_io_uring_enter, fd, submit, 1, IORING_ENTER_GETEVENTS, NULL, 0 ) >= 0 ) {
+						return true;
+					}
+					if( errno != EINTR ) {
+						return false;
+					}
+				}
+			}
+			bool complete(uint64_t& data, int& res) {
+				unsigned head = *cqHead;
+				if( head == __atomic_load_n( cqTail, __ATOMIC_ACQUIRE ) ) {
+					return false;
+				}
+				struct io_uring_cqe* cqe = &cqes[head & *cqMask];
+				data = cqe->user_data;
+				res = cqe->res;
+				__atomic_store_n( cqHead, head + 1, __ATOMIC_RELEASE );
+				return true;
+			}
+		};
+		Uring ring;
+#endif
+		bool uring = false;
+		bool ringFailed = false;	//only touched by the io_uring worker
+		WorkerPool* pool = nullptr;
+		std::vector<uint8_t> scratch;	//only for the io_uring worker
+		
+		long hits = 0;
+		long partial = 0;
+		long misses = 0;
+		double avoided = 0;
+		int64_t readBytes = 0;
+
+#ifdef PREFETCH_URING
+		//depth reads in flight, each one followed by the next block. it
+		//only returns once every read it queued has completed, as they
+		//all share scratch and their tags; should the ring fail, the reads
+		//still in flight can't be waited for, so it's never used again
+		int64_t readUring(int fd, int64_t size) {
+			struct iovec iov[depth];
+			int64_t next = 0, done = 0;
+			int inFlight = 0;
+			for( int i = 0; i < depth && next < size; i++ ) {
+				iov[i].iov_base = scratch.data() + (size_t) i * blockSize;
+				iov[i].iov_len = std::min( (int64_t) blockSize, size - next );
+				ring.read( fd, &iov[i], next, i );
+				next += iov[i].iov_len;
+				inFlight++;
+			}
+			while( inFlight > 0 ) {
+				if( !ring.enter() ) {
+					ringFailed = true;
+					break;
+				}
+				uint64_t i;
+				int res;
+				while( ring.complete( i, res ) ) {
+					inFlight--;
+					if( res <= 0 ) {
+						next = size;
+						continue;
+					}
+					done += res;
+					if( next < size ) {
+						iov[i].iov_len = std::min( (int64_t) blockSize, size - next );
+						ring.read( fd, &iov[i], next, i );
+						next += iov[i].iov_len;
+						inFlight++;
+					}
+				}
+			}
+			return done;
+		}
+#endif
+		int64_t readPlain(int fd, int64_t size) {
+			std::vector<uint8_t> buf( blockSize );
+			int64_t done = 0;
+			ssize_t n;
+			while( done < size && (n = pread( fd, buf.data(), std::min( (int64_t) blockSize, size - done ), done )) > 0 ) {
+				done += n;
+			}
+			return done;
+		}
+		
+		//reads the first reserved bytes of name, unless it's been claimed
+		//or forgotten in the meantime
+		void warm(std::string name, long id) {
+			int64_t size;
+			{
+				std::lock_guard<std::mutex> lck( mutexFiles );
+				auto it = files.find( name );
+				if( it == files.end() || it->second.id != id || it->second.state != Queued ) {
+					return;
+				}
+				it->second.state = Reading;
+				size = it->second.reserved;
+			}
+			std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+			int64_t done = 0;
+			int fd = ::open( name.c_str(), O_RDONLY | O_CLOEXEC );
+			if( fd >= 0 ) {
+				struct stat st;
+				if( fstat( fd, &st ) == 0 ) {
+					size = std::min( size, (int64_t) st.st_size );
+				}
+#ifdef PREFETCH_URING
+				done = uring && !ringFailed ? readUring( fd, size ) : readPlain( fd, size );
+#else
+				done = readPlain( fd, size );
+#endif
+				::close( fd );
+			}
+			double seconds = std::chrono::duration<double>( std::chrono::steady_clock::now() - start ).count();
+			
+			std::lock_guard<std::mutex> lck( mutexFiles );
+			readBytes += done;
+			auto it = files.find( name );
+			//forgotten while it was read: its share was given back then
+			if( it == files.end() || it->second.id != id ) {
+				return;
+			}
+			Entry& e = it->second;
+			e.seconds = seconds;
+			if( e.state == Claimed ) {
+				reserved -= e.reserved;
+				e.reserved = 0;
+			} else {
+				//what the file didn't need is given back
+				reserved -= e.reserved - done;
+				e.reserved = done;
+				e.state = Done;
+			}
+		}
+	
+	public:
+		//budget: bytes warmed but not yet claimed, ahead: files asked for
+		//at a time
+		Prefetcher(int64_t budget_, int ahead_ = 2, int threads = 2): budget(budget_), ahead(std::max( 1, ahead_ )) {
+#ifdef PREFETCH_URING
+			uring = ring.init( 2 * depth );
+			if( uring ) {
+				scratch.resize( (size_t) depth * blockSize );
+				threads = 1;
+			}
+#endif
+			pool = new WorkerPool( threads );
+		}
+		~Prefetcher() {
+			delete pool;
+		}
+		Prefetcher(const Prefetcher&) = delete;
+		Prefetcher& operator=(const Prefetcher&) = delete;
+		
+		int filesAhead() {
+			return ahead;
+		}
+		bool usesUring() {
+			return uring;
+		}
+		
+		//warms the start of name in the background, as far as the budget
+		//allows
+		void prefetch(const std::string& name) {
+			std::lock_guard<std::mutex> lck( mutexFiles );
+			int64_t share = std::min( budget / ahead, budget - reserved );
+			if( files.count( name ) || share <= 0 ) {
+				return;
+			}
+			long id = ++queued;
+			files[name] = Entry{ Queued, share, 0, id };
+			reserved += share;
+			pool->submit( [this, name, id]() { warm( name, id ); } );
+		}
+		//the decoder starts reading name
+		void claim(const std::string& name) {
+			std::lock_guard<std::mutex> lck( mutexFiles );
+			auto it = files.find( name );
+			if( it == files.end() ) {
+				misses++;
+				files[name] = Entry{ Claimed, 0, 0, 0 };
+				return;
+			}
+			Entry& e = it->second;
+			switch( e.state ) {
+				case Claimed:
+					return;
+				case Done:
+					hits++;
+					avoided += e.seconds;
+					reserved -= e.reserved;
+					e.reserved = 0;
+					break;
+				case Reading:
+					partial++;
+					break;
+				case Queued:
+					misses++;
+					reserved -= e.reserved;
+					e.reserved = 0;
+					break;
+			}
+			e.state = Claimed;
+		}
+		//name isn't going to be played soon any more: its share of the
+		//budget is given back, whether it was claimed or not, and it's
+		//read again if it's asked for once more
+		void forget(const std::string& name) {
+			std::lock_guard<std::mutex> lck( mutexFiles );
+			auto it = files.find( name );
+			if( it == files.end() ) {
+				return;
+			}
+			reserved -= it->second.reserved;
+			files.erase( it );
+		}
+		
+		//hits per claimed file
+		double hitRate() {
+			std::lock_guard<std::mutex> lck( mutexFiles );
+			long n = hits + partial + misses;
+			return n ? (double) hits / n : 0;
+		}
+		std::string report() {
+			std::lock_guard<std::mutex> lck( mutexFiles );
+			std::stringstream ss;
+			ss << "Prefetch (" << (uring ? "io_uring" : "pread") << "): " << hits << " hits, " << partial
+				<< " partial, " << misses << " misses, " << readBytes / 1048576 << " MB read, ~"
+				<< std::setprecision(1) << std::fixed << avoided << " s of stalls avoided";
+			return ss.str();
+		}
+};
@@ -0,0 +1,167 @@
+#pragma once
+
+#include <atomic>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+
+#include <cstdint>
+#include <cstdlib>
+#include <stdexcept>
+
+//Single-producer/single-consumer ring of PCM chunks between the decode
+//thread (producer) and the playback loop (consumer). Each side only ever
+//advances its own index, so handing a chunk over is one atomic store and
+//needs no lock. The mutex is only used to park a thread when the ring is
+//full (producer) or empty (consumer) and is never touched otherwise.
+
+struct PcmChunk {
+	uint8_t* data = nullptr;
+	int size = 0;		//bytes of valid PCM
+	int capacity = 0;	//bytes allocated for data
+	int song = -1;		//playlist index the samples belong to
+	int64_t pts = 0;	//position of the first sample in the song, in samples
+	int freq = 0;
+	int channels = 1;
+	int format = 1;		//AVSampleFormat of the packed samples, S16
+	int frameSize = 2;	//bytes per sample over all channels
+	int epoch = 0;		//seeks done before the chunk was filled
+	int lane = 0;		//source to play it on, see Loader::setCrossfade
+	bool fadeIn = false;	//first chunk of a song faded in on its lane
+	
+	//PCM that lives elsewhere (e.g. a mapped cache file) is played from
+	//view instead of being copied to data; keep holds it alive
+	const uint8_t* view = nullptr;
+	std::shared_ptr<void> keep;
+	
+	const uint8_t* pcm() {
+		return view ? view : data;
+	}
+};
+
+class PcmRing {
+	private:
+		std::vector<PcmChunk> chunks;
+		
+		//head: next chunk to read, only written by the consumer
+		//tail: next chunk to write, only written by the producer
+		std::atomic<size_t> head;
+		std::atomic<size_t> tail;
+		std::atomic<bool> finished;	//producer won't write any more
+		std::atomic<bool> closed;	//consumer won't read any more
+		
+		std::mutex mutexPark;
+		std::condition_variable condPark;
+		std::atomic<int> parked;
+		
+		void wake() {
+			//pairs with the increment of parked in park(); makes sure
+			//either the parked thread sees the new index or we see it
+			std::atomic_thread_fence( std::memory_order_seq_cst );
+			if( parked.load( std::memory_order_relaxed ) > 0 ) {
+				std::lock_guard<std::mutex> lck( mutexPark );
+				condPark.notify_all();
+			}
+		}
+		
+		template<typename Pred>
+		void park(Pred pred) {
+			parked.fetch_add( 1 );
+			std::atomic_thread_fence( std::memory_order_seq_cst );
+			{
+				std::unique_lock<std::mutex> lck( mutexPark );
+				condPark.wait( lck, pred );
+			}
+			parked.fetch_sub( 1 );
+		}
+		
+		bool full() {
+			return tail.load( std::memory_order_relaxed ) - head.load( std::memory_order_acquire ) >= chunks.size();
+		}
+		bool empty() {
+			return head.load( std::memory_order_relaxed ) == tail.load( std::memory_order_acquire );
+		}
+	
+	public:
+		PcmRing(int num, int chunkSize):
+			chunks(num), head(0), tail(0), finished(false), closed(false), parked(0)
+		{
+			for( auto& chunk : chunks ) {
+				chunk.data = (uint8_t*) malloc( chunkSize );
+				if( !chunk.data ) {
+					throw std::runtime_error("Couldn't allocate PCM chunk.");
+				}
+				chunk.capacity = chunkSize;
+			}
+		}
+		~PcmRing() {
+			for( auto& chunk : chunks ) {
+				free( chunk.data );
+			}
+		}
+		PcmRing(const PcmRing&) = delete;
+		PcmRing& operator=(const PcmRing&) = delete;
+		
+		//producer side
+		//the chunk to fill next or nullptr if the ring is full
+		PcmChunk* writeSlot() {
+			if( full() ) {
+				return nullptr;
+			}
+			return &chunks[tail.load( std::memory_order_relaxed ) % chunks.size()];
+		}
+		void commitWrite() {
+			tail.store( tail.load( std::memory_order_relaxed ) + 1, std::memory_order_release );
+			wake();
+		}
+		//blocks until there is a free chunk; false if the consumer left
+		bool waitWritable() {
+			if( !full() || closed ) {
+				return !closed;
+			}
+			park( [this]() { return !full() || closed; } );
+			return !closed;
+		}
+		//no more chunks will be written
+		void finish() {
+			finished = true;
+			wake();
+		}
+		
+		//consumer side
+		//the oldest filled chunk or nullptr if there is none
+		PcmChunk* readSlot() {
+			if( empty() ) {
+				return nullptr;
+			}
+			return &chunks[head.load( std::memory_order_relaxed ) % chunks.size()];
+		}
+		void commitRead() {
+			head.store( head.load( std::memory_order_relaxed ) + 1, std::memory_order_release );
+			wake();
+		}
+		//blocks until a chunk is ready; false if there won't be any more
+		bool waitReadable() {
+			if( empty() ) {
+				park( [this]() { return !empty() || finished; } );
+			}
+			return !empty();
+		}
+		//the producer is started again after it had finished
+		void reopen() {
+			finished = false;
+		}
+		//releases a producer waiting for space, e.g. on shutdown
+		void close() {
+			closed = true;
+			wake();
+		}
+		
+		bool done() {
+			return finished && empty();
+		}
+		size_t filled() {
+			return tail.load( std::memory_order_acquire ) - head.load( std::memory_order_acquire );
+		}
+};
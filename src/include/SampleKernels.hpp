@@ -0,0 +1,353 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+
+extern "C" {
+#include <libavutil/samplefmt.h>
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SAMPLE_KERNELS_X86
+#include <immintrin.h>
+#define SIMD(kernel) kernel
+#else
+#define SIMD(kernel) nullptr
+#endif
+
+//Hand vectorized sample format conversions for the common cases where
+//the sample rate doesn't change: planar float to S16 or to packed float,
+//stereo to mono from planar float or S16. Each comes as scalar, SSE2 and
+//AVX2 code; the best one the CPU supports is picked at runtime. Results
+//are the same as swresample's (rounding to nearest, clipping, a stereo
+//downmix of (L+R)/2 for S16 and (L+R)/sqrt(2) for float output)
+
+class SampleKernels {
+	public:
+		//converts samples per channel from in (one pointer per plane) to
+		//packed out
+		typedef void (*Kernel)(const uint8_t* const* in, int channels, int samples, uint8_t* out);
+		
+		enum Isa { Scalar, SSE2, AVX2 };
+	
+	private:
+		//scalar code, also used for the tails of the vectorized loops
+		static inline int16_t toS16(float x) {
+			x = x < -32768.0f ? -32768.0f : (x > 32767.0f ? 32767.0f : x);
+			return (int16_t) lrintf( x );
+		}
+		static void fltpToS16Range(const uint8_t* const* in, int channels, int i, int samples, uint8_t* out) {
+			int16_t* o = (int16_t*) out;
+			for( ; i < samples; i++ ) {
+				for( int c = 0; c < channels; c++ ) {
+					o[i * channels + c] = toS16( ((const float*) in[c])[i] * 32768.0f );
+				}
+			}
+		}
+		static void fltpToFltRange(const uint8_t* const* in, int channels, int i, int samples, uint8_t* out) {
+			float* o = (float*) out;
+			for( ; i < samples; i++ ) {
+				for( int c = 0; c < channels; c++ ) {
+					o[i * channels + c] = ((const float*) in[c])[i];
+				}
+			}
+		}
+		static void fltpStereoToMonoS16Range(const uint8_t* const* in, int i, int samples, uint8_t* out) {
+			const float* l = (const float*) in[0];
+			const float* r = (const float*) in[1];
+			int16_t* o = (int16_t*) out;
+			for( ; i < samples; i++ ) {
+				o[i] = toS16( (l[i] + r[i]) * 16384.0f );
+			}
+		}
+		static void fltpStereoToMonoFltRange(const uint8_t* const* in, int i, int samples, uint8_t* out) {
+			const float* l = (const float*) in[0];
+			const float* r = (const float*) in[1];
+			float* o = (float*) out;
+			const float c = (float) M_SQRT1_2;
+			for( ; i < samples; i++ ) {
+				o[i] = l[i] * c + r[i] * c;
+			}
+		}
+		static void s16StereoToMonoRange(const uint8_t* const* in, int i, int samples, uint8_t* out) {
+			const int16_t* s = (const int16_t*) in[0];
+			int16_t* o = (int16_t*) out;
+			for( ; i < samples; i++ ) {
+				o[i] = (s[2 * i] + s[2 * i + 1] + 1) >> 1;
+			}
+		}
+		
+		static void fltpToS16(const uint8_t* const* in, int channels, int samples, uint8_t* out) {
+			fltpToS16Range( in, channels, 0, samples, out );
+		}
+		static void fltpToFlt(const uint8_t* const* in, int channels, int samples, uint8_t* out) {
+			fltpToFltRange( in, channels, 0, samples, out );
+		}
+		static void fltpStereoToMonoS16(const uint8_t* const* in, int, int samples, uint8_t* out) {
+			fltpStereoToMonoS16Range( in, 0, samples, out );
+		}
+		static void fltpStereoToMonoFlt(const uint8_t* const* in, int, int samples, uint8_t* out) {
+			fltpStereoToMonoFltRange( in, 0, samples, out );
+		}
+		static void s16StereoToMono(const uint8_t* const* in, int, int samples, uint8_t* out) {
+			s16StereoToMonoRange( in, 0, samples, out );
+		}
+
+#ifdef SAMPLE_KERNELS_X86
+		//SSE2: 4 floats or 8 shorts at a time. cvtps2dq rounds to nearest
+		//even like lrintf, clipping is done in float before
+		__attribute__((target("sse2")))
+		static inline __m128i s16x4(__m128 x, float scale) {
+			x = _mm_mul_ps( x, _mm_set1_ps( scale ) );
+			x = _mm_min_ps( _mm_max_ps( x, _mm_set1_ps( -32768.0f ) ), _mm_set1_ps( 32767.0f ) );
+			return _mm_cvtps_epi32( x );
+		}
+		__attribute__((target("sse2")))
+		static void fltpToS16Sse2(const uint8_t* const* in, int channels, int samples, uint8_t* out) {
+			int16_t* o = (int16_t*) out;
+			int i = 0;
+			if( channels == 1 ) {
+				const float* a = (const float*) in[0];
+				for( ; i + 8 <= samples; i += 8 ) {
+					__m128i lo = s16x4( _mm_loadu_ps( a + i ), 32768.0f );
+					__m128i hi = s16x4( _mm_loadu_ps( a + i + 4 ), 32768.0f );
+					_mm_storeu_si128( (__m128i*) (o + i), _mm_packs_epi32( lo, hi ) );
+				}
+			} else if( channels == 2 ) {
+				const float* l = (const float*) in[0];
+				const float* r = (const float*) in[1];
+				for( ; i + 4 <= samples; i += 4 ) {
+					__m128i a = s16x4( _mm_loadu_ps( l + i ), 32768.0f );
+					__m128i b = s16x4( _mm_loadu_ps( r + i ), 32768.0f );
+					_mm_storeu_si128( (__m128i*) (o + 2 * i),
+						_mm_packs_epi32( _mm_unpacklo_epi32( a, b ), _mm_unpackhi_epi32( a, b ) ) );
+				}
+			}
+			fltpToS16Range( in, channels, i, samples, out );
+		}
+		__attribute__((target("sse2")))
+		static void fltpToFltSse2(const uint8_t* const* in, int channels, int samples, uint8_t* out) {
+			int i = 0;
+			if( channels == 2 ) {
+				const float* l = (const float*) in[0];
+				const float* r = (const float*) in[1];
+				float* o = (float*) out;
+				for( ; i + 4 <= samples; i += 4 ) {
+					__m128 a = _mm_loadu_ps( l + i );
+					__m128 b = _mm_loadu_ps( r + i );
+					_mm_storeu_ps( o + 2 * i, _mm_unpacklo_ps( a, b ) );
+					_mm_storeu_ps( o + 2 * i + 4, _mm_unpackhi_ps( a, b ) );
+				}
+			}
+			fltpToFltRange( in, channels, i, samples, out );
+		}
+		__attribute__((target("sse2")))
+		static void fltpStereoToMonoS16Sse2(const uint8_t* const* in, int, int samples, uint8_t* out) {
+			const float* l = (const float*) in[0];
+			const float* r = (const float*) in[1];
+			int16_t* o = (int16_t*) out;
+			int i = 0;
+			for( ; i + 8 <= samples; i += 8 ) {
+				__m128i lo = s16x4( _mm_add_ps( _mm_loadu_ps( l + i ), _mm_loadu_ps( r + i ) ), 16384.0f );
+				__m128i hi = s16x4( _mm_add_ps( _mm_loadu_ps( l + i + 4 ), _mm_loadu_ps( r + i + 4 ) ), 16384.0f );
+				_mm_storeu_si128( (__m128i*) (o + i), _mm_packs_epi32( lo, hi ) );
+			}
+			fltpStereoToMonoS16Range( in, i, samples, out );
+		}
+		__attribute__((target("sse2")))
+		static void fltpStereoToMonoFltSse2(const uint8_t* const* in, int, int samples, uint8_t* out) {
+			const float* l = (const float*) in[0];
+			const float* r = (const float*) in[1];
+			float* o = (float*) out;
+			const __m128 c = _mm_set1_ps( (float) M_SQRT1_2 );
+			int i = 0;
+			for( ; i + 4 <= samples; i += 4 ) {
+				_mm_storeu_ps( o + i, _mm_add_ps(
+					_mm_mul_ps( _mm_loadu_ps( l + i ), c ), _mm_mul_ps( _mm_loadu_ps( r + i ), c ) ) );
+			}
+			fltpStereoToMonoFltRange( in, i, samples, out );
+		}
+		__attribute__((target("sse2")))
+		static void s16StereoToMonoSse2(const uint8_t* const* in, int, int samples, uint8_t* out) {
+			const int16_t* s = (const int16_t*) in[0];
+			int16_t* o = (int16_t*) out;
+			const __m128i ones = _mm_set1_epi16( 1 );
+			const __m128i round = _mm_set1_epi32( 1 );
+			int i = 0;
+			for( ; i + 8 <= samples; i += 8 ) {
+				//L+R of each pair as 32 bits, rounded and halved
+				__m128i a = _mm_madd_epi16( _mm_loadu_si128( (const __m128i*) (s + 2 * i) ), ones );
+				__m128i b = _mm_madd_epi16( _mm_loadu_si128( (const __m128i*) (s + 2 * i + 8) ), ones );
+				a = _mm_srai_epi32( _mm_add_epi32( a, round ), 1 );
+				b = _mm_srai_epi32( _mm_add_epi32( b, round ), 1 );
+				_mm_storeu_si128( (__m128i*) (o + i), _mm_packs_epi32( a, b ) );
+			}
+			s16StereoToMonoRange( in, i, samples, out );
+		}
+		
+		//AVX2: twice the width. packs and unpacks work within 128 bit
+		//lanes, so results are put back into order with a permute
+		__attribute__((target("avx2")))
+		static inline __m256i s16x8(__m256 x, float scale) {
+			x = _mm256_mul_ps( x, _mm256_set1_ps( scale ) );
+			x = _mm256_min_ps( _mm256_max_ps( x, _mm256_set1_ps( -32768.0f ) ), _mm256_set1_ps( 32767.0f ) );
+			return _mm256_cvtps_epi32( x );
+		}
+		__attribute__((target("avx2")))
+		static void fltpToS16Avx2(const uint8_t* const* in, int channels, int samples, uint8_t* out) {
+			int16_t* o = (int16_t*) out;
+			int i = 0;
+			if( channels == 1 ) {
+				const float* a = (const float*) in[0];
+				for( ; i + 16 <= samples; i += 16 ) {
+					__m256i lo = s16x8( _mm256_loadu_ps( a + i ), 32768.0f );
+					__m256i hi = s16x8( _mm256_loadu_ps( a + i + 8 ), 32768.0f );
+					_mm256_storeu_si256( (__m256i*) (o + i),
+						_mm256_permute4x64_epi64( _mm256_packs_epi32( lo, hi ), 0xD8 ) );
+				}
+			} else if( channels == 2 ) {
+				//unpack and pack both stay in lane, which keeps the order
+				const float* l = (const float*) in[0];
+				const float* r = (const float*) in[1];
+				for( ; i + 8 <= samples; i += 8 ) {
+					__m256i a = s16x8( _mm256_loadu_ps( l + i ), 32768.0f );
+					__m256i b = s16x8( _mm256_loadu_ps( r + i ), 32768.0f );
+					_mm256_storeu_si256( (__m256i*) (o + 2 * i),
+						_mm256_packs_epi32( _mm256_unpacklo_epi32( a, b ), _mm256_unpackhi_epi32( a, b ) ) );
+				}
+			}
+			fltpToS16Range( in, channels, i, samples, out );
+		}
+		__attribute__((target("avx2")))
+		static void fltpToFltAvx2(const uint8_t* const* in, int channels, int samples, uint8_t* out) {
+			int i = 0;
+			if( channels == 2 ) {
+				const float* l = (const float*) in[0];
+				const float* r = (const float*) in[1];
+				float* o = (float*) out;
+				for( ; i + 8 <= samples; i += 8 ) {
+					__m256 a = _mm256_loadu_ps( l + i );
+					__m256 b = _mm256_loadu_ps( r + i );
+					__m256 lo = _mm256_unpacklo_ps( a, b );
+					__m256 hi = _mm256_unpackhi_ps( a, b );
+					_mm256_storeu_ps( o + 2 * i, _mm256_permute2f128_ps( lo, hi, 0x20 ) );
+					_mm256_storeu_ps( o + 2 * i + 8, _mm256_permute2f128_ps( lo, hi, 0x31 ) );
+				}
+			}
+			fltpToFltRange( in, channels, i, samples, out );
+		}
+		__attribute__((target("avx2")))
+		static void fltpStereoToMonoS16Avx2(const uint8_t* const* in, int, int samples, uint8_t* out) {
+			const float* l = (const float*) in[0];
+			const float* r = (const float*) in[1];
+			int16_t* o = (int16_t*) out;
+			int i = 0;
+			for( ; i + 16 <= samples; i += 16 ) {
+				__m256i lo = s16x8( _mm256_add_ps( _mm256_loadu_ps( l + i ), _mm256_loadu_ps( r + i ) ), 16384.0f );
+				__m256i hi = s16x8( _mm256_add_ps( _mm256_loadu_ps( l + i + 8 ), _mm256_loadu_ps( r + i + 8 ) ), 16384.0f );
+				_mm256_storeu_si256( (__m256i*) (o + i),
+					_mm256_permute4x64_epi64( _mm256_packs_epi32( lo, hi ), 0xD8 ) );
+			}
+			fltpStereoToMonoS16Range( in, i, samples, out );
+		}
+		__attribute__((target("avx2")))
+		static void fltpStereoToMonoFltAvx2(const uint8_t* const* in, int, int samples, uint8_t* out) {
+			const float* l = (const float*) in[0];
+			const float* r = (const float*) in[1];
+			float* o = (float*) out;
+			const __m256 c = _mm256_set1_ps( (float) M_SQRT1_2 );
+			int i = 0;
+			for( ; i + 8 <= samples; i += 8 ) {
+				_mm256_storeu_ps( o + i, _mm256_add_ps(
+					_mm256_mul_ps( _mm256_loadu_ps( l + i ), c ), _mm256_mul_ps( _mm256_loadu_ps( r + i ), c ) ) );
+			}
+			fltpStereoToMonoFltRange( in, i, samples, out );
+		}
+		__attribute__((target("avx2")))
+		static void s16StereoToMonoAvx2(const uint8_t* const* in, int, int samples, uint8_t* out) {
+			const int16_t* s = (const int16_t*) in[0];
+			int16_t* o = (int16_t*) out;
+			const __m256i ones = _mm256_set1_epi16( 1 );
+			const __m256i round = _mm256_set1_epi32( 1 );
+			int i = 0;
+			for( ; i + 16 <= samples; i += 16 ) {
+				__m256i a = _mm256_madd_epi16( _mm256_loadu_si256( (const __m256i*) (s + 2 * i) ), ones );
+				__m256i b = _mm256_madd_epi16( _mm256_loadu_si256( (const __m256i*) (s + 2 * i + 16) ), ones );
+				a = _mm256_srai_epi32( _mm256_add_epi32( a, round ), 1 );
+				b = _mm256_srai_epi32( _mm256_add_epi32( b, round ), 1 );
+				_mm256_storeu_si256( (__m256i*) (o + i),
+					_mm256_permute4x64_epi64( _mm256_packs_epi32( a, b ), 0xD8 ) );
+			}
+			s16StereoToMonoRange( in, i, samples, out );
+		}
+#endif
+
+		static Kernel pick(Isa isa, Kernel scalar, Kernel sse2, Kernel avx2) {
+			switch( isa ) {
+				case AVX2:
+					return avx2 ? avx2 : scalar;
+				case SSE2:
+					return sse2 ? sse2 : scalar;
+				default:
+					return scalar;
+			}
+		}
+	
+	public:
+		//widest instruction set the CPU supports
+		static Isa best() {
+#ifdef SAMPLE_KERNELS_X86
+			__builtin_cpu_init();
+			if( __builtin_cpu_supports("avx2") ) {
+				return AVX2;
+			}
+			if( __builtin_cpu_supports("sse2") ) {
+				return SSE2;
+			}
+#endif
+			return Scalar;
+		}
+		static bool supported(Isa isa) {
+			return isa <= best();
+		}
+		static const char* name(Isa isa) {
+			switch( isa ) {
+				case AVX2:
+					return "avx2";
+				case SSE2:
+					return "sse2";
+				default:
+					return "scalar";
+			}
+		}
+		
+		//kernel converting inFmt to packed outFmt without resampling.
+		//channels must match, or stereo is mixed down to mono. nullptr if
+		//there is none for the formats
+		static Kernel find(enum AVSampleFormat inFmt, int inChannels,
+			enum AVSampleFormat outFmt, int outChannels, Isa isa = best())
+		{
+			//one plane of float is planar and packed at the same time
+			bool fltp = inFmt == AV_SAMPLE_FMT_FLTP || (inFmt == AV_SAMPLE_FMT_FLT && inChannels == 1);
+			bool s16 = inFmt == AV_SAMPLE_FMT_S16;
+			if( fltp && outFmt == AV_SAMPLE_FMT_S16 && inChannels == outChannels ) {
+				return pick( isa, fltpToS16, SIMD(fltpToS16Sse2), SIMD(fltpToS16Avx2) );
+			}
+			if( fltp && outFmt == AV_SAMPLE_FMT_FLT && inChannels == outChannels && inChannels > 1 ) {
+				return pick( isa, fltpToFlt, SIMD(fltpToFltSse2), SIMD(fltpToFltAvx2) );
+			}
+			if( fltp && outFmt == AV_SAMPLE_FMT_S16 && inChannels == 2 && outChannels == 1 ) {
+				return pick( isa, fltpStereoToMonoS16, SIMD(fltpStereoToMonoS16Sse2), SIMD(fltpStereoToMonoS16Avx2) );
+			}
+			if( fltp && outFmt == AV_SAMPLE_FMT_FLT && inChannels == 2 && outChannels == 1 ) {
+				return pick( isa, fltpStereoToMonoFlt, SIMD(fltpStereoToMonoFltSse2), SIMD(fltpStereoToMonoFltAvx2) );
+			}
+			if( s16 && outFmt == AV_SAMPLE_FMT_S16 && inChannels == 2 && outChannels == 1 ) {
+				return pick( isa, s16StereoToMono, SIMD(s16StereoToMonoSse2), SIMD(s16StereoToMonoAvx2) );
+			}
+			return nullptr;
+		}
+};
+
+#undef SIMD
@@ -0,0 +1,213 @@
+#pragma once
+
+#include <deque>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <thread>
+#include <algorithm>
+
+#include "OpenAL.h"
+
+//Decides when the playback loop has to wake up: when a queued buffer has
+//been played or when the status line is due. With AL_SOFT_events OpenAL
+//Soft reports finished buffers, otherwise the end of the playing buffer
+//is computed from AL_SAMPLE_OFFSET. Also counts the wakeups and how long
+//played buffers waited to be refilled. Several sources can be followed,
+//e.g. while crossfading; the first one is 0, addSource() numbers the rest
+
+class Scheduler {
+	private:
+		typedef std::chrono::steady_clock clock;
+		
+		//buffers queued on a source, in playing order
+		struct Queued {
+			ALint samples;
+			ALint freq;
+		};
+		struct Queue {
+			Source* source;
+			std::deque<Queued> queued;
+			clock::time_point frontDue;
+			//completion times reported by the event thread, not yet
+			//handled; guarded by mutexEvent
+			std::deque<clock::time_point> finished;
+		};
+		std::vector<Queue> queues;
+		
+		bool events = false;
+		std::mutex mutexEvent;
+		std::condition_variable condEvent;
+		
+		bool anyFinished() {
+			for( auto& q : queues ) {
+				if( !q.finished.empty() ) {
+					return true;
+				}
+			}
+			return false;
+		}
+		
+		clock::time_point started;
+		long wakeups = 0;
+		long refills = 0;
+		double refillLatency = 0;
+		double maxRefillLatency = 0;
+
+#ifdef AL_SOFT_events
+		LPALEVENTCONTROLSOFT alEventControlSOFT = nullptr;
+		LPALEVENTCALLBACKSOFT alEventCallbackSOFT = nullptr;
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-parameter"
+		//called on OpenAL's event thread; mustn't call into OpenAL
+		static void AL_APIENTRY onEvent(ALenum type, ALuint object, ALuint param,
+			ALsizei length, const ALchar* message, void* user)
+		{
+			Scheduler* sched = (Scheduler*) user;
+			if( type != AL_EVENT_TYPE_BUFFER_COMPLETED_SOFT ) {
+				return;
+			}
+			{
+				std::lock_guard<std::mutex> lck( sched->mutexEvent );
+				for( auto& q : sched->queues ) {
+					if( object == q.source->source ) {
+						for( ALuint i = 0; i < param; i++ ) {
+							q.finished.push_back( clock::now() );
+						}
+					}
+				}
+			}
+			sched->condEvent.notify_one();
+		}
+#pragma GCC diagnostic pop
+#endif
+
+	public:
+		Scheduler(Source& source): started(clock::now()) {
+			addSource( source );
+#ifdef AL_SOFT_events
+			if( alIsExtensionPresent("AL_SOFT_events") ) {
+				alEventControlSOFT = (LPALEVENTCONTROLSOFT) alGetProcAddress("alEventControlSOFT");
+				alEventCallbackSOFT = (LPALEVENTCALLBACKSOFT) alGetProcAddress("alEventCallbackSOFT");
+			}
+			if( alEventControlSOFT && alEventCallbackSOFT ) {
+				ALenum type = AL_EVENT_TYPE_BUFFER_COMPLETED_SOFT;
+				alEventCallbackSOFT( onEvent, this );
+				alEventControlSOFT( 1, &type, AL_TRUE );
+				events = true;
+			}
+#endif
+		}
+		~Scheduler() {
+#ifdef AL_SOFT_events
+			if( events ) {
+				ALenum type = AL_EVENT_TYPE_BUFFER_COMPLETED_SOFT;
+				alEventControlSOFT( 1, &type, AL_FALSE );
+				alEventCallbackSOFT( NULL, NULL );
+			}
+#endif
+		}
+		Scheduler(const Scheduler&) = delete;
+		Scheduler& operator=(const Scheduler&) = delete;
+		
+		//follows another source as well; returns its number
+		int addSource(Source& source) {
+			std::lock_guard<std::mutex> lck( mutexEvent );
+			queues.push_back( Queue() );
+			queues.back().source = &source;
+			return queues.size() - 1;
+		}
+		
+		//book-keeping of source s's queue
+		void queue(ALint samples, ALint freq, int s = 0) {
+			queues[s].queued.push_back( Queued{ samples, freq } );
+		}
+		void unqueue(int s = 0) {
+			Queue& q = queues[s];
+			if( q.queued.empty() ) {
+				return;
+			}
+			q.queued.pop_front();
+			
+			//the buffer finished at its reported or computed end
+			clock::time_point done = q.frontDue;
+			if( events ) {
+				std::lock_guard<std::mutex> lck( mutexEvent );
+				if( !q.finished.empty() ) {
+					done = q.finished.front();
+					q.finished.pop_front();
+				}
+			}
+			double latency = std::max( 0.0, std::chrono::duration<double>( clock::now() - done ).count() );
+			refillLatency += latency;
+			maxRefillLatency = std::max( maxRefillLatency, latency );
+			refills++;
+		}
+		
+		//all buffers have been taken off the sources without being played
+		void clear() {
+			std::lock_guard<std::mutex> lck( mutexEvent );
+			for( auto& q : queues ) {
+				q.queued.clear();
+				q.finished.clear();
+			}
+		}
+		
+		//seconds until everything queued on source s has been played
+		double remaining(int s) {
+			Queue& q = queues[s];
+			double left = 0;
+			for( auto& b : q.queued ) {
+				left += (double) b.samples / b.freq;
+			}
+			if( !q.queued.empty() ) {
+				left -= (double) q.source->getSampleOffset() / q.queued.front().freq;
+			}
+			return std::max( 0.0, left );
+		}
+		
+		//sleeps until a playing buffer has finished, but at most for
+		//maxSeconds
+		void wait(double maxSeconds) {
+			clock::time_point now = clock::now();
+			clock::time_point deadline = now + std::chrono::duration_cast<clock::duration>(
+				std::chrono::duration<double>( maxSeconds ) );
+			for( auto& q : queues ) {
+				if( q.queued.empty() ) {
+					continue;
+				}
+				const Queued& front = q.queued.front();
+				double remaining = (double) (front.samples - q.source->getSampleOffset()) / front.freq;
+				q.frontDue = now + std::chrono::duration_cast<clock::duration>(
+					std::chrono::duration<double>( std::max( 0.0, remaining ) ) );
+				if( !events ) {
+					deadline = std::min( deadline, q.frontDue + std::chrono::milliseconds(1) );
+				}
+			}
+			
+			if( events ) {
+				std::unique_lock<std::mutex> lck( mutexEvent );
+				condEvent.wait_until( lck, deadline, [this]() { return anyFinished(); });
+			} else {
+				std::this_thread::sleep_until( deadline );
+			}
+			wakeups++;
+		}
+		
+		bool eventDriven() {
+			return events;
+		}
+		double wakeupsPerSecond() {
+			double elapsed = std::chrono::duration<double>( clock::now() - started ).count();
+			return elapsed > 0 ? wakeups / elapsed : 0;
+		}
+		//seconds between a buffer finishing and it being refilled
+		double meanRefillLatency() {
+			return refills ? refillLatency / refills : 0;
+		}
+		double peakRefillLatency() {
+			return maxRefillLatency;
+		}
+};
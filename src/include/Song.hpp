@@ -1,47 +1,157 @@
 #pragma once
 
-#include <queue>
+#include <deque>
+#include <vector>
+#include <chrono>
+#include <algorithm>
 
 #include <cstdio>
+#include <cstdint>
 
+#include "OpenAL.h"
 #include "Loader.hpp"
+#include "RingBuffer.hpp"
 
-//Provides interface to print current song info and to check whether
-//a new song is playing
+//Provides interface to print current song info and to tell which song
+//is playing and where. Every buffer queued on the source is tracked with
+//the song, position (pts) and length of the PCM chunk uploaded to it;
+//with the source's sample offset into its queue this gives the song and
+//position being played to the sample. With AL_SOFT_source_latency the
+//time until the device outputs that sample is taken off as well. Song
+//boundaries on the source are measured as they're played: the samples
+//missing at the start of the incoming song, plus the time the source ran
+//dry in between. Only used by the playback loop, so it needs no locking
 
 class Song {
 	private:
+		struct Queued {
+			int song;
+			int64_t pts;	//in samples at freq
+			int samples;
+			int freq;
+			int gap;		//index into gaps if the song starts here, else -1
+		};
+		
 		Loader* load;
+		Source* source;
+		//buffers on the source in playing order, played ones that haven't
+		//been detached yet included
+		std::deque<Queued> queued;
 		int actSong;
-		std::queue<int> play;
+		double seconds = 0;
+		double latency = 0;
 		
-		void push(int i) {
-			play.push(i);
-		}
-	public:
+		//samples between the songs at each boundary as played
+		std::vector<long> gaps;
+		int lastPushed = -1;
+		//when the source plays the last sample queued, as of the last
+		//update() and push() while it plays
+		std::chrono::steady_clock::time_point dryAt;
 		
-		Song(Loader& load_): load(&load_), actSong(0) {}
+		static std::chrono::steady_clock::duration toDuration(double seconds) {
+			return std::chrono::duration_cast<std::chrono::steady_clock::duration>( std::chrono::duration<double>( seconds ) );
+		}
 		
-		void push() { push(load->actSong()); }
-		bool change() { return actSong != play.front(); }
+		//song and position of sample offset of the source's queue
+		void locate(int64_t offset, int& song, double& at) {
+			for( auto& q : queued ) {
+				if( offset < q.samples ) {
+					song = q.song;
+					at = (double) (q.pts + offset) / q.freq;
+					return;
+				}
+				offset -= q.samples;
+			}
+			//past the end of the queue
+			const Queued& q = queued.back();
+			song = q.song;
+			at = (double) (q.pts + q.samples) / q.freq;
+		}
+	
+	public:
+	
+		Song(Loader& load_, Source& source_): load(&load_), source(&source_), actSong(-1) {}
 		
-		Song& updateUser() {
-			actSong = play.front();
-			load->printBanner(actSong);
-			
-			return *this;
+		//a buffer with chunk has been queued on the source. a song that
+		//follows another one is contiguous if it starts at its first sample
+		void push(const PcmChunk& chunk) {
+			int gap = -1;
+			if( lastPushed >= 0 && chunk.song != lastPushed ) {
+				gap = gaps.size();
+				gaps.push_back( chunk.pts );
+			}
+			lastPushed = chunk.song;
+			int samples = chunk.size / chunk.frameSize;
+			queued.push_back( Queued{ chunk.song, chunk.pts, samples, chunk.freq, gap } );
+			if( dryAt > std::chrono::steady_clock::now() ) {
+				dryAt += toDuration( (double) samples / chunk.freq );
+			}
+		}
+		//the oldest buffer has been detached from the source
+		void pop() {
+			if( queued.size() ) {
+				queued.pop_front();
+			}
+		}
+		//all buffers have been taken off the source, e.g. for a seek. the
+		//song after it isn't a boundary
+		void clear() {
+			queued.clear();
+			lastPushed = -1;
+		}
+		//the source ran dry and plays again: if its queue starts a song,
+		//the time it stood still is part of that boundary's gap
+		void restarted() {
+			if( queued.empty() || queued.front().gap < 0 ) {
+				return;
+			}
+			const Queued& q = queued.front();
+			double dry = std::chrono::duration<double>( std::chrono::steady_clock::now() - dryAt ).count();
+			gaps[q.gap] += std::max( 0.0, dry ) * q.freq;
 		}
-		void nextBuffer() { play.pop(); }
 		
-		void updateSongInfo() {
-			if(!play.size()) return;
-			if( change() ) {
-				updateUser();
+		//finds out what's playing; prints the banner and returns true if
+		//it's another song than before
+		bool update() {
+			if( queued.empty() ) {
+				return false;
+			}
+			int64_t offset;
+			int song;
+			//a stopped source has played everything and reports offset 0
+			if( source->getState() == AL_STOPPED ) {
+				offset = INT64_MAX;
+				latency = 0;
+			} else {
+				source->getSampleOffsetLatency( offset, latency );
+				double remaining = 0;
+				int64_t skip = offset;
+				for( auto& q : queued ) {
+					remaining += (double) std::max( (int64_t) 0, q.samples - std::max( (int64_t) 0, skip ) ) / q.freq;
+					skip -= q.samples;
+				}
+				dryAt = std::chrono::steady_clock::now() + toDuration( remaining );
+			}
+			locate( offset, song, seconds );
+			seconds = std::max( 0.0, seconds - latency );
+			if( song == actSong ) {
+				return false;
 			}
-			nextBuffer();
+			actSong = song;
+			load->printBanner( actSong );
+			return true;
 		}
+		int current() { return actSong; }
+		//seconds into the current song, as of update()
+		double position() { return seconds; }
+		//seconds until a sample played by the source is heard, 0 if unknown
+		double outputLatency() { return latency; }
+		//samples of the incoming song missing or silent at each boundary
+		//so far, 0 where it followed the song before sample-contiguously
+		const std::vector<long>& boundaryGaps() { return gaps; }
 		
 		void debugInfo() {
-			printf("\t{% 2li/% 2i/% 2i}", play.size(), play.size() ? play.front(): -1, actSong);
+			printf("\t{% 2li/% 2i/% 2i % 4.1f ms}", queued.size(), queued.size() ? queued.front().song : -1,
+				actSong, latency * 1000);
 		}
 };
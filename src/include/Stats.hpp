@@ -0,0 +1,223 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <string>
+#include <sstream>
+#include <fstream>
+#include <iomanip>
+#include <algorithm>
+#include <cstdint>
+
+//Counters and latency histograms for each stage of the playback path,
+//so a stutter can be traced to I/O, the codec, the conversion or the
+//upload to OpenAL. Recording a sample costs two clock reads and a few
+//relaxed atomic increments, and stages are only timed if a Stats object
+//has been handed out (--stats). A thread appends a JSON snapshot of
+//everything to the stats file periodically, one object per line
+
+class Stats {
+	public:
+		typedef std::chrono::steady_clock clock;
+		
+		enum Stage {
+			Read,			//av_read_frame
+			SendPacket,		//avcodec_send_packet
+			ReceiveFrame,	//avcodec_receive_frame
+			Convert,		//Converter::convert
+			Copy,			//memcpy of audio that needs no conversion
+			Upload,			//Buffer::setData
+			WaitRoom,		//decoder waiting for room in the ring
+			WaitData,		//playback waiting for a decoded chunk
+			Seek,			//from a seek request until playback restarts
+			Fill,			//Loader::fillAudioBuffer
+			FillOverlap,	//the same while two songs are crossfaded
+			Animate,		//moving the sources, one tick of the Animator
+			Jitter,			//how late an Animator tick woke up
+			Stages
+		};
+		enum Counter {
+			Frames,			//decoded frames
+			Chunks,			//chunks handed to the playback loop
+			DecodedBytes,
+			UploadedBytes,
+			Underruns,		//source ran dry and was restarted
+			Crossfades,
+			Counters
+		};
+		
+		//durations in power of two buckets of nanoseconds; bucket b
+		//holds [2^b, 2^(b+1)). lock-free, any thread may record
+		class Histogram {
+			private:
+				static const int buckets = 40;
+				std::atomic<long> count;
+				std::atomic<long> totalNs;
+				std::atomic<long> maxNs;
+				std::atomic<long> bucket[buckets];
+			
+			public:
+				Histogram(): count(0), totalNs(0), maxNs(0) {
+					for( auto& b : bucket ) {
+						b = 0;
+					}
+				}
+				
+				void record(long ns) {
+					ns = std::max( 1L, ns );
+					int b = std::min( buckets - 1, 63 - __builtin_clzll( ns ) );
+					bucket[b].fetch_add( 1, std::memory_order_relaxed );
+					count.fetch_add( 1, std::memory_order_relaxed );
+					totalNs.fetch_add( ns, std::memory_order_relaxed );
+					long max = maxNs.load( std::memory_order_relaxed );
+					while( ns > max && !maxNs.compare_exchange_weak( max, ns, std::memory_order_relaxed ) );
+				}
+				
+				//upper bound of the bucket the p-quantile falls into
+				double percentileUs(double p) {
+					long n = count.load( std::memory_order_relaxed );
+					long seen = 0;
+					for( int b = 0; b < buckets; b++ ) {
+						seen += bucket[b].load( std::memory_order_relaxed );
+						if( n > 0 && seen >= p * n ) {
+							return std::min( (double) (2L << b), (double) maxNs ) / 1000;
+						}
+					}
+					return maxNs / 1000.0;
+				}
+				
+				void json(std::ostream& os) {
+					long n = count;
+					os << "{\"count\": " << n
+						<< ", \"total_ms\": " << totalNs / 1e6
+						<< ", \"mean_us\": " << (n ? totalNs / 1e3 / n : 0)
+						<< ", \"p50_us\": " << percentileUs( 0.5 )
+						<< ", \"p99_us\": " << percentileUs( 0.99 )
+						<< ", \"max_us\": " << maxNs / 1e3 << "}";
+				}
+		};
+		
+		//times the scope it lives in; does nothing without stats
+		class Timer {
+			private:
+				Stats* stats;
+				Stage stage;
+				clock::time_point start;
+			
+			public:
+				Timer(Stats* stats_, Stage stage_): stats(stats_), stage(stage_) {
+					if( stats ) {
+						start = clock::now();
+					}
+				}
+				~Timer() {
+					if( stats ) {
+						stats->record( stage, clock::now() - start );
+					}
+				}
+				Timer(const Timer&) = delete;
+				Timer& operator=(const Timer&) = delete;
+		};
+	
+	private:
+		Histogram stages[Stages];
+		std::atomic<long> counters[Counters];
+		clock::time_point started;
+		
+		std::string fileName;
+		std::thread threadDump;
+		std::mutex mutexDump;
+		std::condition_variable condDump;
+		bool stop = false;
+		
+		static const char* name(Stage s) {
+			static const char* names[] = {
+				"read", "send_packet", "receive_frame", "convert", "copy",
+				"upload", "wait_room", "wait_data", "seek",
+				"fill", "fill_overlap", "animate", "jitter"
+			};
+			return names[s];
+		}
+		static const char* name(Counter c) {
+			static const char* names[] = {
+				"frames", "chunks", "decoded_bytes", "uploaded_bytes", "underruns",
+				"crossfades"
+			};
+			return names[c];
+		}
+	
+	public:
+		Stats(): started(clock::now()) {
+			for( auto& c : counters ) {
+				c = 0;
+			}
+		}
+		~Stats() {
+			stopDump();
+		}
+		Stats(const Stats&) = delete;
+		Stats& operator=(const Stats&) = delete;
+		
+		void record(Stage s, clock::duration d) {
+			stages[s].record( std::chrono::duration_cast<std::chrono::nanoseconds>( d ).count() );
+		}
+		void add(Counter c, long n = 1) {
+			counters[c].fetch_add( n, std::memory_order_relaxed );
+		}
+		long get(Counter c) {
+			return counters[c];
+		}
+		
+		//all counters and histograms as one line of JSON
+		std::string json() {
+			std::stringstream ss;
+			ss << std::fixed << std::setprecision(3);
+			ss << "{\"t\": " << std::chrono::duration<double>( clock::now() - started ).count();
+			for( int c = 0; c < Counters; c++ ) {
+				ss << ", \"" << name( (Counter) c ) << "\": " << counters[c];
+			}
+			ss << ", \"stages\": {";
+			for( int s = 0; s < Stages; s++ ) {
+				ss << (s ? ", " : "") << "\"" << name( (Stage) s ) << "\": ";
+				stages[s].json( ss );
+			}
+			ss << "}}";
+			return ss.str();
+		}
+		
+		//appends a snapshot to file now, and every periodMs from a
+		//thread of its own until stopDump()
+		Stats& startDump(std::string file, int periodMs) {
+			fileName = file;
+			dump();
+			threadDump = std::thread( [this, periodMs]() {
+				std::unique_lock<std::mutex> lck( mutexDump );
+				while( !condDump.wait_for( lck, std::chrono::milliseconds( periodMs ), [this]() { return stop; }) ) {
+					dump();
+				}
+			});
+			
+			return *this;
+		}
+		//stops the thread and writes a last snapshot
+		void stopDump() {
+			if( !threadDump.joinable() ) {
+				return;
+			}
+			{
+				std::lock_guard<std::mutex> lck( mutexDump );
+				stop = true;
+			}
+			condDump.notify_one();
+			threadDump.join();
+			dump();
+		}
+		bool dump() {
+			std::ofstream os( fileName, std::ios::app );
+			os << json() << std::endl;
+			return (bool) os;
+		}
+};
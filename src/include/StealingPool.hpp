@@ -0,0 +1,144 @@
+#pragma once
+
+#include <vector>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <algorithm>
+
+//Fixed number of threads, each with a queue of its own. A worker takes
+//the newest job of its own queue and, when that's empty, steals the
+//oldest one of another queue. Jobs submitted by a worker go to its own
+//queue, so a job that resubmits itself stays on the same thread (and
+//cache) unless others run out of work. Meant for many short jobs on the
+//playback path, e.g. decoding the next chunks of hundreds of streams.
+//Jobs still queued on destruction are dropped
+
+class StealingPool {
+	private:
+		struct Queue {
+			std::deque<std::function<void()>> jobs;
+			std::mutex mutex;
+		};
+		std::vector<std::unique_ptr<Queue>> queues;
+		std::vector<std::thread> workers;
+		
+		//queued jobs; idle workers sleep until there are any
+		std::atomic<long> pending;
+		std::mutex mutexIdle;
+		std::condition_variable condIdle;
+		bool stop = false;
+		
+		std::atomic<unsigned> next;
+		std::atomic<long> steals;
+		
+		//pool and index of the worker the calling thread is
+		struct Self {
+			StealingPool* pool;
+			int index;
+		};
+		static Self& self() {
+			static thread_local Self s{ nullptr, -1 };
+			return s;
+		}
+		
+		bool take(int w, std::function<void()>& job) {
+			{
+				Queue& q = *queues[w];
+				std::lock_guard<std::mutex> lck( q.mutex );
+				if( !q.jobs.empty() ) {
+					job = std::move( q.jobs.back() );
+					q.jobs.pop_back();
+					return true;
+				}
+			}
+			for( uint n = 1; n < queues.size(); n++ ) {
+				Queue& q = *queues[(w + n) % queues.size()];
+				std::lock_guard<std::mutex> lck( q.mutex );
+				if( !q.jobs.empty() ) {
+					job = std::move( q.jobs.front() );
+					q.jobs.pop_front();
+					steals.fetch_add( 1, std::memory_order_relaxed );
+					return true;
+				}
+			}
+			return false;
+		}
+		
+		void work(int w) {
+			self() = Self{ this, w };
+			std::function<void()> job;
+			while( true ) {
+				if( take( w, job ) ) {
+					pending.fetch_sub( 1 );
+					job();
+					job = nullptr;
+					continue;
+				}
+				std::unique_lock<std::mutex> lck( mutexIdle );
+				condIdle.wait( lck, [this]() { return stop || pending > 0; });
+				if( stop ) {
+					return;
+				}
+			}
+		}
+	
+	public:
+		//num <= 0: one thread per core
+		StealingPool(int num = 0): pending(0), next(0), steals(0) {
+			if( num <= 0 ) {
+				num = std::max( 1u, std::thread::hardware_concurrency() );
+			}
+			for( int i = 0; i < num; i++ ) {
+				queues.emplace_back( new Queue() );
+			}
+			for( int i = 0; i < num; i++ ) {
+				workers.push_back( std::thread( &StealingPool::work, this, i ) );
+			}
+		}
+		~StealingPool() {
+			{
+				std::lock_guard<std::mutex> lck( mutexIdle );
+				stop = true;
+			}
+			condIdle.notify_all();
+			for( auto& worker : workers ) {
+				worker.join();
+			}
+		}
+		StealingPool(const StealingPool&) = delete;
+		StealingPool& operator=(const StealingPool&) = delete;
+		
+		//queues job on the calling worker's queue, or round robin if the
+		//caller isn't a worker of this pool
+		StealingPool& submit(std::function<void()> job) {
+			int w = self().index;
+			if( self().pool != this ) {
+				w = next.fetch_add( 1, std::memory_order_relaxed ) % queues.size();
+			}
+			{
+				Queue& q = *queues[w];
+				std::lock_guard<std::mutex> lck( q.mutex );
+				q.jobs.push_back( std::move( job ) );
+			}
+			pending.fetch_add( 1 );
+			{
+				std::lock_guard<std::mutex> lck( mutexIdle );
+			}
+			condIdle.notify_one();
+			
+			return *this;
+		}
+		
+		int size() {
+			return workers.size();
+		}
+		//jobs taken from another worker's queue so far
+		long stolen() {
+			return steals;
+		}
+};
@@ -0,0 +1,352 @@
+#pragma once
+
+#include <string>
+#include <sstream>
+#include <atomic>
+#include <vector>
+#include <algorithm>
+#include <stdexcept>
+#include <cerrno>
+
+#include "Converter.hpp"
+#include "LibraryIndex.hpp"
+#include "MappedInput.hpp"
+#include "CodecThreads.hpp"
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavutil/dict.h>
+}
+
+//One entry of the playlist: the file, its ffmpeg contexts and the
+//metadata shown in the banner. Tracks are probed lazily, possibly by a
+//worker thread; state tells whether the contexts are ready to be used.
+//Once a track has been played its contexts are closed again, it's only
+//opened once more if it's sought back to
+
+class Track {
+	private:
+		//error checking function
+		void ce(int errnum, std::string msg) {
+			if( errnum < 0 ) {
+				char err[AV_ERROR_MAX_STRING_SIZE];
+				av_strerror(errnum, err, AV_ERROR_MAX_STRING_SIZE);
+				
+				std::stringstream ss;
+				ss << msg << " (" << fileName << "):" << err;
+				
+				throw std::runtime_error(ss.str());
+			}
+		}
+	
+	public:
+		enum State { Unprobed, Probing, Ready, Failed, Closed };
+		
+		std::string fileName;
+		AVFormatContext* pFormatCtx = NULL;
+		int audioStream = -1;
+		AVCodecContext* aCodecCtx = NULL;
+		const AVCodec* aCodec = NULL;
+		Converter* conv = nullptr;
+		//rate of the decoded audio, which seek points and skips count in,
+		//and of the PCM it's played in once the converter is set up
+		int freq = 0;
+		int outFreq = 0;
+		
+		//meta information for the banner, valid once state is Ready (or
+		//Closed) or right away if the track is indexed
+		std::string title;
+		std::string artist;
+		float duration = 0;
+		
+		//what the library index knows about the file
+		bool indexed = false;
+		LibraryIndex::Info known;
+		
+		//output isn't in the requested format, as no converter could be
+		//set up for it
+		bool raw = false;
+		
+		//seek points, from the index or collected while the track is
+		//decoded from the start. complete once it has been decoded to the
+		//end without seeking
+		std::vector<LibraryIndex::SeekPoint> seekPoints;
+		bool seekPointsComplete = false;
+		bool collecting = true;
+		
+		//served from a mapping instead of avio's file protocol, if asked
+		//for and the file can be mapped
+		MappedInput* input = nullptr;
+		
+		std::atomic<int> state;
+		
+		Track(std::string name): fileName(name), state(Unprobed) {}
+		~Track() {
+			close();
+		}
+		Track(const Track&) = delete;
+		Track& operator=(const Track&) = delete;
+		
+		//interface to ffmpeg's functions
+		Track& init(bool mapped = false) {
+			if( mapped && (input = MappedInput::open( fileName )) ) {
+				pFormatCtx = avformat_alloc_context();
+				ce( pFormatCtx ? 0 : AVERROR(ENOMEM), "Couldn't allocate format context" );
+				pFormatCtx->pb = input->context();
+				pFormatCtx->flags |= AVFMT_FLAG_CUSTOM_IO;
+			}
+			ce(
+				avformat_open_input( &pFormatCtx, fileName.c_str(), NULL, NULL),
+				"Coudln't open file"
+			);
+			
+			return *this;
+		}
+		
+		Track& findStreamInfo() {
+			ce( avformat_find_stream_info( pFormatCtx, NULL ), "Couldn't find stream-info");
+			
+			return *this;
+		}
+		
+		Track& dumpFormat() {
+			av_dump_format( pFormatCtx, 0, fileName.c_str(), 0 );
+			
+			return *this;
+		}
+		
+		//checks all streams for type audio. terminates when it founds one
+		Track& findAudioStream() {
+			audioStream = -1;
+			for( uint i = 0; i < pFormatCtx->nb_streams; i++ ) {
+				if( pFormatCtx->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_AUDIO &&
+					audioStream < 0 )
+				{
+					audioStream = i;
+				}
+			}
+			ce( audioStream, "Couldn't find audio-stream.");
+			
+			return *this;
+		}
+		
+		//uses the audio stream the index knows about instead of probing
+		//the file for it. false if the container doesn't give enough
+		//information about the stream without avformat_find_stream_info
+		bool useAudioStream(int stream, int codecId) {
+			if( stream < 0 || (uint) stream >= pFormatCtx->nb_streams ) {
+				return false;
+			}
+			AVCodecParameters* par = pFormatCtx->streams[stream]->codecpar;
+			if( par->codec_type != AVMEDIA_TYPE_AUDIO || par->codec_id != codecId ||
+				par->sample_rate <= 0 || par->ch_layout.nb_channels <= 0 )
+			{
+				return false;
+			}
+			audioStream = stream;
+			
+			return true;
+		}
+		
+		//takes the seek points from the index, if it has them
+		Track& useSeekPoints(LibraryIndex* index) {
+			if( index->seekPoints( fileName, seekPoints ) ) {
+				seekPointsComplete = true;
+				collecting = false;
+			}
+			
+			return *this;
+		}
+		//adds a seek point about every second while decoding from the start
+		void notePacket(const AVPacket* packet) {
+			if( !collecting || packet->pos < 0 || packet->pts == AV_NOPTS_VALUE ) {
+				return;
+			}
+			int64_t time = av_rescale_q( packet->pts, pFormatCtx->streams[audioStream]->time_base, AV_TIME_BASE_Q );
+			if( seekPoints.empty() || time >= seekPoints.back().time + AV_TIME_BASE ) {
+				seekPoints.push_back( LibraryIndex::SeekPoint{ time, packet->pos } );
+			}
+		}
+		//the track has been decoded to its end; the seek points are kept
+		//in the index if they cover all of it
+		void decodedToEnd(LibraryIndex* index) {
+			if( !collecting ) {
+				return;
+			}
+			collecting = false;
+			seekPointsComplete = true;
+			if( index && !seekPoints.empty() ) {
+				index->putSeekPoints( fileName, seekPoints );
+			}
+		}
+		
+		//positions the demuxer at or before seconds into the track and
+		//flushes the decoder. a seek point is used if there is one, as
+		//byte positions are exact and cheap in any container, otherwise
+		//the container seeks by timestamp. skip is set to the samples to
+		//drop to get to seconds exactly, or to -1 if that has to be
+		//computed from the timestamp of the first frame
+		int64_t seek(double seconds, int64_t& skip) {
+			collecting = false;
+			AVStream* st = pFormatCtx->streams[audioStream];
+			int64_t start = st->start_time != AV_NOPTS_VALUE ?
+				av_rescale_q( st->start_time, st->time_base, AV_TIME_BASE_Q ) : 0;
+			int64_t target = start + (int64_t) (std::max( 0.0, seconds ) * AV_TIME_BASE);
+			
+			avcodec_flush_buffers( aCodecCtx );
+			if( conv ) {
+				conv->reset();
+			}
+			//points past the last one are only covered by complete points
+			auto point = std::upper_bound( seekPoints.begin(), seekPoints.end(), target,
+				[](int64_t t, const LibraryIndex::SeekPoint& p) { return t < p.time; });
+			bool covered = seekPointsComplete || point != seekPoints.end();
+			if( point != seekPoints.begin() && covered ) {
+				point--;
+				if( av_seek_frame( pFormatCtx, -1, point->pos, AVSEEK_FLAG_BYTE ) >= 0 ) {
+					skip = av_rescale( target - point->time, freq, AV_TIME_BASE );
+					return target;
+				}
+			}
+			ce(
+				av_seek_frame( pFormatCtx, audioStream, av_rescale_q( target, AV_TIME_BASE_Q, st->time_base ), AVSEEK_FLAG_BACKWARD ),
+				"Couldn't seek"
+			);
+			skip = -1;
+			
+			return target;
+		}
+		//samples between the first frame after a timestamp seek and target
+		int64_t samplesUntil(const AVFrame* frame, int64_t target) {
+			if( frame->best_effort_timestamp == AV_NOPTS_VALUE ) {
+				return 0;
+			}
+			int64_t time = av_rescale_q( frame->best_effort_timestamp, pFormatCtx->streams[audioStream]->time_base, AV_TIME_BASE_Q );
+			return std::max( (int64_t) 0, av_rescale( target - time, freq, AV_TIME_BASE ) );
+		}
+		
+		//takes the banner metadata from the index
+		Track& useIndex(const LibraryIndex::Info& info) {
+			indexed = true;
+			known = info;
+			title = info.title;
+			artist = info.artist;
+			duration = info.duration;
+			
+			return *this;
+		}
+		//what to put into the index once probed
+		LibraryIndex::Info indexInfo(int64_t size, int64_t mtime) {
+			LibraryIndex::Info info;
+			info.size = size;
+			info.mtime = mtime;
+			info.audioStream = audioStream;
+			info.codecId = aCodecCtx->codec_id;
+			info.sampleRate = freq;
+			info.duration = duration;
+			info.title = title;
+			info.artist = artist;
+			
+			return info;
+		}
+		
+		Track& createAudioContext() {
+			aCodecCtx = avcodec_alloc_context3(NULL);
+			ce(
+				avcodec_parameters_to_context( aCodecCtx, pFormatCtx->streams[audioStream]->codecpar ),
+				"Couldn't create audio context."
+			);
+			freq = aCodecCtx->sample_rate;
+			
+			return *this;
+		}
+		
+		Track& findDecoder() {
+			aCodec = avcodec_find_decoder(aCodecCtx->codec_id);
+			ce( -(aCodec == NULL), "Couldn't find matching codec.");
+			
+			return *this;
+		}
+		Track& openDecoder(const CodecThreads& threads = CodecThreads()) {
+			threads.apply( aCodecCtx, aCodec );
+			ce( avcodec_open2( aCodecCtx, aCodec, NULL ), "Couldn't open decoder.");
+			
+			return *this;
+		}
+		
+		Track& readMetadata() {
+			duration = pFormatCtx->duration / 1e6;
+			AVDictionaryEntry* tmp;
+			tmp = av_dict_get(pFormatCtx->metadata, "title", NULL, AV_DICT_IGNORE_SUFFIX);
+			title = tmp ? tmp->value : "";
+			tmp = av_dict_get(pFormatCtx->metadata, "artist", NULL, AV_DICT_IGNORE_SUFFIX);
+			artist = tmp ? tmp->value : "";
+			
+			return *this;
+		}
+		
+		//whether the decoder's output is packed and already in the given
+		//layout, sample format and rate, so it can be used as is
+		bool isFormat(int64_t outChLayout, enum AVSampleFormat outSampleFmt, int outSampleRate) {
+			const AVChannelLayout& in = aCodecCtx->ch_layout;
+			bool packed = in.nb_channels == 1 || !av_sample_fmt_is_planar( aCodecCtx->sample_fmt );
+			bool layout = in.nb_channels == av_popcount64( outChLayout ) && (in.nb_channels <= 2 ||
+				(in.order == AV_CHANNEL_ORDER_NATIVE && (int64_t) in.u.mask == outChLayout));
+			return packed && layout && av_get_packed_sample_fmt( aCodecCtx->sample_fmt ) == outSampleFmt &&
+				(outSampleRate == -1 || outSampleRate == aCodecCtx->sample_rate);
+		}
+		
+		//as the source audio may be different for each file, each needs
+		//its own converter, unless it's in the output format already.
+		//without one the decoded audio is used as is
+		Track& createConverter(int64_t outChLayout, enum AVSampleFormat outSampleFmt, int outSampleRate,
+			Converter::Quality quality = Converter::Default)
+		{
+			raw = false;
+			outFreq = freq;
+			if( isFormat( outChLayout, outSampleFmt, outSampleRate ) ) {
+				return *this;
+			}
+			conv = new Converter();
+			try{
+				conv->init( aCodecCtx, outChLayout, outSampleFmt, outSampleRate, quality );
+				outFreq = conv->getSampleRate();
+			} catch(const std::runtime_error& e) {
+				delete conv;
+				conv = nullptr;
+				raw = true;
+			}
+			
+			return *this;
+		}
+		
+		//format of the PCM the track is played in
+		int getChannels() {
+			return conv ? conv->getChannels() : aCodecCtx->ch_layout.nb_channels;
+		}
+		enum AVSampleFormat getSampleFormat() {
+			return conv ? conv->getSampleFormat() : av_get_packed_sample_fmt( aCodecCtx->sample_fmt );
+		}
+		//bytes per output sample over all channels
+		int getFrameSize() {
+			return getChannels() * av_get_bytes_per_sample( getSampleFormat() );
+		}
+		
+		void close() {
+			if( aCodecCtx ) {
+				avcodec_free_context( &aCodecCtx );
+			}
+			if( pFormatCtx ) {
+				avformat_close_input( &pFormatCtx );
+			}
+			if( input ) {
+				delete input;
+				input = nullptr;
+			}
+			if( conv ) {
+				delete conv;
+				conv = nullptr;
+			}
+		}
+};
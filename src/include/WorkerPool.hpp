@@ -0,0 +1,76 @@
+#pragma once
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <algorithm>
+
+//Fixed number of threads working off a queue of jobs. Used for work
+//that is off the playback path (probing files etc.), so a plain locked
+//queue is good enough. Jobs still queued on destruction are dropped
+
+class WorkerPool {
+	private:
+		std::vector<std::thread> workers;
+		std::deque<std::function<void()>> jobs;
+		std::mutex mutexJobs;
+		std::condition_variable condJobs;
+		bool stop = false;
+		
+		void work() {
+			while( true ) {
+				std::function<void()> job;
+				{
+					std::unique_lock<std::mutex> lck( mutexJobs );
+					condJobs.wait( lck, [this]() { return stop || !jobs.empty(); });
+					if( stop ) {
+						return;
+					}
+					job = std::move( jobs.front() );
+					jobs.pop_front();
+				}
+				job();
+			}
+		}
+	
+	public:
+		//num <= 0: one thread per core
+		WorkerPool(int num = 0) {
+			if( num <= 0 ) {
+				num = std::max( 1u, std::thread::hardware_concurrency() );
+			}
+			for( int i = 0; i < num; i++ ) {
+				workers.push_back( std::thread( &WorkerPool::work, this ) );
+			}
+		}
+		~WorkerPool() {
+			{
+				std::lock_guard<std::mutex> lck( mutexJobs );
+				stop = true;
+				jobs.clear();
+			}
+			condJobs.notify_all();
+			for( auto& worker : workers ) {
+				worker.join();
+			}
+		}
+		WorkerPool(const WorkerPool&) = delete;
+		WorkerPool& operator=(const WorkerPool&) = delete;
+		
+		WorkerPool& submit(std::function<void()> job) {
+			{
+				std::lock_guard<std::mutex> lck( mutexJobs );
+				jobs.push_back( std::move( job ) );
+			}
+			condJobs.notify_one();
+			
+			return *this;
+		}
+		
+		int size() {
+			return workers.size();
+		}
+};
@@ -1,15 +1,22 @@
 #include <cstdio>
 #include <iostream>
 #include <iomanip>
+#include <sstream>
+#include <string>
 #include <vector>
+#include <memory>
 
-#include <unistd.h> //for usleep
+#include <getopt.h>
 #include <cmath>
 #include <cstdarg>
+#include <csignal>
+#include <fstream>
+#include <poll.h>
+#include <unistd.h>
 
 #include <thread>
-#include <mutex>
-#include <condition_variable>
+#include <chrono>
+#include <algorithm>
 
 #include <stdexcept>
 
@@ -23,152 +30,700 @@ extern "C" {
 #include "Converter.hpp"
 #include "Loader.hpp"
 #include "Song.hpp"
+#include "RingBuffer.hpp"
+#include "PcmCache.hpp"
+#include "LibraryIndex.hpp"
+#include "Scheduler.hpp"
+#include "OutputFormat.hpp"
+#include "Stats.hpp"
+#include "Animator.hpp"
+#include "Prefetcher.hpp"
+#include "LoudnessScanner.hpp"
 
 const float T = 200;
 const float PI = 3.14156;
 
-//uses a second thread to refill the audio buffer when playing
-
-std::mutex mutexLoader;
-std::condition_variable condResumeLoader;
-//InterThreadCommunication-Variable:
-// - Main -> Sub:
-//		+ 1: Refill Audio Buffer
-//		+ 0: Exit
-//	- Sub -> Main:
-//		+ -1: EOF, Buffer refilled
-//		+ -2: Buffer refilled
-int threadState = 3;
-
-void threadLoadAudioData(Loader& load, Song& song) {
-	do{
-		std::unique_lock<std::mutex> lck( mutexLoader );
-		condResumeLoader.wait( lck, []() { return threadState >= 0; });
-		
-		switch( threadState ) {
-			case 1:
-				if( load.complete() ) {
-					threadState = -1;
-				} else {
-					song.push();
-					load.fillAudioBuffer();
-					threadState = -2;
-				}
-				break;
-			case 0:
-			default:
+//uses a second thread to decode ahead while playing. decoded audio is
+//handed over through a lock-free ring of PCM chunks, so decoding and the
+//upload to OpenAL run concurrently. the ring tells the thread to stop
+//by being closed, the thread tells the main loop it's done by finishing
+void threadLoadAudioData(Loader& load, PcmRing& ring, Stats* stats) {
+	while( load.running() ) {
+		{
+			Stats::Timer timer( stats, Stats::WaitRoom );
+			if( !ring.waitWritable() ) {
 				break;
+			}
 		}
-	} while( threadState != 0 );
+		PcmChunk& chunk = *ring.writeSlot();
+		load.fillAudioBuffer( chunk );
+		if( chunk.size > 0 ) {
+			if( stats ) {
+				stats->add( Stats::Chunks );
+				stats->add( Stats::DecodedBytes, chunk.size );
+			}
+			ring.commitWrite();
+		}
+	}
+	ring.finish();
 }
 
-int main(int argc, char** argv)  {
-	if( argc < 2 ) {
-		std::cerr << "Usage: " << argv[0] << " <filename(s)>" << std::endl;
-		return EXIT_FAILURE;
+//Ctrl-C stops playback like the q command, so the position is saved
+static volatile sig_atomic_t interrupted = 0;
+void onInterrupt(int) {
+	interrupted = 1;
+}
+
+//seconds, m:s or h:m:s
+double parseTime(std::string s) {
+	double t = 0;
+	std::stringstream ss( s );
+	std::string part;
+	while( std::getline( ss, part, ':' ) ) {
+		t = t * 60 + atof( part.c_str() );
 	}
-	
-	//registers for all command line arguments a loader
-	Loader load;
-	for(int i = 1; i <= argc - 1; i++) {
-		load.init( &(argv[i]) ).dumpFormat()
-			.findStreamInfo().findAudioStream().createAudioContext()
-			.findDecoder().openDecoder();
-		//as the source audio may be different for each file, need a new one for each file
-		Converter* conv = new Converter();
-		try{
-			conv->init( load.getAudioCodecContext(), AV_CH_LAYOUT_MONO, AV_SAMPLE_FMT_S16, -1 );
-			load.registerConverter( conv );
-		} catch(const std::runtime_error& e) {
-			load.registerConverter( );
+	return t;
+}
+
+//reads a line typed on stdin without blocking: "+s"/"-s" seeks relative
+//to position, "s" (or m:s) to an absolute position and "q" quits.
+//returns true if a seek has been asked for
+bool readCommand(double position, double& target, bool& quit) {
+	static std::string pending;
+	static bool eof = false;
+	struct pollfd pfd = { STDIN_FILENO, POLLIN, 0 };
+	char buf[256];
+	while( !eof && poll( &pfd, 1, 0 ) > 0 ) {
+		ssize_t n = read( STDIN_FILENO, buf, sizeof(buf) );
+		if( n <= 0 ) {
+			eof = true;
+			break;
 		}
+		pending.append( buf, n );
+	}
+	size_t nl = pending.find( '\n' );
+	if( nl == std::string::npos ) {
+		return false;
+	}
+	std::string line = pending.substr( 0, nl );
+	pending.erase( 0, nl + 1 );
+	if( line.empty() ) {
+		return false;
+	}
+	if( line == "q" ) {
+		quit = true;
+		return false;
 	}
+	if( line[0] == '+' ) {
+		target = position + parseTime( line.substr( 1 ) );
+	} else if( line[0] == '-' ) {
+		target = position - parseTime( line.substr( 1 ) );
+	} else {
+		target = parseTime( line );
+	}
+	target = std::max( 0.0, target );
+	return true;
+}
+
+std::chrono::steady_clock::duration toDuration(double seconds) {
+	return std::chrono::duration_cast<std::chrono::steady_clock::duration>( std::chrono::duration<double>( seconds ) );
+}
+
+//a source with its own buffers and the songs queued on them. with a
+//crossfade the incoming song plays on the second lane while the first
+//one fades out; the lanes take turns
+struct Lane {
+	Source* source;
+	float level = 1;	//the song's gain for the same loudness
+	std::vector<ALuint> spare;
+	//filled by a refill, queued together at its end
+	std::vector<ALuint> uploaded;
+	//OpenAL format and rate of what's queued. a source only takes
+	//buffers of one format and rate at a time
+	ALenum format = 0;
+	int freq = 0;
+	//the source ran dry for a change of format, not an underrun
+	bool restart = false;
+	Song song;
+	
+	Lane(Source& source_, Loader& load): source(&source_), song(load, source_) {}
+	
+	//takes back all played buffers in one call
+	int detach() {
+		size_t n = spare.size();
+		spare.resize( spare.capacity() );
+		n += source->detachBuffers( &spare[n], spare.size() - n );
+		spare.resize( n );
+		return n;
+	}
+};
+
+//copies a decoded chunk to an OpenAL buffer
+Buffer& upload(Buffer& buffer, OutputFormat& formats, PcmChunk& chunk, Stats* stats) {
+	Stats::Timer timer( stats, Stats::Upload );
+	buffer.setData( formats.alFormat( chunk.channels, chunk.format ), chunk.pcm(), chunk.size, chunk.freq );
+	if( stats ) {
+		stats->add( Stats::UploadedBytes, chunk.size );
+	}
+	
+	return buffer;
+}
+
+int usage(char* name) {
+	std::cerr << "Usage: " << name << " [-d|--dump] [-c|--cache <dir>] [--cache-size <MB>] [-i|--index <file>] [-r|--refresh <ms>] [-l|--latency <ms>] [-b|--buffers <n>] [-t|--throughput] [-S|--no-spatial] [-s|--stats <file>] [--stats-interval <ms>] [--start <time>] [--resume <file>] [-x|--crossfade <s>] [-a|--animate <Hz>] [-m|--mmap] [-p|--prefetch <n>] [--prefetch-budget <MB>] [--codec-threads <n>] [-n|--normalize] [--target <LUFS>] [--resampler <fast|default|high|native>] <file(s), directories or playlists>" << std::endl;
+	return EXIT_FAILURE;
+}
 
-	//setup OpenAl with one listener and one source
+int main(int argc, char** argv)  {
+	bool dumpFormat = false;
+	std::string cacheDir;
+	int64_t cacheSize = 2048;
+	std::string indexFile;
+	int refresh = 100;
+	int latency = 200;
+	int numBuffers = 4;
+	bool throughput = false;
+	bool spatial = true;
+	std::string statsFile;
+	int statsInterval = 1000;
+	double startSeconds = 0;
+	std::string resumeFile;
+	float crossfade = 0;
+	double animateHz = 250;
+	bool mapped = false;
+	int prefetchAhead = 2;
+	int64_t prefetchBudget = 64;
+	int codecThreads = 0;
+	bool normalize = false;
+	double targetLufs = -18;
+	bool nativeRate = false;
+	Converter::Quality resampler = Converter::Default;
+	const struct option options[] = {
+		{ "dump", no_argument, NULL, 'd' },
+		{ "cache", required_argument, NULL, 'c' },
+		{ "cache-size", required_argument, NULL, 'C' },
+		{ "index", required_argument, NULL, 'i' },
+		{ "refresh", required_argument, NULL, 'r' },
+		{ "latency", required_argument, NULL, 'l' },
+		{ "buffers", required_argument, NULL, 'b' },
+		{ "throughput", no_argument, NULL, 't' },
+		{ "no-spatial", no_argument, NULL, 'S' },
+		{ "stats", required_argument, NULL, 's' },
+		{ "stats-interval", required_argument, NULL, 'I' },
+		{ "start", required_argument, NULL, 'P' },
+		{ "resume", required_argument, NULL, 'R' },
+		{ "crossfade", required_argument, NULL, 'x' },
+		{ "animate", required_argument, NULL, 'a' },
+		{ "mmap", no_argument, NULL, 'm' },
+		{ "prefetch", required_argument, NULL, 'p' },
+		{ "prefetch-budget", required_argument, NULL, 'B' },
+		{ "codec-threads", required_argument, NULL, 'T' },
+		{ "normalize", no_argument, NULL, 'n' },
+		{ "target", required_argument, NULL, 'G' },
+		{ "resampler", required_argument, NULL, 'Q' },
+		{ NULL, 0, NULL, 0 }
+	};
+	int opt;
+	while( (opt = getopt_long( argc, argv, "dc:i:r:l:b:tSs:x:a:mp:n", options, NULL )) != -1 ) {
+		switch( opt ) {
+			case 'd':
+				dumpFormat = true;
+				break;
+			case 'c':
+				cacheDir = optarg;
+				break;
+			case 'C':
+				cacheSize = atoll( optarg );
+				break;
+			case 'i':
+				indexFile = optarg;
+				break;
+			case 'r':
+				refresh = std::max( 1, atoi( optarg ) );
+				break;
+			case 'l':
+				latency = std::max( 1, atoi( optarg ) );
+				break;
+			case 'b':
+				numBuffers = std::max( 2, atoi( optarg ) );
+				break;
+			case 't':
+				throughput = true;
+				break;
+			case 'S':
+				spatial = false;
+				break;
+			case 's':
+				statsFile = optarg;
+				break;
+			case 'I':
+				statsInterval = std::max( 10, atoi( optarg ) );
+				break;
+			case 'P':
+				startSeconds = parseTime( optarg );
+				break;
+			case 'R':
+				resumeFile = optarg;
+				break;
+			case 'x':
+				crossfade = std::max( 0.0, atof( optarg ) );
+				break;
+			case 'a':
+				animateHz = std::max( 1.0, atof( optarg ) );
+				break;
+			case 'm':
+				mapped = true;
+				break;
+			case 'p':
+				prefetchAhead = std::max( 0, atoi( optarg ) );
+				break;
+			case 'B':
+				prefetchBudget = std::max( 1LL, atoll( optarg ) );
+				break;
+			case 'T':
+				codecThreads = std::max( 0, atoi( optarg ) );
+				break;
+			case 'n':
+				normalize = true;
+				break;
+			case 'G':
+				targetLufs = atof( optarg );
+				break;
+			case 'Q':
+				nativeRate = std::string( optarg ) == "native";
+				if( !nativeRate && !Converter::parseQuality( optarg, resampler ) ) {
+					return usage( argv[0] );
+				}
+				break;
+			default:
+				return usage( argv[0] );
+		}
+	}
+	if( optind >= argc ) {
+		return usage( argv[0] );
+	}
+	
+	//decoded songs are cached on disk if asked for
+	std::unique_ptr<PcmCache> cache;
+	if( !cacheDir.empty() ) {
+		cache.reset( new PcmCache( cacheDir, cacheSize * 1048576 ) );
+	}
+	
+	//known files are listed and bannered from the library index
+	std::unique_ptr<LibraryIndex> index;
+	if( !indexFile.empty() ) {
+		index.reset( new LibraryIndex( indexFile ) );
+	}
+	
+	//per-stage timings, dumped to a file as JSON lines while playing
+	std::unique_ptr<Stats> stats;
+	if( !statsFile.empty() ) {
+		stats.reset( new Stats() );
+		stats->startDump( statsFile, statsInterval );
+	}
+	
+	//streaming: numBuffers small buffers hold latency ms of audio on the
+	//source and are topped up as each one finishes. the ring in front of
+	//them is a fixed number of chunks, so memory doesn't grow with the
+	//length of a song. throughput: a few large buffers, decoded far ahead
+	//and refilled rarely
+	int chunkSize, ringChunks;
+	float chunkMs;
+	if( throughput ) {
+		numBuffers = 3;
+		ringChunks = 2;
+		chunkSize = 50 * 1048575;
+		chunkMs = 0;
+	} else {
+		ringChunks = 2 * numBuffers;
+		chunkMs = (float) latency / numBuffers;
+		//room for a chunk at 192 kHz and 8 float channels, plus a frame
+		chunkSize = std::max( 1048575, (int) (chunkMs * 192 * 32) + 262144 );
+	}
+	
+	//setup OpenAl with one listener and one source, two to crossfade
 	OpenAL al;
 	al.createContext().makeCurrent();
 
 	std::array<ALfloat,6> ori{{ 1.0f, 0.0f, 0.0f, 0.0f, 1.0f, 0.0f }};
 	al.getListener().setPosition(0, 0, 0).setVelocity(0, 0, 0)
 		.setOrientation(ori);
-	al.makeCurrent().genSources(1).sources[0].setPitch(1).setGain(2)
-		.setPosition(0, 0, 0).setVelocity(0, 0, 0).disableLooping();
-	
-	//3 small buffers to reduce loading time 
-	//(not necessary any more for modern machines)
-	al.genBuffers(3);
-	Song song(load);
-	for( uint i = 0; i < al.buffers.size() && !load.complete(); i++ ) {
-		song.push();
-		load.fillAudioBuffer();
-		
-		al.buffers[i].setData( AL_FORMAT_MONO16, load.audioBuffer, load.size, load.getFreq() );
-		al.sources[0].attachBuffer(al.buffers[i]);
+	//normalized songs are played at their level alone, which may boost
+	//quiet ones up to maxLevel (+24 dB, as far as OpenAL Soft mixes)
+	const ALfloat gain = normalize ? 1 : 2;
+	const ALfloat maxLevel = 16;
+	int numLanes = crossfade > 0 ? 2 : 1;
+	al.makeCurrent().genSources( numLanes );
+	for( auto& source : al.sources ) {
+		source.setPitch(1).setGain(gain)
+			.setPosition(0, 0, 0).setVelocity(0, 0, 0).disableLooping();
+		if( normalize ) {
+			source.setMaxGain( maxLevel );
+		}
 	}
 	
-	//start the 2nd thread to fill a larger buffer while already playing
-	load.setAudioBufferSize(50 * 1048575);
-	std::thread threadLoadAudio( threadLoadAudioData, std::ref(load), std::ref(song) );
-	{
-		std::unique_lock<std::mutex> lck( mutexLoader );
-		
-		song.updateUser().nextBuffer();
-		al.sources[0].play();
-		
-		threadState = 1;
-		condResumeLoader.notify_one();
+	//the sources circle the listener once every T tenths of a second,
+	//moved by a thread of their own
+	Animator::Trajectory orbit = [](double seconds, ALfloat& x, ALfloat& y, ALfloat& z) {
+		x = 1 * cos(2 * PI * seconds * 10 / T);
+		y = 1 * sin(2 * PI * seconds * 10 / T);
+		z = 0;
+	};
+	Animator anim( animateHz );
+	anim.setStats( stats.get() );
+	if( spatial ) {
+		for( auto& source : al.sources ) {
+			anim.add( source, orbit );
+		}
+	}
+	
+	//the output format of each song is negotiated with the device
+	OutputFormat formats( spatial );
+	
+	//the start of the next songs' files is read ahead into the page
+	//cache, so opening them doesn't wait for the disk
+	std::unique_ptr<Prefetcher> prefetcher;
+	if( prefetchAhead > 0 ) {
+		prefetcher.reset( new Prefetcher( prefetchBudget * 1048576, prefetchAhead ) );
+	}
+	
+	//the loudness of the songs is measured in the background, or taken
+	//from the index, a few songs before they're played
+	std::unique_ptr<LoudnessScanner> loudness;
+	if( normalize ) {
+		loudness.reset( new LoudnessScanner( index.get(), targetLufs ) );
+	}
+	
+	//registers all command line arguments (files, directories and
+	//playlists) with the loader. songs are read from them and probed in
+	//the background as playback gets close, it only waits for the first
+	Loader load;
+	load.negotiateFormat( &formats )
+		.setDumpFormat( dumpFormat ).setCache( cache.get() ).setIndex( index.get() )
+		.setStats( stats.get() ).setChunkDuration( chunkMs ).setCrossfade( crossfade ).setMappedInput( mapped )
+		.setPrefetcher( prefetcher.get() ).setCodecThreads( CodecThreads( 2, codecThreads ) )
+		.setLoudness( loudness.get() ).setOutputRate( nativeRate ? -1 : al.frequency(), resampler );
+	if( !nativeRate && resampler == Converter::High && !Converter::soxrAvailable() ) {
+		std::cerr << "No soxr in this ffmpeg, resampling with a long swr filter instead" << std::endl;
+	}
+	for(int i = optind; i <= argc - 1; i++) {
+		load.add( argv[i] );
+	}
+	
+	//playback starts at --start in the first song or where the last run
+	//with the same --resume file was quit
+	int startSong = 0;
+	if( !resumeFile.empty() ) {
+		std::ifstream resume( resumeFile );
+		double seconds;
+		std::string name;
+		if( resume >> seconds && resume.get() == '\t' && std::getline( resume, name ) ) {
+			startSong = load.skipTo( name );
+			if( load.songName( startSong ) == name ) {
+				startSeconds = seconds;
+			}
+		}
+	}
+	load.probeAhead();
+	//chunks decoded before the latest seek are dropped
+	int epoch = 0;
+	bool restart;
+	if( startSong > 0 || startSeconds > 0 ) {
+		epoch = load.seek( startSong, startSeconds, restart );
+	}
+
+	//buffers queued on the sources, refilled from a ring of decoded
+	//chunks. the decoder thread runs ahead while already playing
+	al.genBuffers( numBuffers * numLanes );
+	std::vector<Lane> lanes;
+	for( int l = 0; l < numLanes; l++ ) {
+		lanes.emplace_back( al.sources[l], load );
+		for( int b = 0; b < numBuffers; b++ ) {
+			lanes[l].spare.push_back( al.buffers[l * numBuffers + b].buffer );
+		}
+		lanes[l].uploaded.reserve( numBuffers );
+	}
+	PcmRing ring( ringChunks, chunkSize );
+	std::thread threadLoadAudio( threadLoadAudioData, std::ref(load), std::ref(ring), stats.get() );
+	Scheduler sched( al.sources[0] );
+	for( int l = 1; l < numLanes; l++ ) {
+		sched.addSource( al.sources[l] );
+	}
+	
+	//fg: lane of the song being played. while crossfading, the incoming
+	//song waits on lane pending until fadeStart, then lane fading fades
+	//out while fg fades in
+	int fg = 0, pending = -1, fading = -1;
+	std::chrono::steady_clock::time_point fadeStart;
+	
+	//finds out what the lane plays. a song that has started gets its
+	//gain for the target loudness if it has been measured by then; while
+	//crossfading, the fade applies it
+	auto follow = [&](Lane& lane) {
+		if( !lane.song.update() ) {
+			return;
+		}
+		lane.level = 1;
+		if( loudness ) {
+			loudness->gain( load.songName( lane.song.current() ), lane.level );
+			lane.level = std::min( lane.level, maxLevel );
+		}
+		if( fading < 0 ) {
+			lane.source->setGain( gain * lane.level );
+		}
+	};
+	
+	//fills spare buffers with decoded chunks and queues them on the
+	//chunks' lanes, all of a lane's at once. waits for the first wait
+	//chunks, takes the rest if ready. a chunk whose lane has no spare
+	//buffer waits in the ring
+	auto refill = [&](uint wait) {
+		PcmChunk* chunk;
+		while( true ) {
+			if( wait > 0 ) {
+				Stats::Timer timer( stats.get(), Stats::WaitData );
+				if( !ring.waitReadable() ) {
+					break;
+				}
+			}
+			if( !(chunk = ring.readSlot()) ) {
+				break;
+			}
+			if( chunk->epoch == epoch ) {
+				Lane& lane = lanes[chunk->lane];
+				if( lane.spare.empty() ) {
+					break;
+				}
+				//a song in another format or rate waits until the lane has
+				//played everything queued, then the source starts over
+				ALenum format = formats.alFormat( chunk->channels, chunk->format );
+				if( format != lane.format || chunk->freq != lane.freq ) {
+					if( !lane.uploaded.empty() || lane.source->getAttachedBuffers() > 0 ) {
+						break;
+					}
+					lane.restart = lane.format != 0;
+					lane.format = format;
+					lane.freq = chunk->freq;
+				}
+				//the incoming song starts when everything queued before it
+				//has been played
+				if( chunk->fadeIn ) {
+					pending = chunk->lane;
+					fadeStart = std::chrono::steady_clock::now() + toDuration( sched.remaining( fg ) );
+				}
+				upload( al.findBuffer( lane.spare.back() ), formats, *chunk, stats.get() );
+				lane.uploaded.push_back( lane.spare.back() );
+				lane.spare.pop_back();
+				sched.queue( chunk->size / chunk->frameSize, chunk->freq, chunk->lane );
+				lane.song.push( *chunk );
+				if( wait > 0 ) {
+					wait--;
+				}
+			}
+			ring.commitRead();
+		}
+		for( auto& lane : lanes ) {
+			lane.source->attachBuffers( lane.uploaded.data(), lane.uploaded.size() );
+			lane.uploaded.clear();
+		}
+	};
+	refill( numBuffers );
+	if( lanes[fg].spare.size() == (uint) numBuffers ) {
+		std::cerr << "Nothing to play." << std::endl;
+		threadLoadAudio.join();
+		return EXIT_FAILURE;
 	}
 	
+	follow( lanes[fg] );
+	lanes[fg].source->play();
+	signal( SIGINT, onInterrupt );
+	
 	//main loop; plays untill all file have been played
-	//rotates the audio source around the listener for a certain effect
-	double t = 0.f;
-	ALfloat x, y, z;
-	while (al.sources[0].getState() == AL_PLAYING) {
-		al.sources[0].setPosition(
-			1 * cos(2 * PI * t / T),
-			1 * sin(2 * PI * t / T),
-			0.0f
-		).getPosition(&x, &y, &z);
-
-		usleep(100000);
+	//the animator rotates the audio source around the listener for a
+	//certain effect, unless it plays the songs' own channels (--no-spatial).
+	//wakes up when a buffer has been played or the status line is due;
+	//t counts tenths of seconds into the song, as played by the source
+	anim.setOrigin( std::chrono::steady_clock::now() - toDuration( startSeconds ) ).start();
+	double t = startSeconds * 10;
+	ALfloat x = 0, y = 0, z = 0;
+	long underruns = 0;
+	bool quit = false;
+	double target;
+	std::vector<bool> stopped( numLanes );
+	while( !quit && !interrupted ) {
+		std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+		follow( lanes[fg] );
+		t = lanes[fg].song.position() * 10;
+		//the animator's position is computed again for the status line
+		anim.setOrigin( now - toDuration( t / 10 ) );
+		if( spatial ) {
+			orbit( t / 10, x, y, z );
+		}
+
 		printf("\rt = %02.0f:%02.0f:%04.1f ( % 4.2f % 4.2f % 4.2f ) [% 4.0f°]", 
 			floor( t / (10 * 3600)), fmod(floor( t / (10*60)), 60) ,fmod(t / 10, 60), x, y, z, fmod(t, T) / T * 360
 		);
-		song.debugInfo();
+		lanes[fg].song.debugInfo();
 		fflush(stdout);
 		
-		//when the current buffer has been played, get a new one
-		//tell the 2nd thread to decode more audio
-		if( al.sources[0].getProcessedBuffers() > 0 ) {
-			std::unique_lock<std::mutex> lck( mutexLoader ); //threadState, load.audioBuffer/-size, song
-			if( threadState == -2 ) {
-				al.sources[0].attachBuffer(
-					al.findBuffer(al.sources[0].detachBuffer()).setData(
-						AL_FORMAT_MONO16, load.audioBuffer, load.size, load.getFreq()
-					)
-				);
-				
-				threadState = 1;
-				condResumeLoader.notify_one();
-			} else {
-				al.sources[0].detachBuffer();
+		//crossfade: the incoming song starts once the outgoing one has
+		//played up to the fade. the gains follow the playback clock, with
+		//equal power over the fade
+		if( pending >= 0 && now >= fadeStart ) {
+			fading = fg;
+			fg = pending;
+			pending = -1;
+			lanes[fg].source->setGain( 0 ).play();
+			follow( lanes[fg] );
+		}
+		if( fading >= 0 ) {
+			double p = std::min( 1.0, std::chrono::duration<double>( now - fadeStart ).count() / crossfade );
+			OpenAL::Batch batch( al );
+			lanes[fg].source->setGain( gain * lanes[fg].level * sin( p * M_PI_2 ) );
+			lanes[fading].source->setGain( gain * lanes[fading].level * cos( p * M_PI_2 ) );
+		}
+		
+		//when a buffer has been played, refill it with the next decoded
+		//chunk. buffers the decoder has nothing for yet are kept as spares
+		for( int l = 0; l < numLanes; l++ ) {
+			Lane& lane = lanes[l];
+			stopped[l] = lane.source->getState() != AL_PLAYING;
+			for( int n = lane.detach(); n > 0; n-- ) {
+				sched.unqueue( l );
+				lane.song.pop();
 			}
-			
-			if( song.change() ) {
-				t = 0;
+		}
+		refill( 0 );
+		
+		//a source stops when it runs out of buffers: either everything
+		//has been played or the decoder fell behind and it's restarted.
+		//the fading lane is done once it has played the outgoing song
+		for( int l = 0; l < numLanes; l++ ) {
+			Lane& lane = lanes[l];
+			if( !stopped[l] || l == pending ) {
+				continue;
+			}
+			if( lane.source->getAttachedBuffers() > 0 ) {
+				lane.source->play();
+				lane.song.restarted();
+				if( lane.restart ) {
+					lane.restart = false;
+					continue;
+				}
+				underruns++;
+				if( stats ) {
+					stats->add( Stats::Underruns );
+				}
+			} else if( l == fading ) {
+				lane.source->setGain( gain * lane.level );
+				lanes[fg].source->setGain( gain * lanes[fg].level );
+				fading = -1;
 			}
-			song.updateSongInfo();
 		}
-	
-		t++;
-	}
-	{
-		std::unique_lock<std::mutex> lck( mutexLoader );
-		threadState = 0;
-		condResumeLoader.notify_all();
+		if( stopped[fg] && lanes[fg].source->getAttachedBuffers() == 0 && pending < 0 && fading < 0 && ring.done() ) {
+			break;
+		}
+		
+		//seeking within the playing song: everything queued on the sources
+		//or waiting in the ring is dropped, and playback restarts with the
+		//first chunk the decoder has for the new position
+		if( readCommand( t / 10, target, quit ) ) {
+			Stats::Timer timer( stats.get(), Stats::Seek );
+			epoch = load.seek( lanes[fg].song.current(), target, restart );
+			if( restart ) {
+				threadLoadAudio.join();
+				ring.reopen();
+				threadLoadAudio = std::thread( threadLoadAudioData, std::ref(load), std::ref(ring), stats.get() );
+			}
+			for( auto& lane : lanes ) {
+				lane.source->stop().setGain( gain * lane.level );
+				lane.detach();
+				lane.song.clear();
+			}
+			sched.clear();
+			pending = fading = -1;
+			refill( 1 );
+			for( auto& lane : lanes ) {
+				lane.restart = false;
+			}
+			for( int l = 0; l < numLanes; l++ ) {
+				if( lanes[l].source->getAttachedBuffers() > 0 ) {
+					fg = l;
+				}
+			}
+			Lane& lane = lanes[fg];
+			if( lane.source->getAttachedBuffers() > 0 ) {
+				follow( lane );
+				lane.source->play();
+			}
+			continue;
+		}
+		
+		//the gains are ramped in steps of 10 ms
+		double wait = refresh / 1000.0;
+		if( pending >= 0 ) {
+			wait = std::min( wait, std::max( 0.0, std::chrono::duration<double>( fadeStart - now ).count() ) );
+		}
+		if( fading >= 0 ) {
+			wait = std::min( wait, 0.01 );
+		}
+		sched.wait( wait );
 	}
+	anim.stopAnimating();
+	ring.close();
 	threadLoadAudio.join();
+	if( stats ) {
+		stats->stopDump();
+	}
 
 	printf("\n");
+	if( cache ) {
+		std::cout << "PCM cache: " << cache->hits << " hits, " << cache->misses << " misses, "
+			<< cache->stored << " stored, " << cache->evicted << " evicted, "
+			<< cache->servedBytes / 1048576 << " MB served, ~"
+			<< std::setprecision(1) << std::fixed << cache->cpuSaved() << " s decoding saved" << std::endl;
+	}
+	if( prefetcher ) {
+		std::cout << prefetcher->report() << std::endl;
+	}
+	if( loudness ) {
+		std::cout << loudness->report() << std::endl;
+	}
+	#ifdef DEBUG
+	std::cout << "Decoded " << load.decodedFrames() << " frames with "
+		<< load.bufferAllocations() << " buffer allocations" << std::endl;
+	std::cout << underruns << " underruns" << std::endl;
+	//with a crossfade the songs overlap on purpose
+	if( numLanes == 1 ) {
+		for( long gap : lanes[0].song.boundaryGaps() ) {
+			std::cout << "Song boundary gap: " << gap << " samples" << std::endl;
+		}
+	}
+	std::cout << (sched.eventDriven() ? "Event" : "Offset") << " driven playback: "
+		<< sched.wakeupsPerSecond() << " wakeups/s, refill latency "
+		<< sched.meanRefillLatency() * 1000 << " ms mean, "
+		<< sched.peakRefillLatency() * 1000 << " ms max" << std::endl;
+	std::cout << "Animation: " << anim.json() << std::endl;
+	std::cout << "Output latency " << lanes[fg].song.outputLatency() * 1000 << " ms" << std::endl;
+	#endif
+	
+	//where to resume: the position if playback was quit, nothing if
+	//everything has been played
+	if( !resumeFile.empty() ) {
+		if( quit || interrupted ) {
+			std::ofstream resume( resumeFile );
+			resume << std::fixed << std::setprecision(1) << t / 10 << '\t' << load.songName( lanes[fg].song.current() ) << std::endl;
+		} else {
+			unlink( resumeFile.c_str() );
+		}
+	}
+	
+	//stop probing and measuring and keep what was found out for the next
+	//start
+	load.close();
+	loudness.reset();
+	if( index && !index->save() ) {
+		std::cerr << "Couldn't save library index " << indexFile << std::endl;
+	}
 	return EXIT_SUCCESS;
 }